@@ -66,14 +66,14 @@ void init_SPI2(uint16_t config){
 void SPI1_set_clock_div(uint8_t divider){
 	if(divider > 7){return;}
 	SPI1->CR1 &=~ SPI_CR1_BR;
-	SPI1->CR1 |= divider;
+	SPI1->CR1 |= (uint16_t)divider << SPI_CR1_BR_Pos;
 }
 
 // change the SPI clock speed by changing the clock divider
 void SPI2_set_clock_div(uint8_t divider){
 	if(divider > 7){return;}
 	SPI2->CR1 &=~ SPI_CR1_BR;
-	SPI2->CR1 |= divider;
+	SPI2->CR1 |= (uint16_t)divider << SPI_CR1_BR_Pos;
 }
 
 // send one/two byte(s) to the slave and receive one/two byte(s)
@@ -84,8 +84,8 @@ uint16_t SPI1_transmit(uint16_t tx_data){
 	uint32_t t1 = sysTick_Time;
 	while( !(SPI1->SR & SPI_SR_TXE) ){
 		// check time to prevent getting stuck in the loop in case of an error
-		// exit loop after 0.1s if nothing happens
-		if( sysTick_Time > (t1+100) ){
+		// exit loop after 0.1s if nothing happens (the difference is correct when the counter wraps)
+		if( (uint32_t)(sysTick_Time - t1) > 100 ){
 			SPI1_error = 1;
 			return 0xFFFF;
 		}
@@ -93,8 +93,8 @@ uint16_t SPI1_transmit(uint16_t tx_data){
 	// wait until the response has been received
 	while( !(SPI1->SR & SPI_SR_RXNE) ){
 		// check time to prevent getting stuck in the loop in case of an error
-		// exit loop after 0.1s if nothing happens
-		if( sysTick_Time > (t1+100) ){
+		// exit loop after 0.1s if nothing happens (the difference is correct when the counter wraps)
+		if( (uint32_t)(sysTick_Time - t1) > 100 ){
 			SPI1_error = 1;
 			return 0xFFFF;
 		}
@@ -111,8 +111,8 @@ uint16_t SPI2_transmit(uint16_t tx_data){
 	uint32_t t1 = sysTick_Time;
 	while( !(SPI2->SR & SPI_SR_TXE) ){
 		// check time to prevent getting stuck in the loop in case of an error
-		// exit loop after 0.1s if nothing happens
-		if( sysTick_Time > (t1+100) ){
+		// exit loop after 0.1s if nothing happens (the difference is correct when the counter wraps)
+		if( (uint32_t)(sysTick_Time - t1) > 100 ){
 			SPI2_error = 1;
 			return 0xFFFF;
 		}
@@ -120,8 +120,8 @@ uint16_t SPI2_transmit(uint16_t tx_data){
 	// wait until the response has been received
 	while( !(SPI2->SR & SPI_SR_RXNE) ){
 		// check time to prevent getting stuck in the loop in case of an error
-		// exit loop after 0.1s if nothing happens
-		if( sysTick_Time > (t1+100) ){
+		// exit loop after 0.1s if nothing happens (the difference is correct when the counter wraps)
+		if( (uint32_t)(sysTick_Time - t1) > 100 ){
 			SPI2_error = 1;
 			return 0xFFFF;
 		}
@@ -130,12 +130,615 @@ uint16_t SPI2_transmit(uint16_t tx_data){
 	return (uint16_t) SPI2->DR;
 }
 
+/*	fast polling mode for whole buffers
+ *
+ *	SPIx_transmit() reads the volatile sysTick_Time for every byte. Here the
+ *	next byte is written as soon as the transmit buffer is empty, so the
+ *	shift register never runs dry (up to 36MHz with SPI_BAUD_DIV_2), and the
+ *	wait loops only count down a spin budget held in a register: the transfer
+ *	is aborted when a byte doesn't complete within it, without any access to
+ *	the system time.
+ *	With the next byte queued, the received one has to be read within one byte
+ *	time, or it is overwritten (OVR) and the bytes shift. So the buffer is
+ *	clocked in bursts of max. SPI_IRQ_LOCK_CYCLES with the interrupts masked,
+ *	each burst ends with an empty pipeline and interrupts are served in between.
+ */
+
+// number of frames of <frame_bits> that fit into SPI_IRQ_LOCK_CYCLES at the current clock (at least 1)
+static uint32_t burst_frames(SPI_TypeDef* SPI, uint8_t frame_bits){
+	// f_SPI = 72MHz / 2^(BR+1)
+	uint32_t cycles = (uint32_t)frame_bits << (((SPI->CR1 & SPI_CR1_BR) >> SPI_CR1_BR_Pos) + 1);
+	uint32_t frames = SPI_IRQ_LOCK_CYCLES / cycles;
+	return frames ? frames : 1;
+}
+
+// clock <length> bytes back-to-back (called with the interrupts masked)
+static bool pipelined_burst(SPI_TypeDef* SPI, const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length){
+	uint32_t spins = SPI_WATCHDOG_SPINS;
+	SPI->DR = tx_buf ? tx_buf[0] : 0xFF;
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		if(byte_counter + 1 < length){
+			// the byte is moved into the shift register: queue the next one
+			while( !(SPI->SR & SPI_SR_TXE) ){
+				if(--spins == 0) return false;
+			}
+			SPI->DR = tx_buf ? tx_buf[byte_counter + 1] : 0xFF;
+		}
+		while( !(SPI->SR & SPI_SR_RXNE) ){
+			if(--spins == 0) return false;
+		}
+		uint8_t rx_data = (uint8_t) SPI->DR;
+		if(rx_buf) rx_buf[byte_counter] = rx_data;
+		// rearm the watchdog, the next byte gets the full budget again
+		spins = SPI_WATCHDOG_SPINS;
+	}
+	return true;
+}
+
+static bool polled_transfer(SPI_TypeDef* SPI, const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length){
+	uint32_t burst = burst_frames(SPI, 8);
+	// discard a byte that might be left in the receive buffer
+	(void) SPI->DR;
+	while(length > 0){
+		uint32_t count = (length > burst) ? burst : length;
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		bool ok = pipelined_burst(SPI, tx_buf, rx_buf, count);
+		__set_PRIMASK(primask);
+		if(!ok) return false;
+		if(tx_buf) tx_buf += count;
+		if(rx_buf) rx_buf += count;
+		length -= count;
+	}
+	return true;
+}
+
+/* send and receive <length> bytes on SPI1 without a timeout check for every byte
+arguments:		tx_buf		=	bytes to send, or NULL to send 0xFF (e.g. when only reading)
+				rx_buf		=	buffer for the received bytes, or NULL to discard them
+returns false (and sets SPI1_error) if the bus got stuck
+NOTE: SPI1 must be configured for 8bit frames */
+bool SPI1_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length){
+	if( polled_transfer(SPI1, tx_buf, rx_buf, length) ) return true;
+	SPI1_error = 1;
+	return false;
+}
+
+// same as SPI1_transfer(), for SPI2
+bool SPI2_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length){
+	if( polled_transfer(SPI2, tx_buf, rx_buf, length) ) return true;
+	SPI2_error = 1;
+	return false;
+}
+
+/*	16bit frames for long buffers
+ *
+ *	two bytes are clocked per frame (MSB first, so the first byte is the high
+ *	byte), which halves the accesses to DR and SR and the DMA requests. The
+ *	frame format can only be changed while the peripheral is disabled, so it
+ *	is switched back to 8bit frames right after the data phase (CS can stay low,
+ *	the clock just pauses). An odd last byte is sent with an 8bit frame.
+ */
+
+// switch between 8bit and 16bit frames, returns false if the last frame doesn't finish
+static bool set_16bit_frames(SPI_TypeDef* SPI, bool enable){
+	uint32_t spins = SPI_WATCHDOG_SPINS;
+	while( SPI->SR & SPI_SR_BSY ){
+		if(--spins == 0) return false;
+	}
+	SPI->CR1 &=~ SPI_CR1_SPE;
+	if(enable){
+		SPI->CR1 |= SPI_CR1_DFF;
+	}else{
+		SPI->CR1 &=~ SPI_CR1_DFF;
+	}
+	SPI->CR1 |= SPI_CR1_SPE;
+	return true;
+}
+
+// clock <frames> 16bit frames back-to-back (called with the interrupts masked)
+static bool pipelined_burst16(SPI_TypeDef* SPI, const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t frames){
+	uint32_t spins = SPI_WATCHDOG_SPINS;
+	SPI->DR = tx_buf ? ((uint16_t)tx_buf[0] << 8) | tx_buf[1] : 0xFFFF;
+	for(uint32_t frame = 0; frame<frames; frame++){
+		if(frame + 1 < frames){
+			while( !(SPI->SR & SPI_SR_TXE) ){
+				if(--spins == 0) return false;
+			}
+			SPI->DR = tx_buf ? ((uint16_t)tx_buf[2*frame + 2] << 8) | tx_buf[2*frame + 3] : 0xFFFF;
+		}
+		while( !(SPI->SR & SPI_SR_RXNE) ){
+			if(--spins == 0) return false;
+		}
+		uint16_t rx_data = (uint16_t) SPI->DR;
+		if(rx_buf){
+			rx_buf[2*frame] = (uint8_t)(rx_data >> 8);
+			rx_buf[2*frame + 1] = (uint8_t)rx_data;
+		}
+		spins = SPI_WATCHDOG_SPINS;
+	}
+	return true;
+}
+
+static bool polled_transfer16(SPI_TypeDef* SPI, const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length){
+	if(length < SPI_16BIT_MIN_LENGTH) return polled_transfer(SPI, tx_buf, rx_buf, length);
+	if( !set_16bit_frames(SPI, true) ) return false;
+	uint32_t burst = burst_frames(SPI, 16);
+	uint32_t frames = length / 2;
+	const uint8_t* tx_ptr = tx_buf;
+	uint8_t* rx_ptr = rx_buf;
+	bool ok = true;
+	// discard a frame that might be left in the receive buffer
+	(void) SPI->DR;
+	while( ok && (frames > 0) ){
+		uint32_t count = (frames > burst) ? burst : frames;
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		ok = pipelined_burst16(SPI, tx_ptr, rx_ptr, count);
+		__set_PRIMASK(primask);
+		if(tx_ptr) tx_ptr += 2*count;
+		if(rx_ptr) rx_ptr += 2*count;
+		frames -= count;
+	}
+	if( !set_16bit_frames(SPI, false) || !ok ) return false;
+	if(length & 1) return polled_transfer(SPI, tx_buf ? &tx_buf[length - 1] : NULL, rx_buf ? &rx_buf[length - 1] : NULL, 1);
+	return true;
+}
+
+/* same as SPI1_transfer(), but with 16bit frames for the bulk of the buffer (if it has
+at least SPI_16BIT_MIN_LENGTH bytes); SPI1 is back in 8bit mode afterwards */
+bool SPI1_transfer16(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length){
+	if( polled_transfer16(SPI1, tx_buf, rx_buf, length) ) return true;
+	SPI1_error = 1;
+	return false;
+}
+
+// same as SPI1_transfer16(), for SPI2
+bool SPI2_transfer16(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length){
+	if( polled_transfer16(SPI2, tx_buf, rx_buf, length) ) return true;
+	SPI2_error = 1;
+	return false;
+}
+
+/*	DMA mode
+ *
+ *	a whole buffer is clocked out/in with a single DMA transfer:
+ *	one DMA1 channel feeds the SPI data register (TX) and another one
+ *	empties it (RX). The RX channel is the last one to finish, so its
+ *	"transfer complete" interrupt marks the end of the transfer.
+ *		SPI1:	DMA1 channel 2 = SPI1_RX, DMA1 channel 3 = SPI1_TX
+ *		SPI2:	DMA1 channel 4 = SPI2_RX, DMA1 channel 5 = SPI2_TX (only with SPI2_USE_DMA)
+ */
+
+// DMA channels and state of the DMA transfer currently running on one SPI peripheral
+typedef struct {
+	SPI_TypeDef* SPI;
+	DMA_Channel_TypeDef* rx_channel;
+	DMA_Channel_TypeDef* tx_channel;
+	// position of the flags of the RX channel in DMA1->ISR, the ones of the TX channel follow
+	uint8_t flags_pos;
+	uint8_t* error;
+	volatile bool active;
+	void (*callback)(void);
+	// 16bit frames: switch back to 8bit frames at the end
+	bool frames16;
+	// transaction queue: the transactions from <head> to <tail>, the one at <head> is running
+	SPI_transaction_t* volatile queue[SPI_QUEUE_LENGTH];
+	volatile uint8_t head;
+	volatile uint8_t tail;
+	// slave mode: circular buffers of two frames each, <frame_callback> is set while it's running
+	void (*frame_callback)(uint8_t* rx_frame, uint8_t* tx_frame);
+	uint8_t* slave_rx_buf;
+	uint8_t* slave_tx_buf;
+	uint16_t frame_length;
+} SPI_DMA_t;
+
+static void slave_frame_done(SPI_DMA_t* bus);
+
+static SPI_DMA_t SPI1_DMA = {.SPI = SPI1, .rx_channel = DMA1_Channel2, .tx_channel = DMA1_Channel3, .flags_pos = 4, .error = &SPI1_error};
+#if SPI2_USE_DMA
+static SPI_DMA_t SPI2_DMA = {.SPI = SPI2, .rx_channel = DMA1_Channel4, .tx_channel = DMA1_Channel5, .flags_pos = 12, .error = &SPI2_error};
+#endif
+// byte that is sent when no TX buffer is given (e.g. when only reading)
+static const uint16_t SPI_DMA_tx_dummy = 0xFFFF;
+// received bytes go here when no RX buffer is given (e.g. when only writing)
+static uint16_t SPI_DMA_rx_dummy;
+
+// enable the DMA controller and route the channels of <bus> to its data register
+static void init_DMA(SPI_DMA_t* bus, IRQn_Type rx_IRQ){
+	// enable DMA1 clock
+	RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+	// both channels transfer between memory and the SPI data register
+	bus->rx_channel->CPAR = (uint32_t) (&(bus->SPI->DR));
+	bus->tx_channel->CPAR = (uint32_t) (&(bus->SPI->DR));
+	bus->head = 0;
+	bus->tail = 0;
+	// enable the interrupt of the RX channel
+	NVIC_EnableIRQ(rx_IRQ);
+	// globally enable interrupts
+	__enable_irq();
+}
+
+/* <length> = number of frames, <frame_size> = 0 for 8bit or DMA_CCR_PSIZE_0 | DMA_CCR_MSIZE_0 for 16bit frames
+(the SPI peripheral has to be configured for that frame size) */
+static void DMA_transfer(SPI_DMA_t* bus, const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, uint32_t frame_size, void (*callback)(void)){
+	if(length == 0){
+		if(callback) callback();
+		return;
+	}
+	bus->active = true;
+	bus->callback = callback;
+	// the channels can only be configured while they are disabled
+	bus->rx_channel->CCR = 0;
+	bus->tx_channel->CCR = 0;
+	// discard a byte that might be left in the receive buffer from polling mode
+	(void) bus->SPI->DR;
+	// set the number of bytes to be transferred
+	bus->rx_channel->CNDTR = length;
+	bus->tx_channel->CNDTR = length;
+	// RX channel: peripheral -> memory, 8bit or 16bit on both sides, very high priority
+	// so that the received bytes are fetched before the next one arrives (overrun)
+	// enable transfer complete and transfer error interrupt
+	if(rx_buf){
+		bus->rx_channel->CMAR = (uint32_t) rx_buf;
+		bus->rx_channel->CCR = DMA_CCR_MINC;
+	}else{
+		bus->rx_channel->CMAR = (uint32_t) (&SPI_DMA_rx_dummy);
+	}
+	bus->rx_channel->CCR |= frame_size | DMA_CCR_PL_1 | DMA_CCR_PL_0 | DMA_CCR_TCIE | DMA_CCR_TEIE;
+	// TX channel: memory -> peripheral, same frame size, high priority
+	if(tx_buf){
+		bus->tx_channel->CMAR = (uint32_t) tx_buf;
+		bus->tx_channel->CCR = DMA_CCR_MINC;
+	}else{
+		bus->tx_channel->CMAR = (uint32_t) (&SPI_DMA_tx_dummy);
+	}
+	bus->tx_channel->CCR |= frame_size | DMA_CCR_DIR | DMA_CCR_PL_1;
+	// clear old interrupt flags of both channels
+	DMA1->IFCR = (DMA_IFCR_CGIF1 | DMA_IFCR_CGIF2) << bus->flags_pos;
+	// enable the channels, RX first so that no received byte gets lost
+	bus->rx_channel->CCR |= DMA_CCR_EN;
+	bus->tx_channel->CCR |= DMA_CCR_EN;
+	// let the SPI peripheral generate DMA requests, this starts the transfer
+	bus->SPI->CR2 |= SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+}
+
+// called by the interrupt of the RX channel when the last byte has been received
+static void DMA_transfer_done(SPI_DMA_t* bus){
+	if(bus->frame_callback){
+		slave_frame_done(bus);
+		return;
+	}
+	uint32_t flags = DMA1->ISR >> bus->flags_pos;
+	// clear the interrupt flags
+	DMA1->IFCR = (DMA_IFCR_CGIF1 | DMA_IFCR_CGIF2) << bus->flags_pos;
+	if( flags & (DMA_ISR_TCIF1 | DMA_ISR_TEIF1) ){
+		if( flags & DMA_ISR_TEIF1 ){
+			*bus->error = 1;
+		}
+		// stop the DMA requests and disable both channels
+		bus->SPI->CR2 &=~ (SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+		bus->rx_channel->CCR &=~ DMA_CCR_EN;
+		bus->tx_channel->CCR &=~ DMA_CCR_EN;
+		if(bus->frames16){
+			// the bytes stay swapped in pairs, SPIx_DMA_order16() is up to the consumer
+			bus->frames16 = false;
+			if( !set_16bit_frames(bus->SPI, false) ) *bus->error = 1;
+		}
+		bus->active = false;
+		// the callback may already start the next transfer
+		if(bus->callback) bus->callback();
+	}
+}
+
+// enable the DMA controller and route its SPI1 channels to the SPI1 data register
+// call this after init_SPI1()
+void init_SPI1_DMA(void){
+	init_DMA(&SPI1_DMA, DMA1_Channel2_IRQn);
+}
+
+/* start a DMA transfer of <length> bytes on SPI1 and return immediately
+arguments:		tx_buf		=	bytes to send, or NULL to send 0xFF (e.g. when only reading)
+				rx_buf		=	buffer for the received bytes, or NULL to discard them
+				length		=	number of bytes to transfer (1...65535)
+				callback	=	function called from the interrupt when the transfer is finished, or NULL
+NOTE: the chip select line is not touched here, this is up to the caller
+      SPI1 must be configured for 8bit frames */
+void SPI1_DMA_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void)){
+	DMA_transfer(&SPI1_DMA, tx_buf, rx_buf, length, 0, callback);
+}
+
+/* receive a buffer with 16bit frames (half the DMA requests). The first byte of each frame
+is the high byte, so it ends up second in memory: the consumer puts the bytes in order with
+SPIx_DMA_order16() outside of the interrupt, when it takes the data.
+Writes, odd lengths, short or unaligned buffers use 8bit frames, since the bytes to send
+would have to be swapped in the caller's buffer */
+static bool DMA_frames16(const uint8_t* tx_buf, const uint8_t* rx_buf, uint16_t length){
+	return !tx_buf && !(length & 1) && (length >= SPI_16BIT_MIN_LENGTH) && !((uint32_t)rx_buf & 1);
+}
+
+static void DMA_transfer16(SPI_DMA_t* bus, const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void)){
+	if( !DMA_frames16(tx_buf, rx_buf, length) ){
+		DMA_transfer(bus, tx_buf, rx_buf, length, 0, callback);
+		return;
+	}
+	if( !set_16bit_frames(bus->SPI, true) ){
+		// the bytes won't be swapped, so SPIx_DMA_order16() would mix them up
+		*bus->error = 1;
+		DMA_transfer(bus, tx_buf, rx_buf, length, 0, callback);
+		return;
+	}
+	bus->frames16 = true;
+	DMA_transfer(bus, NULL, rx_buf, length / 2, DMA_CCR_PSIZE_0 | DMA_CCR_MSIZE_0, callback);
+}
+
+// swap the bytes of each 16bit frame of a buffer received by DMA_transfer16()
+// (does nothing if it was received with 8bit frames), two frames per word with REV16
+static void DMA_order16(uint8_t* rx_buf, uint16_t length){
+	if( !rx_buf || !DMA_frames16(NULL, rx_buf, length) ) return;
+	uint16_t* frames = (uint16_t*) rx_buf;
+	uint32_t count = length / 2;
+	if( (uint32_t)frames & 2 ){
+		*frames = (uint16_t) __REV16(*frames);
+		frames++;
+		count--;
+	}
+	uint32_t* words = (uint32_t*) frames;
+	for(uint32_t word = 0; word < count/2; word++){
+		words[word] = __REV16(words[word]);
+	}
+	if(count & 1){
+		frames[count - 1] = (uint16_t) __REV16(frames[count - 1]);
+	}
+}
+
+// same as SPI1_DMA_transfer(), with 16bit frames if possible (see DMA_transfer16())
+// the received bytes are only in order after SPI1_DMA_order16()
+void SPI1_DMA_transfer16(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void)){
+	DMA_transfer16(&SPI1_DMA, tx_buf, rx_buf, length, callback);
+}
+
+// put the bytes of a finished SPI1_DMA_transfer16() in order, same <rx_buf> and <length>
+// call it from the consumer of the data, not from the DMA interrupt
+void SPI1_DMA_order16(uint8_t* rx_buf, uint16_t length){
+	DMA_order16(rx_buf, length);
+}
+
+// check if a DMA transfer on SPI1 is still running
+bool SPI1_DMA_busy(void){
+	return SPI1_DMA.active;
+}
+
+// this is triggered when the last byte of a SPI1 DMA transfer has been received
+void DMA1_Channel2_IRQHandler(){
+	DMA_transfer_done(&SPI1_DMA);
+}
+
+#if SPI2_USE_DMA
+// enable the DMA controller and route its SPI2 channels to the SPI2 data register
+// call this after init_SPI2()
+void init_SPI2_DMA(void){
+	init_DMA(&SPI2_DMA, DMA1_Channel4_IRQn);
+}
+
+// same as SPI1_DMA_transfer(), for SPI2
+void SPI2_DMA_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void)){
+	DMA_transfer(&SPI2_DMA, tx_buf, rx_buf, length, 0, callback);
+}
+
+// same as SPI1_DMA_transfer16(), for SPI2
+void SPI2_DMA_transfer16(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void)){
+	DMA_transfer16(&SPI2_DMA, tx_buf, rx_buf, length, callback);
+}
+
+// same as SPI1_DMA_order16(), for SPI2
+void SPI2_DMA_order16(uint8_t* rx_buf, uint16_t length){
+	DMA_order16(rx_buf, length);
+}
+
+// check if a DMA transfer on SPI2 is still running
+bool SPI2_DMA_busy(void){
+	return SPI2_DMA.active;
+}
+
+// this is triggered when the last byte of a SPI2 DMA transfer has been received
+void DMA1_Channel4_IRQHandler(){
+	DMA_transfer_done(&SPI2_DMA);
+}
+#endif
+
+/*	transaction queue
+ *
+ *	each transaction selects its device (CS low), runs as one DMA transfer and
+ *	deselects the device again. The next transaction in the queue is started
+ *	from the DMA interrupt right after that, so several devices can share a bus
+ *	without the CPU waiting or copying anything.
+ */
+
+static void start_transaction(SPI_DMA_t* bus, void (*done)(void)){
+	SPI_transaction_t* transaction = bus->queue[bus->head];
+	if(transaction->CS_port) transaction->CS_port->BSRR = (uint32_t)1 << (transaction->CS_pin + 16);
+	DMA_transfer(bus, transaction->tx_buf, transaction->rx_buf, transaction->length, 0, done);
+}
+
+// called from the DMA interrupt (or directly for a transaction of length 0)
+static void transaction_done(SPI_DMA_t* bus, void (*done)(void)){
+	SPI_transaction_t* transaction = bus->queue[bus->head];
+	if(transaction->CS_port) transaction->CS_port->BSRR = (uint32_t)1 << transaction->CS_pin;
+	bus->head = (bus->head + 1) & (SPI_QUEUE_LENGTH - 1);
+	// start the next transaction first, the callback may queue another one
+	if(bus->head != bus->tail) start_transaction(bus, done);
+	transaction->done = true;
+	if(transaction->callback) transaction->callback(transaction);
+}
 
+static bool queue_transaction(SPI_DMA_t* bus, SPI_transaction_t* transaction, void (*done)(void)){
+	transaction->done = false;
+	// the DMA interrupt removes transactions from the queue
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t next_tail = (bus->tail + 1) & (SPI_QUEUE_LENGTH - 1);
+	if(next_tail == bus->head){
+		__set_PRIMASK(primask);
+		return false;
+	}
+	bool idle = (bus->head == bus->tail);
+	bus->queue[bus->tail] = transaction;
+	bus->tail = next_tail;
+	__set_PRIMASK(primask);
+	// if the bus is idle, nothing else can start it
+	if(idle) start_transaction(bus, done);
+	return true;
+}
 
+static void SPI1_transaction_done(void){
+	transaction_done(&SPI1_DMA, SPI1_transaction_done);
+}
 
+/* queue a transaction on SPI1 (call init_SPI1_DMA() first), it is started right away if the bus is idle
+<transaction> must stay valid until its <done> flag is set or its callback is called
+returns false if the queue is full
+NOTE: SPI1_transmit() and SPI1_DMA_transfer() must not be used while the queue is not idle */
+bool SPI1_queue_transaction(SPI_transaction_t* transaction){
+	return queue_transaction(&SPI1_DMA, transaction, SPI1_transaction_done);
+}
 
+// check if all transactions queued on SPI1 are finished
+bool SPI1_queue_idle(void){
+	return SPI1_DMA.head == SPI1_DMA.tail;
+}
 
+#if SPI2_USE_DMA
+static void SPI2_transaction_done(void){
+	transaction_done(&SPI2_DMA, SPI2_transaction_done);
+}
 
+// same as SPI1_queue_transaction(), for SPI2 (call init_SPI2_DMA() first)
+bool SPI2_queue_transaction(SPI_transaction_t* transaction){
+	return queue_transaction(&SPI2_DMA, transaction, SPI2_transaction_done);
+}
 
+// check if all transactions queued on SPI2 are finished
+bool SPI2_queue_idle(void){
+	return SPI2_DMA.head == SPI2_DMA.tail;
+}
+#endif
 
+/*	slave mode with DMA
+ *
+ *	the master selects the slave with its hardware NSS pin, so the slave only
+ *	shifts while NSS is low. The data is moved by two circular DMA channels,
+ *	each one over a buffer of two frames of <frame_length> bytes: while one half
+ *	is being received/sent, the other one belongs to the application. The RX
+ *	channel's half and full transfer interrupts mark the frame boundaries, the
+ *	callback then gets the frame that has just been received and the half of the
+ *	TX buffer that can be filled with the frame sent after the next one.
+ *	There is no CPU work for the single bytes. The master has to clock whole
+ *	frames, otherwise the slave has to be initialized again to get in step.
+ */
+
+static void init_slave(SPI_DMA_t* bus, IRQn_Type rx_IRQ, uint16_t config, uint8_t* rx_buf, uint8_t* tx_buf,
+		uint16_t frame_length, void (*frame_callback)(uint8_t* rx_frame, uint8_t* tx_frame)){
+	bus->SPI->CR1 = 0;
+	bus->SPI->CR2 = 0;
+	init_DMA(bus, rx_IRQ);
+	bus->slave_rx_buf = rx_buf;
+	bus->slave_tx_buf = tx_buf;
+	bus->frame_length = frame_length;
+	bus->frame_callback = frame_callback;
+	bus->rx_channel->CCR = 0;
+	bus->tx_channel->CCR = 0;
+	bus->rx_channel->CNDTR = 2*frame_length;
+	bus->tx_channel->CNDTR = 2*frame_length;
+	bus->rx_channel->CMAR = (uint32_t) rx_buf;
+	bus->tx_channel->CMAR = (uint32_t) tx_buf;
+	// RX channel: circular, very high priority, interrupts at the end of each half
+	bus->rx_channel->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_PL_1 | DMA_CCR_PL_0 | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_TEIE;
+	// TX channel: circular, high priority
+	bus->tx_channel->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_DIR | DMA_CCR_PL_1;
+	DMA1->IFCR = (DMA_IFCR_CGIF1 | DMA_IFCR_CGIF2) << bus->flags_pos;
+	bus->rx_channel->CCR |= DMA_CCR_EN;
+	bus->tx_channel->CCR |= DMA_CCR_EN;
+	// the first byte to send is loaded into DR by the TX DMA before the master starts clocking
+	bus->SPI->CR2 = SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN;
+	// slave mode (no MSTR), hardware NSS (no SSM), 8bit frames
+	bus->SPI->CR1 = (config & (SPI_CR1_CPOL | SPI_CR1_CPHA | SPI_CR1_LSBFIRST)) | SPI_CR1_SPE;
+}
 
+static void stop_slave(SPI_DMA_t* bus){
+	bus->SPI->CR1 &=~ SPI_CR1_SPE;
+	bus->SPI->CR2 = 0;
+	bus->rx_channel->CCR = 0;
+	bus->tx_channel->CCR = 0;
+	bus->frame_callback = NULL;
+}
+
+// called by the interrupt of the RX channel at the end of each half of the buffers
+static void slave_frame_done(SPI_DMA_t* bus){
+	uint32_t flags = DMA1->ISR >> bus->flags_pos;
+	DMA1->IFCR = (DMA_IFCR_CGIF1 | DMA_IFCR_CGIF2) << bus->flags_pos;
+	if( flags & DMA_ISR_TEIF1 ){
+		*bus->error = 1;
+		return;
+	}
+	// the full transfer flag belongs to the second half; if both are set (late interrupt) it's the newer one
+	uint16_t offset = (flags & DMA_ISR_TCIF1) ? bus->frame_length : 0;
+	if( flags & (DMA_ISR_HTIF1 | DMA_ISR_TCIF1) ){
+		bus->frame_callback(&bus->slave_rx_buf[offset], &bus->slave_tx_buf[offset]);
+	}
+}
+
+/* configure SPI1 as slave with hardware NSS and start receiving and sending frames
+arguments:		remap			=	remap the pins (PA15 NSS, PB3 SCK, PB4 MISO, PB5 MOSI instead of PA4...PA7)
+				config			=	(SPI_MODE_x | SPI_xSB_FIRST), the same as the master's
+				rx_buf, tx_buf	=	buffers of 2*<frame_length> bytes, tx_buf holds the first two frames to send
+				frame_callback	=	called from the interrupt for every frame received (see above)
+NOTE: SPI1 can't be used as master (e.g. for the W25Q64JV) at the same time */
+void init_SPI1_slave(bool remap, uint16_t config, uint8_t* rx_buf, uint8_t* tx_buf, uint16_t frame_length,
+		void (*frame_callback)(uint8_t* rx_frame, uint8_t* tx_frame)){
+	// enable the clocks for the SPI peripheral and AFIO
+	RCC->APB2ENR |= RCC_APB2ENR_SPI1EN | RCC_APB2ENR_AFIOEN;
+	if(remap){
+		RCC->APB2ENR |= RCC_APB2ENR_IOPAEN | RCC_APB2ENR_IOPBEN;
+		// PA15, PB3 and PB4 are JTAG pins after reset: keep only SWD
+		AFIO->MAPR |= AFIO_MAPR_SPI1_REMAP | AFIO_MAPR_SWJ_CFG_JTAGDISABLE;
+		// configure PA15(NSS1), PB3(SCK1) and PB5(MOSI1) as floating inputs
+		// and PB4(MISO1) as AFIO push-pull output
+		GPIOA->CRH &=~ (GPIO_CRH_MODE15 | GPIO_CRH_CNF15);
+		GPIOA->CRH |= GPIO_CRH_CNF15_0;
+		GPIOB->CRL &=~ (GPIO_CRL_MODE3 | GPIO_CRL_MODE4 | GPIO_CRL_MODE5 | GPIO_CRL_CNF3 | GPIO_CRL_CNF4 | GPIO_CRL_CNF5);
+		GPIOB->CRL |= GPIO_CRL_CNF3_0 | GPIO_CRL_MODE4 | GPIO_CRL_CNF4_1 | GPIO_CRL_CNF5_0;
+	}else{
+		RCC->APB2ENR |= RCC_APB2ENR_IOPAEN;
+		// configure PA4(NSS1), PA5(SCK1) and PA7(MOSI1) as floating inputs
+		// and PA6(MISO1) as AFIO push-pull output
+		GPIOA->CRL &=~ (GPIO_CRL_MODE4 | GPIO_CRL_MODE5 | GPIO_CRL_MODE6 | GPIO_CRL_MODE7 | GPIO_CRL_CNF4 | GPIO_CRL_CNF5 | GPIO_CRL_CNF6 | GPIO_CRL_CNF7);
+		GPIOA->CRL |= GPIO_CRL_CNF4_0 | GPIO_CRL_CNF5_0 | GPIO_CRL_MODE6 | GPIO_CRL_CNF6_1 | GPIO_CRL_CNF7_0;
+	}
+	init_slave(&SPI1_DMA, DMA1_Channel2_IRQn, config, rx_buf, tx_buf, frame_length, frame_callback);
+}
+
+// stop the slave mode of SPI1
+void SPI1_slave_stop(void){
+	stop_slave(&SPI1_DMA);
+}
+
+#if SPI2_USE_DMA
+/* same as init_SPI1_slave(), for SPI2 (PB12 NSS, PB13 SCK, PB14 MISO, PB15 MOSI) */
+void init_SPI2_slave(uint16_t config, uint8_t* rx_buf, uint8_t* tx_buf, uint16_t frame_length,
+		void (*frame_callback)(uint8_t* rx_frame, uint8_t* tx_frame)){
+	// enable the clocks for the SPI peripheral and the GPIO port
+	RCC->APB1ENR |= RCC_APB1ENR_SPI2EN;
+	RCC->APB2ENR |= RCC_APB2ENR_IOPBEN;
+	// configure PB12(NSS2), PB13(SCK2) and PB15(MOSI2) as floating inputs
+	// and PB14(MISO2) as AFIO push-pull output
+	GPIOB->CRH &=~ (GPIO_CRH_MODE12 | GPIO_CRH_CNF12 | GPIO_CRH_MODE13 | GPIO_CRH_CNF13 | GPIO_CRH_MODE14 | GPIO_CRH_CNF14 | GPIO_CRH_MODE15 | GPIO_CRH_CNF15);
+	GPIOB->CRH |= GPIO_CRH_CNF12_0 | GPIO_CRH_CNF13_0 | GPIO_CRH_MODE14 | GPIO_CRH_CNF14_1 | GPIO_CRH_CNF15_0;
+	init_slave(&SPI2_DMA, DMA1_Channel4_IRQn, config, rx_buf, tx_buf, frame_length, frame_callback);
+}
+
+// stop the slave mode of SPI2
+void SPI2_slave_stop(void){
+	stop_slave(&SPI2_DMA);
+}
+#endif
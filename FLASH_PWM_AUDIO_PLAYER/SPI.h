@@ -30,6 +30,14 @@
 #define SPI_16BIT_FRAME		SPI_CR1_DFF
 
 #define TIMEOUT 1
+// max. number of status register polls for one byte in SPIx_transfer(), then the bus is
+// considered stuck (a byte takes 2048 CPU cycles at SPI_BAUD_DIV_256, one poll at least 3)
+#define SPI_WATCHDOG_SPINS	1024
+// max. CPU cycles a burst of SPIx_transfer() and SPIx_transfer16() keeps the interrupts masked (4µs)
+#define SPI_IRQ_LOCK_CYCLES	288
+// buffers from this length on are transferred with 16bit frames by SPIx_transfer16() and
+// SPIx_DMA_transfer16(), switching the frame format isn't worth it for fewer bytes
+#define SPI_16BIT_MIN_LENGTH	16
 uint8_t SPI1_error, SPI2_error;
 
 void init_SPI1(bool remap, uint16_t config);
@@ -38,5 +46,57 @@ void SPI1_set_clock_div(uint8_t divider);
 void SPI2_set_clock_div(uint8_t divider);
 uint16_t SPI1_transmit(uint16_t tx_data);
 uint16_t SPI2_transmit(uint16_t tx_data);
+bool SPI1_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length);
+bool SPI2_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length);
+bool SPI1_transfer16(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length);
+bool SPI2_transfer16(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length);
+
+// DMA on SPI2 uses DMA1 channels 4 and 5, which are also the ones of USART1_TX and USART1_RX,
+// so it's only compiled if it's enabled here
+#ifndef SPI2_USE_DMA
+#define SPI2_USE_DMA		0
+#endif
+// size of the transaction queue of one bus (it holds up to SPI_QUEUE_LENGTH-1 transactions), a power of two
+#define SPI_QUEUE_LENGTH	8
+
+// one transfer on the bus with the chip select line of the device
+typedef struct SPI_transaction {
+	GPIO_TypeDef* CS_port;		// e.g. GPIOA, or NULL if the caller handles the chip select line
+	uint8_t CS_pin;				// 0...15
+	const uint8_t* tx_buf;		// bytes to send, or NULL to send 0xFF
+	uint8_t* rx_buf;			// buffer for the received bytes, or NULL to discard them
+	uint16_t length;			// number of bytes
+	// called from the interrupt after CS has been pulled high, or NULL
+	void (*callback)(struct SPI_transaction* transaction);
+	void* context;				// free for the caller
+	volatile bool done;			// set when the transaction is finished
+} SPI_transaction_t;
+
+// DMA mode for SPI1 (DMA1 channel 2 = SPI1_RX, DMA1 channel 3 = SPI1_TX)
+void init_SPI1_DMA(void);
+void SPI1_DMA_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void));
+void SPI1_DMA_transfer16(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void));
+void SPI1_DMA_order16(uint8_t* rx_buf, uint16_t length);
+bool SPI1_DMA_busy(void);
+bool SPI1_queue_transaction(SPI_transaction_t* transaction);
+bool SPI1_queue_idle(void);
+// slave mode with hardware NSS and circular DMA (see SPI.c)
+void init_SPI1_slave(bool remap, uint16_t config, uint8_t* rx_buf, uint8_t* tx_buf, uint16_t frame_length,
+		void (*frame_callback)(uint8_t* rx_frame, uint8_t* tx_frame));
+void SPI1_slave_stop(void);
+
+#if SPI2_USE_DMA
+// DMA mode for SPI2 (DMA1 channel 4 = SPI2_RX, DMA1 channel 5 = SPI2_TX)
+void init_SPI2_DMA(void);
+void SPI2_DMA_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void));
+void SPI2_DMA_transfer16(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void));
+void SPI2_DMA_order16(uint8_t* rx_buf, uint16_t length);
+bool SPI2_DMA_busy(void);
+bool SPI2_queue_transaction(SPI_transaction_t* transaction);
+bool SPI2_queue_idle(void);
+void init_SPI2_slave(uint16_t config, uint8_t* rx_buf, uint8_t* tx_buf, uint16_t frame_length,
+		void (*frame_callback)(uint8_t* rx_frame, uint8_t* tx_frame));
+void SPI2_slave_stop(void);
+#endif
 
 #endif /* SPI_H_ */
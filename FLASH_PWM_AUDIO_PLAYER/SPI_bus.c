@@ -0,0 +1,119 @@
+/*  bus manager for several devices on SPI1
+ *  for the STM32F103
+ *
+ *  see LICENCE.txt
+ */
+#include "SPI_bus.h"
+
+#define CYCLES_PER_US	72
+
+static SPI_device_t* devices[SPI_BUS_MAX_DEVICES];
+static uint8_t num_devices = 0;
+static SPI_device_t* volatile owner = NULL;
+// configuration of the SPI1 peripheral right now (SPI_CR1_BR, CPOL, CPHA and LSBFIRST bits)
+static uint16_t current_config = 0xFFFF;
+
+#define SPI_BUS_CONFIG_BITS	(SPI_CR1_BR | SPI_CR1_CPOL | SPI_CR1_CPHA | SPI_CR1_LSBFIRST)
+
+/* add <device> to the bus, call this once after init_SPI1()
+returns false if there are already SPI_BUS_MAX_DEVICES devices */
+bool SPI1_bus_register(SPI_device_t* device){
+	if(num_devices == SPI_BUS_MAX_DEVICES) return false;
+	device->waiting = false;
+	device->overruns = 0;
+	devices[num_devices++] = device;
+	// the cycle counter measures the hold times
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	return true;
+}
+
+// give the bus to <device> and switch SPI1 to its settings (interrupts disabled)
+static void grant(SPI_device_t* device){
+	owner = device;
+	device->waiting = false;
+	device->granted_at = DWT->CYCCNT;
+	if( (device->config & SPI_BUS_CONFIG_BITS) != current_config ){
+		current_config = device->config & SPI_BUS_CONFIG_BITS;
+		// the mode must not be changed while a frame is running, the previous owner is finished
+		while( SPI1->SR & SPI_SR_BSY );
+		SPI1->CR1 &=~ SPI_CR1_SPE;
+		SPI1->CR1 &=~ (SPI_CR1_CPOL | SPI_CR1_CPHA | SPI_CR1_LSBFIRST);
+		SPI1->CR1 |= device->config & (SPI_CR1_CPOL | SPI_CR1_CPHA | SPI_CR1_LSBFIRST);
+		SPI1_set_clock_div( (device->config & SPI_CR1_BR) >> SPI_CR1_BR_Pos );
+		SPI1->CR1 |= SPI_CR1_SPE;
+	}
+}
+
+/* ask for the bus and return immediately
+returns true if <device> owns the bus now, otherwise it is marked as waiting
+and gets the bus when it is released (in the order of the priorities) */
+bool SPI1_bus_request(SPI_device_t* device){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bool granted = (owner == device);
+	if( !granted && (owner == NULL) ){
+		granted = true;
+		for(uint8_t index = 0; index < num_devices; index++){
+			if( devices[index]->waiting && (devices[index]->priority > device->priority) ) granted = false;
+		}
+		if(granted) grant(device);
+	}
+	if(!granted) device->waiting = true;
+	__set_PRIMASK(primask);
+	return granted;
+}
+
+/* get the bus only if it's free right now and no device with a higher priority is waiting,
+returns false if it's in use (also by <device> itself). Unlike SPI1_bus_request(), <device>
+isn't marked as waiting, so the bus is never granted to it later without being asked again
+(e.g. for a timer tick that can simply try again at the next tick) */
+bool SPI1_bus_try(SPI_device_t* device){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bool granted = (owner == NULL);
+	for(uint8_t index = 0; granted && (index < num_devices); index++){
+		if( devices[index]->waiting && (devices[index]->priority > device->priority) ) granted = false;
+	}
+	if(granted) grant(device);
+	__set_PRIMASK(primask);
+	return granted;
+}
+
+// wait until <device> owns the bus
+void SPI1_bus_acquire(SPI_device_t* device){
+	while( !SPI1_bus_request(device) );
+}
+
+// give the bus back, the waiting device with the highest priority gets it
+void SPI1_bus_release(SPI_device_t* device){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(owner == device){
+		if( device->max_hold_us && ((uint32_t)(DWT->CYCCNT - device->granted_at) > (uint32_t)device->max_hold_us*CYCLES_PER_US) ){
+			device->overruns++;
+		}
+		owner = NULL;
+		SPI_device_t* next = NULL;
+		for(uint8_t index = 0; index < num_devices; index++){
+			if( devices[index]->waiting && ((next == NULL) || (devices[index]->priority > next->priority)) ) next = devices[index];
+		}
+		if(next) grant(next);
+	}
+	__set_PRIMASK(primask);
+}
+
+// check if <device> owns the bus
+bool SPI1_bus_owner(const SPI_device_t* device){
+	return owner == device;
+}
+
+/* number of bytes <device> can clock within its max_hold_us (at least 1),
+0xFFFFFFFF if there is no limit */
+uint32_t SPI1_bus_burst_length(const SPI_device_t* device){
+	if(device->max_hold_us == 0) return 0xFFFFFFFF;
+	// f_SPI = 72MHz / 2^(BR+1), 8 clocks per byte: 9 bytes per µs / 2^(BR+1)
+	uint8_t divider = (device->config & SPI_CR1_BR) >> SPI_CR1_BR_Pos;
+	uint32_t length = ((uint32_t)device->max_hold_us * 9) >> (divider + 1);
+	return length ? length : 1;
+}
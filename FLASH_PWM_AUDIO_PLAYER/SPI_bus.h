@@ -0,0 +1,52 @@
+/*  bus manager for several devices on SPI1
+ *  for the STM32F103
+ *
+ *	every device has its own clock divider and SPI mode, they are applied when
+ *	the device gets the bus. A device asks for the bus before it pulls its CS
+ *	line low and gives it back after CS went high:
+ *	- SPI1_bus_request() returns immediately, the bus is granted if it's free
+ *	  and no device with a higher priority is waiting for it
+ *	- SPI1_bus_acquire() waits until the bus is granted
+ *	- SPI1_bus_try() returns immediately and only takes a free bus, it never
+ *	  marks the device as waiting (for code that is interrupted, e.g. a timer tick)
+ *	- SPI1_bus_release() hands the bus to the waiting device with the highest
+ *	  priority (it can also be called from an interrupt, e.g. at the end of a
+ *	  DMA transfer)
+ *	a device must not hold the bus longer than its max_hold_us, so long transfers
+ *	have to be split into bursts of SPI1_bus_burst_length() bytes. A longer hold
+ *	is counted in <overruns> of the device.
+ *	NOTE: SPI1_bus_acquire() must not be called from an interrupt, the owner of
+ *	the bus might be the code that was interrupted. A device that got false from
+ *	SPI1_bus_request() must ask again until it gets the bus, it might already
+ *	have been granted to it.
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef SPI_BUS_H_
+#define SPI_BUS_H_
+
+#include "SPI.h"
+
+// max. number of devices on the bus
+#define SPI_BUS_MAX_DEVICES	4
+
+typedef struct {
+	uint16_t config;			// (SPI_BAUD_DIV_x | SPI_MODE_x | SPI_xSB_FIRST), like for init_SPI1()
+	uint8_t priority;			// the waiting device with the highest priority gets the bus first
+	uint16_t max_hold_us;		// max. time from getting the bus to releasing it, 0 = no limit
+	// managed by the bus manager
+	volatile bool waiting;
+	uint32_t granted_at;		// CPU cycle counter when the bus was granted
+	uint32_t overruns;			// number of times the bus was held longer than max_hold_us
+} SPI_device_t;
+
+bool SPI1_bus_register(SPI_device_t* device);
+bool SPI1_bus_request(SPI_device_t* device);
+bool SPI1_bus_try(SPI_device_t* device);
+void SPI1_bus_acquire(SPI_device_t* device);
+void SPI1_bus_release(SPI_device_t* device);
+bool SPI1_bus_owner(const SPI_device_t* device);
+uint32_t SPI1_bus_burst_length(const SPI_device_t* device);
+
+#endif /* SPI_BUS_H_ */
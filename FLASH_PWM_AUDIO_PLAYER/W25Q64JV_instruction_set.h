@@ -24,7 +24,7 @@
 #define WRITE_STATUS_REG_2			0x31
 #define READ_STATUS_REG_3			0x15
 #define WRITE_STATUS_REG_3			0x11
-#define READ_SFDP_REG				??
+#define READ_SFDP_REG				0x5A
 #define ERASE_SECURITY_REG			0x44
 #define PROGRAM_SECURITY_REG		0x42
 #define READ_SECURITY_REG			0x48
@@ -39,5 +39,6 @@
 #define ENABLE_RESET				0x66
 #define RESET_DEVICE				0x99
 #define STATUS_REG_1_BUSY_BIT		(1<<0)
+#define STATUS_REG_2_SUS_BIT		(1<<7)
 
 #endif /* W25Q64JV_INSTRUCTION_SET_H_ */
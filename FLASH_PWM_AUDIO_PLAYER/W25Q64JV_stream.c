@@ -0,0 +1,117 @@
+/*	sequential read-ahead streaming from the W25Q64JV
+ *
+ *  see LICENCE.txt
+ */
+#include "W25Q64JV_stream.h"
+
+// only one refill can run at a time as there is only one bus
+static W25Q64JV_stream_t* refill_stream = NULL;
+static volatile bool refill_active = false;
+// the refill is finished, but its bytes haven't been put in order yet
+static volatile bool refill_ready = false;
+static uint16_t refill_index;
+static uint16_t refill_length;
+static bool refill_suspended;
+
+// called from the DMA interrupt when the refill is finished
+static void refill_done(){
+	// CS high, a program/erase that was suspended for the refill continues, then the bus is free
+	// (the resume needs the bus, which can't be acquired in the interrupt)
+	end_read_W25Q64JV(refill_suspended);
+	refill_ready = true;
+	refill_active = false;
+}
+
+// put the bytes of a finished refill in order and hand them to the reader
+static void finish_refill(){
+	if(!refill_ready) return;
+	SPI_DMA_order(&refill_stream->buffer[refill_index], refill_length);
+	refill_stream->address += refill_length;
+	refill_stream->head += refill_length;
+	refill_ready = false;
+}
+
+// start reading from <address>, the stream ends after <length> bytes
+// (use W25Q64JV_geometry.size - address to read up to the end of the chip)
+void open_stream_W25Q64JV(W25Q64JV_stream_t* stream, uint32_t address, uint32_t length){
+	// a refill into this stream might still be running
+	while( refill_active );
+	finish_refill();
+	stream->address = address;
+	stream->remaining = length;
+	stream->head = 0;
+	stream->tail = 0;
+}
+
+// take over the bytes of a finished refill, then start the next one if there is enough space
+// in the buffer and the bus is free
+void service_stream_W25Q64JV(W25Q64JV_stream_t* stream){
+	if(refill_active || read_DMA_busy_W25Q64JV()) return;
+	finish_refill();
+	if(stream->remaining == 0) return;
+	uint32_t space = W25Q64JV_STREAM_BUFFER_SIZE - (stream->head - stream->tail);
+	if( (space < W25Q64JV_STREAM_MIN_REFILL) && (space < stream->remaining) ) return;
+	// the DMA fills a contiguous part of the buffer, i.e. up to the end of it
+	uint32_t index = stream->head % W25Q64JV_STREAM_BUFFER_SIZE;
+	uint32_t length = W25Q64JV_STREAM_BUFFER_SIZE - index;
+	if(length > space) length = space;
+	if(length > stream->remaining) length = stream->remaining;
+	// a refill must not hold a shared bus longer than allowed
+	if(length > max_read_burst_W25Q64JV()) length = max_read_burst_W25Q64JV();
+	stream->remaining -= length;
+	refill_stream = stream;
+	refill_index = index;
+	refill_length = length;
+	refill_active = true;
+	// a program/erase running in the background is suspended, so the samples don't have to wait for it
+	refill_suspended = suspend_W25Q64JV();
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	// send instruction
+	SPI_transmit(W25Q64JV_geometry.fast_read_instruction);
+	// send 24bit address MSB first
+	SPI_transmit( (uint8_t)(stream->address>>16) );
+	SPI_transmit( (uint8_t)(stream->address>>8) );
+	SPI_transmit( (uint8_t)(stream->address) );
+	//send the dummy clocks, 8 per byte
+	for(uint8_t dummy = 0; dummy < W25Q64JV_geometry.fast_read_dummy_cycles/8; dummy++){
+		SPI_transmit(0xFF);
+	}
+	SPI_DMA_transfer(NULL, &stream->buffer[index], length, refill_done);
+}
+
+// check if a refill is running (the SPI bus is in use) or its bytes haven't been taken over by
+// service_stream_W25Q64JV() yet
+bool stream_refill_busy_W25Q64JV(){
+	return refill_active || refill_ready;
+}
+
+// number of bytes that can be read from the buffer right now
+uint32_t available_stream_W25Q64JV(W25Q64JV_stream_t* stream){
+	return stream->head - stream->tail;
+}
+
+// check if all bytes of the stream have been read
+bool end_of_stream_W25Q64JV(W25Q64JV_stream_t* stream){
+	return (stream->remaining == 0) && !stream_refill_busy_W25Q64JV() && (stream->head == stream->tail);
+}
+
+// copy up to <length> bytes from the buffer, returns the number of bytes copied
+// this never waits for the chip, if the buffer runs empty fewer bytes are returned
+uint32_t read_stream_W25Q64JV(W25Q64JV_stream_t* stream, uint8_t* destination_ptr, uint32_t length){
+	uint32_t available = stream->head - stream->tail;
+	if(length > available) length = available;
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		destination_ptr[byte_counter] = stream->buffer[(stream->tail + byte_counter) % W25Q64JV_STREAM_BUFFER_SIZE];
+	}
+	stream->tail += length;
+	return length;
+}
+
+// read the next byte, returns false if the buffer is empty
+bool read_byte_stream_W25Q64JV(W25Q64JV_stream_t* stream, uint8_t* byte){
+	if(stream->head == stream->tail) return false;
+	*byte = stream->buffer[stream->tail % W25Q64JV_STREAM_BUFFER_SIZE];
+	stream->tail++;
+	return true;
+}
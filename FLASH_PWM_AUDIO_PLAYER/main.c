@@ -9,6 +9,11 @@
  *	Vref-> 3.3V
  *	PA0 -> PWM output
  *
+ *	the sounds are stored as an asset image (see W25Q64JV_assets.h), e.g.
+ *	W25Q64JV_pack sounds.bin startup.wav click.wav
+ *	W25Q64JV_upload /dev/ttyUSB0 sounds.bin 0 --erase
+ *	8 and 16 bit clips with any sample rate are played.
+ *
  *	written in 2019 by Marcel Meyer-Garcia
  *  see LICENCE.txt
  */
@@ -16,32 +21,72 @@
 #include "stm32f1xx.h"
 #include "init.h"
 #include "W25Q64JV.h"
+#include "W25Q64JV_stream.h"
+#include "W25Q64JV_assets.h"
+
+// the asset image (built with W25Q64JV_HOST_ASSET_PACKER) is stored from this address on
+#define IMAGE_ADDRESS	0x000000
+// the clip that is played; if there is none with this name, all clips are played one after another
+#define CLIP_NAME		"startup"
 
-#define address 000000
+// the samples are read ahead from the flash by DMA
+W25Q64JV_stream_t audio_stream;
+static volatile uint8_t clip_format;
+static volatile bool clip_finished;
 
 // timer1 update interrupt handler
 void TIM1_UP_IRQHandler(){
-	TIM2->CCR1 = SPI_transmit(0xFF);
+	uint8_t sample[2];
+	uint8_t sample_size = (clip_format == ASSET_FORMAT_S16LE) ? 2 : 1;
+	if( available_stream_W25Q64JV(&audio_stream) >= sample_size ){
+		read_stream_W25Q64JV(&audio_stream, sample, sample_size);
+		// of a 16 bit sample only the high byte is used, shifted to the middle of the PWM range
+		TIM2->CCR1 = (sample_size == 2) ? (uint8_t)(sample[1] + 128) : sample[0];
+	}else if( (audio_stream.remaining == 0) && !stream_refill_busy_W25Q64JV() ){
+		// end of the clip: stop with the output in the middle
+		TIM1->CR1 &=~TIM_CR1_CEN;
+		TIM2->CCR1 = 128;
+		clip_finished = true;
+	}
+	// if the buffer ran empty, the last sample is held
 	// clear timer1 update interrupt flag
 	TIM1->SR &=~TIM_SR_UIF;
 }
 
+// play a clip and return when it's finished
+static void play_clip(const W25Q64JV_asset_t* clip){
+	if( (clip->format != ASSET_FORMAT_U8) && (clip->format != ASSET_FORMAT_S16LE) ) return;
+	if(clip->length == 0) return;
+	// the timer overflow occurs with the sample rate, e.g. 72MHz/1633=approx. 44.1kHz
+	// its auto-reload register has 16 bits, so clips below approx. 1.1kHz can't be played
+	if(clip->sample_rate == 0) return;
+	uint32_t period = (72000000 + clip->sample_rate/2) / clip->sample_rate;
+	if( (period == 0) || (period > 0x10000) ) return;
+	clip_format = clip->format;
+	clip_finished = false;
+	// start streaming from the flash and fill the buffer before the playback starts
+	// (CS is only low during the refills, so the SPI bus can be shared with other devices)
+	open_asset_stream_W25Q64JV(&audio_stream, clip);
+	do{
+		service_stream_W25Q64JV(&audio_stream);
+	}while( stream_refill_busy_W25Q64JV() );
+	TIM1->ARR = period - 1;
+	TIM1->CNT = 0;
+	TIM1->CR1 |= TIM_CR1_CEN;
+	while(!clip_finished){
+		// keep the read-ahead buffer filled
+		service_stream_W25Q64JV(&audio_stream);
+	}
+}
+
 int main(void)
 {
 	// Initialize system timer for 1ms ticks (else divide by 1e6 for µs ticks)
 	SysTick_Config(SystemCoreClock / 1e3);
 
 	init_W25Q64JV();
-	// CS low, SPI slave starts to listen
-	CS_LOW();
-	// send instruction
-	SPI_transmit(FAST_READ);
-	// send 24bit address MSB first
-	SPI_transmit( (uint8_t)(address>>16) );
-	SPI_transmit( (uint8_t)(address>>8) );
-	SPI_transmit( (uint8_t)(address) );
-	//send 8 dummy clocks, i.e. 1 dummy byte
-	SPI_transmit(0xFF);
+	// the directory of the clips is kept in RAM
+	mount_assets_W25Q64JV(IMAGE_ADDRESS);
 
 
 	/* TIMER 2 SETUP FOR PWM */
@@ -89,19 +134,24 @@ int main(void)
 	RCC->APB2ENR |= RCC_APB2ENR_TIM1EN;
 	// use a prescaler of 1, i.e. f_TIM1=f_PCLK2/(0+1)=72MHz
 	TIM1->PSC = 0;
-	// set timer1 auto-reload value
-	// so the timer overflow will occur with a frequency of 72MHz/1633=approx. 44.1kHz
-	TIM1->ARR = 1633;
+	// the auto-reload value is set for the sample rate of each clip in play_clip()
 	// enable timer1 update interrupt
 	TIM1->DIER |= TIM_DIER_UIE;
 	NVIC_EnableIRQ(TIM1_UP_IRQn);
 	// globally enable interrupts
 	__enable_irq();
-	// start timer1
-	TIM1->CR1 |= TIM_CR1_CEN;
-
-
-
-
 
+	const W25Q64JV_asset_t* clip = find_asset_W25Q64JV(CLIP_NAME);
+	if(clip != NULL){
+		play_clip(clip);
+	}else{
+		for(uint16_t index = 0; index < num_assets_W25Q64JV(); index++){
+			play_clip(asset_W25Q64JV(index));
+		}
+	}
+
+	while(1){
+		// the chip is powered down after the idle timeout
+		idle_W25Q64JV();
+	}
 }
@@ -0,0 +1,285 @@
+/*	packer for asset images
+ *
+ *	builds a flash image with the directory described in
+ *	W25Q64JV_SPI_FLASH_MEMORY/W25Q64JV_assets.h from a list of files,
+ *	which can then be written into the W25Q64JV with W25Q64JV_HOST_UPLOADER.
+ *
+ *	WAV files (PCM, 8 or 16 bit, mono or stereo) are mixed down to mono and stored
+ *	with their sample rate and bit depth, with -8 the 16 bit files are converted to
+ *	8 bit as well. All other files are stored as they are: with -r <rate> as 8 bit
+ *	unsigned samples, otherwise as raw data.
+ *	Sample rates below SAMPLE_RATE_MIN are rejected, FLASH_PWM_AUDIO_PLAYER can't play them.
+ *
+ *	usage: W25Q64JV_pack [-8] [-r <rate>] <image> [<name>=]<file> ...
+ *	the name of an asset is the file name without extension if it isn't given.
+ *
+ *  see LICENCE.txt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// must match W25Q64JV_assets.h
+#define ASSET_MAGIC			0x31545341
+#define ASSET_HEADER_SIZE	16
+#define ASSET_ENTRY_SIZE	32
+#define ASSET_NAME_LENGTH	15
+#define ASSETS_MAX			32
+#define ASSET_FORMAT_RAW	0
+#define ASSET_FORMAT_U8		1
+#define ASSET_FORMAT_S16LE	2
+
+// the slowest rate of the player's sample timer (72MHz, 16 bit auto-reload register)
+#define SAMPLE_RATE_MIN		1099
+
+#define FLASH_SIZE			0x800000
+#define PAGE_SIZE			256
+
+typedef struct {
+	char name[ASSET_NAME_LENGTH + 1];
+	uint8_t* data;
+	uint32_t length;
+	uint32_t sample_rate;
+	uint8_t format;
+	uint32_t offset;
+} asset_t;
+
+static asset_t assets[ASSETS_MAX];
+static uint16_t num_assets = 0;
+
+static uint16_t get16(const uint8_t* data){
+	return data[0] | ((uint16_t)data[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* data){
+	return data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void put16(uint8_t* data, uint16_t value){
+	data[0] = (uint8_t)value;
+	data[1] = (uint8_t)(value >> 8);
+}
+
+static void put32(uint8_t* data, uint32_t value){
+	for(int byte_counter = 0; byte_counter < 4; byte_counter++){
+		data[byte_counter] = (uint8_t)(value >> (8*byte_counter));
+	}
+}
+
+// CRC32 (polynomial 0xEDB88320), like crc32_buffer_W25Q64JV() in W25Q64JV.c
+static uint32_t CRC32(const uint8_t* data, uint32_t length){
+	uint32_t crc = 0xFFFFFFFF;
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		crc ^= data[byte_counter];
+		for(uint8_t bit = 0; bit < 8; bit++){
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+		}
+	}
+	return ~crc;
+}
+
+static uint8_t* read_file(const char* name, uint32_t* length){
+	FILE* file = fopen(name, "rb");
+	if(file == NULL){
+		perror(name);
+		return NULL;
+	}
+	fseek(file, 0, SEEK_END);
+	long file_length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t* data = malloc(file_length > 0 ? file_length : 1);
+	if( (file_length < 0) || (data == NULL) || (fread(data, 1, file_length, file) != (size_t)file_length) ){
+		fprintf(stderr, "can't read %s\n", name);
+		fclose(file);
+		free(data);
+		return NULL;
+	}
+	fclose(file);
+	*length = file_length;
+	return data;
+}
+
+// convert the WAV file in <data> into mono samples, returns false if it's no (supported) WAV file
+static bool convert_WAV(const uint8_t* data, uint32_t length, bool to_8bit, asset_t* asset, const char* file_name){
+	if( (length < 12) || memcmp(data, "RIFF", 4) || memcmp(&data[8], "WAVE", 4) ) return false;
+	uint16_t channels = 0, bits = 0;
+	uint32_t sample_rate = 0;
+	const uint8_t* samples = NULL;
+	uint32_t samples_length = 0;
+	// the chunks after the RIFF header, each one is padded to an even length
+	for(uint32_t position = 12; position + 8 <= length; ){
+		uint32_t chunk_length = get32(&data[position + 4]);
+		const uint8_t* chunk = &data[position + 8];
+		if(chunk_length > length - position - 8) chunk_length = length - position - 8;
+		if( !memcmp(&data[position], "fmt ", 4) && (chunk_length >= 16) ){
+			uint16_t audio_format = get16(chunk);
+			// 1 = PCM, 0xFFFE = extensible (PCM as well for the bit depths supported here)
+			if( (audio_format != 1) && (audio_format != 0xFFFE) ){
+				fprintf(stderr, "%s: only PCM WAV files are supported\n", file_name);
+				return false;
+			}
+			channels = get16(&chunk[2]);
+			sample_rate = get32(&chunk[4]);
+			bits = get16(&chunk[14]);
+		}else if( !memcmp(&data[position], "data", 4) ){
+			samples = chunk;
+			samples_length = chunk_length;
+		}
+		position += 8 + chunk_length + (chunk_length & 1);
+	}
+	if( (samples == NULL) || (channels == 0) || ((bits != 8) && (bits != 16)) ){
+		fprintf(stderr, "%s: only 8 or 16 bit PCM WAV files are supported\n", file_name);
+		return false;
+	}
+	if(sample_rate < SAMPLE_RATE_MIN){
+		fprintf(stderr, "%s: the sample rate (%u Hz) must be at least %d Hz\n", file_name, sample_rate, SAMPLE_RATE_MIN);
+		return false;
+	}
+	uint32_t frame_size = channels * bits / 8;
+	uint32_t num_frames = samples_length / frame_size;
+	bool output_8bit = to_8bit || (bits == 8);
+	asset->format = output_8bit ? ASSET_FORMAT_U8 : ASSET_FORMAT_S16LE;
+	asset->sample_rate = sample_rate;
+	asset->length = num_frames * (output_8bit ? 1 : 2);
+	asset->data = malloc(asset->length > 0 ? asset->length : 1);
+	for(uint32_t frame = 0; frame < num_frames; frame++){
+		// mix all channels, as 16 bit signed values
+		int32_t sum = 0;
+		for(uint16_t channel = 0; channel < channels; channel++){
+			const uint8_t* sample = &samples[frame*frame_size + channel*bits/8];
+			sum += (bits == 8) ? ((int32_t)sample[0] - 128) * 256 : (int16_t)get16(sample);
+		}
+		int32_t value = sum / channels;
+		if(output_8bit){
+			asset->data[frame] = (uint8_t)((value >> 8) + 128);
+		}else{
+			put16(&asset->data[2*frame], (uint16_t)(int16_t)value);
+		}
+	}
+	return true;
+}
+
+static bool add_asset(const char* argument, bool to_8bit, uint32_t raw_sample_rate){
+	if(num_assets >= ASSETS_MAX){
+		fprintf(stderr, "too many files, max. %d\n", ASSETS_MAX);
+		return false;
+	}
+	asset_t* asset = &assets[num_assets];
+	const char* file_name = argument;
+	const char* separator = strchr(argument, '=');
+	const char* name;
+	size_t name_length;
+	if(separator != NULL){
+		name = argument;
+		name_length = separator - argument;
+		file_name = separator + 1;
+	}else{
+		// the file name without path and extension
+		name = strrchr(file_name, '/') ? strrchr(file_name, '/') + 1 : file_name;
+		const char* extension = strrchr(name, '.');
+		name_length = extension ? (size_t)(extension - name) : strlen(name);
+	}
+	if( (name_length == 0) || (name_length > ASSET_NAME_LENGTH) ){
+		fprintf(stderr, "%s: the name must have 1 to %d characters\n", argument, ASSET_NAME_LENGTH);
+		return false;
+	}
+	memset(asset->name, 0, sizeof(asset->name));
+	memcpy(asset->name, name, name_length);
+	for(uint16_t other = 0; other < num_assets; other++){
+		if(strcmp(assets[other].name, asset->name) == 0){
+			fprintf(stderr, "the name %s is used twice\n", asset->name);
+			return false;
+		}
+	}
+	uint32_t length;
+	uint8_t* data = read_file(file_name, &length);
+	if(data == NULL) return false;
+	if( (length >= 12) && !memcmp(data, "RIFF", 4) ){
+		bool ok = convert_WAV(data, length, to_8bit, asset, file_name);
+		free(data);
+		if(!ok) return false;
+	}else{
+		asset->data = data;
+		asset->length = length;
+		asset->sample_rate = raw_sample_rate;
+		asset->format = raw_sample_rate ? ASSET_FORMAT_U8 : ASSET_FORMAT_RAW;
+	}
+	num_assets++;
+	return true;
+}
+
+int main(int argc, char* argv[]){
+	bool to_8bit = false;
+	uint32_t raw_sample_rate = 0;
+	int argument = 1;
+	for(; (argument < argc) && (argv[argument][0] == '-'); argument++){
+		if(strcmp(argv[argument], "-8") == 0){
+			to_8bit = true;
+		}else if( (strcmp(argv[argument], "-r") == 0) && (argument + 1 < argc) ){
+			char* end;
+			raw_sample_rate = strtoul(argv[++argument], &end, 10);
+			if( (*end != '\0') || (raw_sample_rate < SAMPLE_RATE_MIN) ){
+				fprintf(stderr, "-r %s: the sample rate must be at least %d Hz\n", argv[argument], SAMPLE_RATE_MIN);
+				return 1;
+			}
+		}else{
+			break;
+		}
+	}
+	if(argc - argument < 2){
+		fprintf(stderr, "usage: %s [-8] [-r <rate>] <image> [<name>=]<file> ...\n", argv[0]);
+		return 1;
+	}
+	const char* image_name = argv[argument++];
+	for(; argument < argc; argument++){
+		if( !add_asset(argv[argument], to_8bit, raw_sample_rate) ) return 1;
+	}
+
+	// directory, then the data of each asset from the next page boundary on
+	uint32_t image_length = ASSET_HEADER_SIZE + num_assets*ASSET_ENTRY_SIZE;
+	for(uint16_t index = 0; index < num_assets; index++){
+		image_length = (image_length + PAGE_SIZE - 1) & ~(uint32_t)(PAGE_SIZE - 1);
+		assets[index].offset = image_length;
+		image_length += assets[index].length;
+	}
+	if(image_length > FLASH_SIZE){
+		fprintf(stderr, "the image (%u bytes) doesn't fit into the chip\n", image_length);
+		return 1;
+	}
+	// the gaps stay erased
+	uint8_t* image = malloc(image_length);
+	memset(image, 0xFF, image_length);
+	for(uint16_t index = 0; index < num_assets; index++){
+		uint8_t* entry = &image[ASSET_HEADER_SIZE + index*ASSET_ENTRY_SIZE];
+		memset(entry, 0, ASSET_ENTRY_SIZE);
+		memcpy(entry, assets[index].name, ASSET_NAME_LENGTH + 1);
+		put32(&entry[16], assets[index].offset);
+		put32(&entry[20], assets[index].length);
+		put32(&entry[24], assets[index].sample_rate);
+		entry[28] = assets[index].format;
+		memcpy(&image[assets[index].offset], assets[index].data, assets[index].length);
+	}
+	put32(&image[0], ASSET_MAGIC);
+	put16(&image[4], num_assets);
+	put16(&image[6], ASSET_ENTRY_SIZE);
+	put32(&image[8], CRC32(&image[ASSET_HEADER_SIZE], num_assets*ASSET_ENTRY_SIZE));
+	put32(&image[12], 0xFFFFFFFF);
+
+	FILE* file = fopen(image_name, "wb");
+	if( (file == NULL) || (fwrite(image, 1, image_length, file) != image_length) ){
+		perror(image_name);
+		return 1;
+	}
+	fclose(file);
+	static const char* format_names[] = {"raw", "8 bit", "16 bit"};
+	printf("index name             offset     length   rate  format\n");
+	for(uint16_t index = 0; index < num_assets; index++){
+		printf("%5u %-15s %8X %10u %6u  %s\n", index, assets[index].name, assets[index].offset,
+			assets[index].length, assets[index].sample_rate, format_names[assets[index].format]);
+	}
+	printf("%u bytes written to %s\n", image_length, image_name);
+	return 0;
+}
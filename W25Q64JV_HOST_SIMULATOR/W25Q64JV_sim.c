@@ -0,0 +1,603 @@
+/*	simulated Winbond W25Q64JV SPI flash memory for host builds (e.g. Linux)
+ *
+ *  see LICENCE.txt
+ */
+#include "W25Q64JV_sim.h"
+#include "W25Q64JV_instruction_set.h"
+#include <string.h>
+
+#define STATUS_REG_1_WEL_BIT	(1<<1)
+#define STATUS_REG_2_SUS_BIT	(1<<7)
+
+// JEDEC ID: manufacturer Winbond, memory type, capacity 2^23 bytes
+#define SIM_MANUFACTURER_ID		0xEF
+#define SIM_MEMORY_TYPE			0x40
+#define SIM_CAPACITY			0x17
+#define SIM_DEVICE_ID			0x16
+
+sim_stats_t sim_stats;
+
+static uint8_t memory[SIM_FLASH_SIZE];
+static uint32_t sector_erase_count[SIM_NUM_SECTORS];
+static const uint8_t unique_ID[8] = {0xD1, 0x63, 0x28, 0x40, 0x5A, 0x17, 0x2C, 0x33};
+
+// SFDP table (JESD216): header, one parameter header and the basic flash parameter table at 0x80
+// the values are those of the W25Q64JV datasheet
+static const uint8_t SFDP_header[16] = {
+	'S', 'F', 'D', 'P', 0x05, 0x01, 0x00, 0xFF,
+	0x00, 0x05, 0x01, 0x10, 0x80, 0x00, 0x00, 0xFF
+};
+static const uint8_t SFDP_basic_parameters[64] = {
+	0xE5, 0x20, 0xF9, 0xFF,		// 4kB erase with 0x20, ...
+	0xFF, 0xFF, 0xFF, 0x03,		// 64Mbit
+	0x44, 0xEB, 0x08, 0x6B,		// quad/dual read modes
+	0x08, 0x3B, 0x42, 0xBB,
+	0xFE, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0x00, 0x00,
+	0xFF, 0xFF, 0x40, 0xEB,
+	0x0C, 0x20, 0x0F, 0x52,		// erase types 1 and 2: 4kB 0x20, 32kB 0x52
+	0x10, 0xD8, 0x00, 0x00,		// erase types 3 and 4: 64kB 0xD8, none
+	0x36, 0x02, 0xA6, 0x00,		// typical erase times
+	0x82, 0xEA, 0x14, 0xC4,		// page size 256 bytes, program times
+	0xE9, 0x63, 0x76, 0x33,
+	0x7A, 0x75, 0x7A, 0x75,
+	0xF7, 0xA2, 0xD5, 0x5C,
+	0x19, 0xF7, 0x4D, 0xFF,
+	0xE9, 0x30, 0xF8, 0x80
+};
+bool sim_SFDP_disabled;
+
+uint8_t sim_SPI_error;
+bool sim_SPI_timeout;
+uint32_t sim_bus_max_burst = 0xFFFFFFFF;
+uint32_t sim_bus_refusals;
+void (*sim_bus_acquire_interrupt)(void) = NULL;
+
+static uint64_t time_ns;
+static uint32_t byte_time_ns;
+
+// the driver's ownership of the shared bus
+static struct {
+	bool held;
+	// a failed sim_bus_request() queued the driver up, the bus would be granted to it next
+	bool waiting;
+	uint64_t granted_at;
+} bus;
+
+// state of the chip
+static struct {
+	bool CS_low;
+	uint32_t byte_count;			// bytes clocked since CS went low
+	uint8_t instruction;			// first byte of the transaction
+	bool ignored;					// the instruction is not executed
+	uint32_t address;
+	bool write_enable;
+	bool volatile_SR_write_enable;
+	bool reset_enable;
+	bool power_down;
+	uint64_t busy_until;			// end of program/erase
+	bool chip_erase;				// a chip erase can't be suspended
+	bool suspended;
+	uint64_t remaining_ns;			// rest of the suspended program/erase
+	uint64_t resumed_at;
+	uint64_t ready_until;			// end of wake-up/reset, instructions are ignored before
+	uint8_t status_reg_2;
+	uint8_t status_reg_3;
+	// data of the page program, applied when CS goes high
+	uint8_t page_data[256];
+	bool page_written[256];
+} chip;
+
+static bool busy(void){
+	return time_ns < chip.busy_until;
+}
+
+static uint8_t status_reg_1(void){
+	uint8_t status = 0;
+	if(busy()) status |= STATUS_REG_1_BUSY_BIT;
+	if(chip.write_enable) status |= STATUS_REG_1_WEL_BIT;
+	return status;
+}
+
+static void start_busy(uint64_t duration_ns){
+	chip.busy_until = time_ns + duration_ns;
+	chip.chip_erase = false;
+	sim_stats.busy_time_ns += duration_ns;
+	// the write enable latch is cleared when the operation is finished,
+	// nothing can be sent in between anyway
+	chip.write_enable = false;
+}
+
+static void erase(uint32_t address, uint32_t size){
+	address &= (SIM_FLASH_SIZE - 1) & ~(size - 1);
+	memset(&memory[address], 0xFF, size);
+	for(uint32_t sector = address/SIM_SECTOR_SIZE; sector < (address+size)/SIM_SECTOR_SIZE; sector++){
+		sector_erase_count[sector]++;
+	}
+}
+
+// instructions that are accepted while the chip is busy
+static bool allowed_while_busy(uint8_t instruction){
+	return (instruction == READ_STATUS_REG_1) || (instruction == READ_STATUS_REG_2) || (instruction == READ_STATUS_REG_3)
+		|| (instruction == ERASE_PROGRAM_SUSPEND);
+}
+
+// instructions that are ignored while a program/erase is suspended
+static bool forbidden_while_suspended(uint8_t instruction){
+	return (instruction == PAGE_PROGRAM) || (instruction == SECTOR_ERASE_4KB) || (instruction == BLOCK_ERASE_32KB)
+		|| (instruction == BLOCK_ERASE_64KB) || (instruction == CHIP_ERASE) || (instruction == WRITE_STATUS_REG_1)
+		|| (instruction == WRITE_STATUS_REG_2) || (instruction == WRITE_STATUS_REG_3) || (instruction == POWER_DOWN);
+}
+
+static void begin_instruction(uint8_t instruction){
+	chip.instruction = instruction;
+	chip.ignored = false;
+	if(chip.power_down && (instruction != RELEASE_PWR_DWN_ID)){
+		chip.ignored = true;
+	}else if(time_ns < chip.ready_until){
+		chip.ignored = true;
+	}else if(busy() && !allowed_while_busy(instruction)){
+		chip.ignored = true;
+	}else if(chip.suspended && forbidden_while_suspended(instruction)){
+		chip.ignored = true;
+	}
+	if(chip.ignored){
+		sim_stats.ignored_instructions++;
+		return;
+	}
+	if(instruction == PAGE_PROGRAM){
+		memset(chip.page_written, 0, sizeof(chip.page_written));
+	}
+	// the reset sequence has to be ENABLE_RESET immediately followed by RESET_DEVICE
+	if( (instruction != ENABLE_RESET) && (instruction != RESET_DEVICE) ){
+		chip.reset_enable = false;
+	}
+}
+
+// receive the 24bit address (bytes 1-3 of the transaction)
+static void shift_address(uint32_t n, uint8_t data){
+	if(n == 1) chip.address = 0;
+	chip.address = (chip.address << 8) | data;
+	if(n == 3) chip.address &= (SIM_FLASH_SIZE - 1);
+}
+
+// handle byte <n> (n>=1) of the current transaction and return the byte sent by the chip
+static uint8_t continue_instruction(uint32_t n, uint8_t data){
+	switch(chip.instruction){
+	case READ_STATUS_REG_1:
+		return status_reg_1();
+	case READ_STATUS_REG_2:
+		return chip.suspended ? (chip.status_reg_2 | STATUS_REG_2_SUS_BIT) : chip.status_reg_2;
+	case READ_STATUS_REG_3:
+		return chip.status_reg_3;
+	case WRITE_STATUS_REG_1:
+		// the protection bits are not simulated
+		return 0xFF;
+	case WRITE_STATUS_REG_2:
+		if( (n == 1) && (chip.write_enable || chip.volatile_SR_write_enable) ) chip.status_reg_2 = data;
+		return 0xFF;
+	case WRITE_STATUS_REG_3:
+		if( (n == 1) && (chip.write_enable || chip.volatile_SR_write_enable) ) chip.status_reg_3 = data;
+		return 0xFF;
+	case READ_DATA:
+	case FAST_READ:
+		if(n <= 3){
+			shift_address(n, data);
+			return 0xFF;
+		}
+		// FAST_READ has 1 dummy byte after the address
+		if( (chip.instruction == FAST_READ) && (n == 4) ) return 0xFF;
+		sim_stats.data_bytes_read++;
+		{
+			uint8_t value = memory[chip.address];
+			// continuous reading wraps around at the end of the memory
+			chip.address = (chip.address + 1) & (SIM_FLASH_SIZE - 1);
+			return value;
+		}
+	case PAGE_PROGRAM:
+		if(n <= 3){
+			shift_address(n, data);
+			return 0xFF;
+		}
+		{
+			// the address wraps around at the end of the page
+			uint8_t offset = (uint8_t)(chip.address + (n - 4));
+			chip.page_data[offset] = data;
+			chip.page_written[offset] = true;
+		}
+		return 0xFF;
+	case SECTOR_ERASE_4KB:
+	case BLOCK_ERASE_32KB:
+	case BLOCK_ERASE_64KB:
+		if(n <= 3) shift_address(n, data);
+		return 0xFF;
+	case READ_SFDP_REG:
+		// 3 address bytes and 1 dummy byte like FAST_READ
+		if(n <= 3){
+			shift_address(n, data);
+			return 0xFF;
+		}
+		if( (n == 4) || sim_SFDP_disabled ) return 0xFF;
+		{
+			uint32_t address = (chip.address + (n - 5)) & 0xFF;
+			if(address < sizeof(SFDP_header)) return SFDP_header[address];
+			if( (address >= 0x80) && (address < 0x80 + sizeof(SFDP_basic_parameters)) ) return SFDP_basic_parameters[address - 0x80];
+			return 0xFF;
+		}
+	case JEDEC_ID:
+		if(n == 1) return SIM_MANUFACTURER_ID;
+		if(n == 2) return SIM_MEMORY_TYPE;
+		if(n == 3) return SIM_CAPACITY;
+		return 0xFF;
+	case MANUFACT_DEVICE_ID:
+		// 3 address bytes (000000h), then manufacturer and device ID alternately
+		if(n <= 3) return 0xFF;
+		return (n % 2 == 0) ? SIM_MANUFACTURER_ID : SIM_DEVICE_ID;
+	case RELEASE_PWR_DWN_ID:
+		// 3 dummy bytes, then the device ID
+		if(n <= 3) return 0xFF;
+		return SIM_DEVICE_ID;
+	case READ_UNIQUE_ID:
+		// 4 dummy bytes, then the 64bit ID
+		if( (n >= 5) && (n <= 12) ) return unique_ID[n - 5];
+		return 0xFF;
+	default:
+		return 0xFF;
+	}
+}
+
+// instructions that are executed when CS goes high
+static void end_instruction(void){
+	if(chip.ignored || (chip.byte_count == 0)) return;
+	uint32_t n = chip.byte_count;
+	switch(chip.instruction){
+	case WRITE_ENABLE:
+		chip.write_enable = true;
+		break;
+	case WRITE_DISABLE:
+		chip.write_enable = false;
+		break;
+	case VOLATILE_SR_WRITE_ENABLE:
+		chip.volatile_SR_write_enable = true;
+		break;
+	case PAGE_PROGRAM:
+		if(!chip.write_enable){
+			sim_stats.ignored_instructions++;
+			break;
+		}
+		if(n < 5) break;
+		{
+			uint32_t page = chip.address & ~0xFFUL;
+			for(uint32_t offset = 0; offset < 256; offset++){
+				if(chip.page_written[offset]){
+					// programming can only clear bits
+					memory[page + offset] &= chip.page_data[offset];
+					sim_stats.data_bytes_programmed++;
+				}
+			}
+		}
+		sim_stats.page_programs++;
+		start_busy(SIM_T_PAGE_PROGRAM);
+		break;
+	case SECTOR_ERASE_4KB:
+	case BLOCK_ERASE_32KB:
+	case BLOCK_ERASE_64KB:
+		// the instruction is only executed after exactly 3 address bytes
+		if(n != 4) break;
+		if(!chip.write_enable){
+			sim_stats.ignored_instructions++;
+			break;
+		}
+		if(chip.instruction == SECTOR_ERASE_4KB){
+			erase(chip.address, 0x1000);
+			sim_stats.sector_erases++;
+			start_busy(SIM_T_SECTOR_ERASE);
+		}else if(chip.instruction == BLOCK_ERASE_32KB){
+			erase(chip.address, 0x8000);
+			sim_stats.block_erases_32KB++;
+			start_busy(SIM_T_BLOCK_ERASE_32KB);
+		}else{
+			erase(chip.address, 0x10000);
+			sim_stats.block_erases_64KB++;
+			start_busy(SIM_T_BLOCK_ERASE_64KB);
+		}
+		break;
+	case CHIP_ERASE:
+		if(n != 1) break;
+		if(!chip.write_enable){
+			sim_stats.ignored_instructions++;
+			break;
+		}
+		erase(0, SIM_FLASH_SIZE);
+		sim_stats.chip_erases++;
+		start_busy(SIM_T_CHIP_ERASE);
+		chip.chip_erase = true;
+		break;
+	case ERASE_PROGRAM_SUSPEND:
+		// only a running program/erase (no chip erase) can be suspended, and only tSUS after the last resume
+		if( !busy() || chip.suspended || chip.chip_erase || (time_ns < chip.resumed_at + SIM_T_SUSPEND) ){
+			sim_stats.ignored_instructions++;
+			break;
+		}
+		// an operation that ends within tSUS just finishes
+		if(chip.busy_until - time_ns <= SIM_T_SUSPEND) break;
+		chip.remaining_ns = chip.busy_until - time_ns;
+		chip.busy_until = time_ns + SIM_T_SUSPEND;
+		chip.suspended = true;
+		sim_stats.suspends++;
+		break;
+	case ERASE_PROGRAM_RESUME:
+		if( !chip.suspended || busy() ){
+			sim_stats.ignored_instructions++;
+			break;
+		}
+		chip.busy_until = time_ns + chip.remaining_ns;
+		chip.suspended = false;
+		chip.resumed_at = time_ns;
+		break;
+	case WRITE_STATUS_REG_2:
+	case WRITE_STATUS_REG_3:
+		chip.write_enable = false;
+		chip.volatile_SR_write_enable = false;
+		break;
+	case POWER_DOWN:
+		chip.power_down = true;
+		break;
+	case RELEASE_PWR_DWN_ID:
+		if(chip.power_down){
+			chip.power_down = false;
+			chip.ready_until = time_ns + SIM_T_RELEASE_POWER_DOWN;
+		}
+		break;
+	case ENABLE_RESET:
+		chip.reset_enable = true;
+		break;
+	case RESET_DEVICE:
+		if(chip.reset_enable){
+			chip.reset_enable = false;
+			chip.write_enable = false;
+			chip.volatile_SR_write_enable = false;
+			chip.ready_until = time_ns + SIM_T_RESET;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void sim_init(uint32_t spi_clock_hz){
+	memset(memory, 0xFF, sizeof(memory));
+	memset(sector_erase_count, 0, sizeof(sector_erase_count));
+	memset(&chip, 0, sizeof(chip));
+	time_ns = 0;
+	sim_set_SPI_clock(spi_clock_hz);
+	sim_reset_stats();
+	sim_bus_max_burst = 0xFFFFFFFF;
+	sim_bus_refusals = 0;
+	sim_bus_acquire_interrupt = NULL;
+	bus.held = false;
+	bus.waiting = false;
+}
+
+void sim_reset_stats(void){
+	memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+void sim_set_SPI_clock(uint32_t spi_clock_hz){
+	// 8 clock cycles per byte, rounded up
+	byte_time_ns = (uint32_t)((8000000000ULL + spi_clock_hz - 1) / spi_clock_hz);
+}
+
+uint64_t sim_time_ns(void){
+	return time_ns;
+}
+
+void sim_advance_time(uint64_t ns){
+	time_ns += ns;
+}
+
+uint32_t sim_cycle_counter(void){
+	time_ns += 14;
+	return (uint32_t)(time_ns * 72 / 1000);
+}
+
+uint8_t* sim_memory(void){
+	return memory;
+}
+
+uint32_t sim_sector_erase_count(uint32_t sector){
+	if(sector >= SIM_NUM_SECTORS) return 0;
+	return sector_erase_count[sector];
+}
+
+bool sim_busy(void){
+	return busy();
+}
+
+bool sim_suspended(void){
+	return chip.suspended;
+}
+
+bool sim_powered_down(void){
+	return chip.power_down;
+}
+
+void sim_CS_low(void){
+	// no falling edge if CS is already low
+	if(chip.CS_low) return;
+	chip.CS_low = true;
+	chip.byte_count = 0;
+	sim_stats.transactions++;
+	if(!bus.held) sim_stats.transactions_without_bus++;
+}
+
+void sim_CS_high(void){
+	if(!chip.CS_low) return;
+	end_instruction();
+	chip.CS_low = false;
+}
+
+uint16_t sim_SPI_transmit(uint16_t tx_data){
+	uint8_t data = (uint8_t)tx_data;
+	if(sim_SPI_timeout){
+		sim_SPI_error = 1;
+		return 0xFFFF;
+	}
+	time_ns += byte_time_ns;
+	sim_stats.bytes_clocked++;
+	// the chip doesn't drive its output while it's not selected
+	if(!chip.CS_low) return 0xFF;
+	uint32_t n = chip.byte_count++;
+	if(n == 0){
+		begin_instruction(data);
+		return 0xFF;
+	}
+	if(chip.ignored) return 0xFF;
+	return continue_instruction(n, data);
+}
+
+// the polled buffer transfer clocks exactly the same bytes as sim_SPI_transmit()
+bool sim_SPI_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length){
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		uint16_t rx_data = sim_SPI_transmit(tx_buf ? tx_buf[byte_counter] : 0xFF);
+		if(rx_buf) rx_buf[byte_counter] = (uint8_t)rx_data;
+	}
+	return !sim_SPI_timeout;
+}
+
+// >0 while a DMA callback runs, i.e. in the DMA interrupt on the µC
+static uint32_t DMA_callback_depth = 0;
+
+// like SPI1_bus_acquire(): returns immediately if the driver owns the bus already
+static void bus_grant(void){
+	bus.held = true;
+	bus.waiting = false;
+	bus.granted_at = time_ns;
+	sim_stats.bus_grants++;
+}
+
+void sim_bus_acquire(void){
+	if(bus.held) return;
+	if(DMA_callback_depth > 0) sim_stats.bus_acquires_in_interrupt++;
+	bus_grant();
+	if(sim_bus_acquire_interrupt){
+		void (*interrupt)(void) = sim_bus_acquire_interrupt;
+		sim_bus_acquire_interrupt = NULL;
+		interrupt();
+	}
+}
+
+bool sim_bus_request(void){
+	if(bus.held) return true;
+	if(sim_bus_refusals > 0){
+		sim_bus_refusals--;
+		// the other device's transaction
+		time_ns += 10000;
+		bus.waiting = true;
+		return false;
+	}
+	bus_grant();
+	return true;
+}
+
+// like SPI1_bus_try(): fails if anyone has the bus (the driver too) and doesn't queue up for it
+bool sim_bus_try(void){
+	if(bus.held) return false;
+	if(sim_bus_refusals > 0){
+		sim_bus_refusals--;
+		time_ns += 10000;
+		return false;
+	}
+	bus_grant();
+	return true;
+}
+
+bool sim_bus_waiting(void){
+	return bus.waiting;
+}
+
+void sim_bus_release(void){
+	if(!bus.held) return;
+	bus.held = false;
+	if(time_ns - bus.granted_at > sim_stats.max_bus_hold_ns) sim_stats.max_bus_hold_ns = time_ns - bus.granted_at;
+}
+
+// same rule as SPIx_DMA_transfer16(): reads of an even length from 16 bytes on into a 2 byte aligned buffer
+static bool DMA_frames16(const uint8_t* tx_buf, const uint8_t* rx_buf, uint16_t length){
+	return !tx_buf && !(length & 1) && (length >= SIM_DMA_16BIT_MIN_LENGTH) && !((uintptr_t)rx_buf & 1);
+}
+
+// on the host, a "DMA transfer" is just a loop over sim_SPI_transmit()
+// with 16bit frames the bytes of each frame end up swapped, like on the µC
+static void DMA_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void), uint32_t swap){
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		uint8_t rx_data = (uint8_t)sim_SPI_transmit(tx_buf ? tx_buf[byte_counter] : 0xFF);
+		if(rx_buf) rx_buf[byte_counter ^ swap] = rx_data;
+	}
+	if(callback){
+		DMA_callback_depth++;
+		callback();
+		DMA_callback_depth--;
+	}
+}
+
+void sim_SPI_DMA_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void)){
+	DMA_transfer(tx_buf, rx_buf, length, callback, DMA_frames16(tx_buf, rx_buf, length) ? 1 : 0);
+}
+
+// like SPIx_DMA_transfer(): always 8bit frames, the bytes arrive in order
+void sim_SPI_DMA_transfer8(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void)){
+	DMA_transfer(tx_buf, rx_buf, length, callback, 0);
+}
+
+void sim_SPI_DMA_order(uint8_t* rx_buf, uint16_t length){
+	if( !rx_buf || !DMA_frames16(NULL, rx_buf, length) ) return;
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter += 2){
+		uint8_t high = rx_buf[byte_counter + 1];
+		rx_buf[byte_counter + 1] = rx_buf[byte_counter];
+		rx_buf[byte_counter] = high;
+	}
+}
+
+static struct {
+	uint8_t data[SIM_UART_BUFFER_SIZE];
+	uint64_t arrival_ns[SIM_UART_BUFFER_SIZE];
+	uint32_t head, tail;
+	uint64_t byte_time_ns;
+	void (*host_receive)(uint8_t data);
+} UART;
+
+void sim_UART_init(uint32_t baud_rate, void (*host_receive)(uint8_t data)){
+	UART.head = 0;
+	UART.tail = 0;
+	UART.byte_time_ns = 10000000000ULL / baud_rate;
+	UART.host_receive = host_receive;
+}
+
+void sim_UART_host_send(uint8_t data){
+	uint64_t arrival_ns = time_ns;
+	if(UART.head != UART.tail){
+		uint64_t last = UART.arrival_ns[(UART.head - 1) % SIM_UART_BUFFER_SIZE];
+		if(last > arrival_ns) arrival_ns = last;
+	}
+	// the host never sends that much ahead, so overflow is not handled
+	UART.data[UART.head % SIM_UART_BUFFER_SIZE] = data;
+	UART.arrival_ns[UART.head % SIM_UART_BUFFER_SIZE] = arrival_ns + UART.byte_time_ns;
+	UART.head++;
+}
+
+bool sim_UART_available(void){
+	if( (UART.head != UART.tail) && (UART.arrival_ns[UART.tail % SIM_UART_BUFFER_SIZE] <= time_ns) ) return true;
+	// polling loop
+	time_ns += 1000;
+	return false;
+}
+
+uint8_t sim_UART_read(void){
+	return UART.data[UART.tail++ % SIM_UART_BUFFER_SIZE];
+}
+
+void sim_UART_write(uint8_t data){
+	time_ns += UART.byte_time_ns;
+	if(UART.host_receive) UART.host_receive(data);
+}
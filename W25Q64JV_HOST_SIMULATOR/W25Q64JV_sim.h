@@ -0,0 +1,142 @@
+/*	simulated Winbond W25Q64JV SPI flash memory for host builds (e.g. Linux)
+ *
+ *	the driver in W25Q64JV_SPI_FLASH_MEMORY talks to the chip only via
+ *	CS_PIN_LOW(), CS_PIN_HIGH(), SPI_transmit, SPI_transfer, SPI_DMA_transfer
+ *	and SPI_DMA_order. When it is compiled with -DW25Q64JV_HOST_SIM these are
+ *	mapped to the functions
+ *	below, which feed an 8MB in-memory model of the chip. The model
+ *	follows the NOR flash rules (programming can only clear bits, erasing
+ *	sets them), keeps the chip BUSY for the typical program/erase times of
+ *	the datasheet and counts every byte that is clocked over the bus.
+ *
+ *	the simulated time only advances with the bytes clocked over the bus
+ *	(8 SPI clock cycles per byte) and with sim_advance_time()
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef W25Q64JV_SIM_H_
+#define W25Q64JV_SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// the driver's porting defines, mapped to the simulator
+#define CS_PIN_LOW()	sim_CS_low()
+#define CS_PIN_HIGH()	sim_CS_high()
+#define SPI_transmit sim_SPI_transmit
+#define SPI_transfer sim_SPI_transfer
+#define SPI_DMA_transfer sim_SPI_DMA_transfer
+#define SPI_DMA_transfer8 sim_SPI_DMA_transfer8
+#define SPI_DMA_order sim_SPI_DMA_order
+#define SPI_error sim_SPI_error
+#define BUS_ACQUIRE()	sim_bus_acquire()
+#define BUS_REQUEST()	sim_bus_request()
+#define BUS_TRY()	sim_bus_try()
+#define BUS_RELEASE()	sim_bus_release()
+#define BUS_MAX_BURST()	sim_bus_max_burst
+#define CYCLE_COUNTER()	sim_cycle_counter()
+#define CYCLES_PER_US	72
+#define TIME_MS()	(uint32_t)(sim_time_ns() / 1000000)
+
+#define SIM_FLASH_SIZE		0x800000	// 8MB
+#define SIM_SECTOR_SIZE		0x1000		// 4kB
+#define SIM_NUM_SECTORS		(SIM_FLASH_SIZE / SIM_SECTOR_SIZE)
+
+// typical timings from the datasheet in ns
+#define SIM_T_PAGE_PROGRAM		400000ULL		// 0.4ms
+#define SIM_T_SECTOR_ERASE		45000000ULL		// 45ms
+#define SIM_T_BLOCK_ERASE_32KB	120000000ULL	// 120ms
+#define SIM_T_BLOCK_ERASE_64KB	150000000ULL	// 150ms
+#define SIM_T_CHIP_ERASE		20000000000ULL	// 20s
+#define SIM_T_RELEASE_POWER_DOWN	3000ULL		// 3µs
+#define SIM_T_RESET				30000ULL		// 30µs
+#define SIM_T_SUSPEND			20000ULL		// 20µs, also the min. time from a resume to the next suspend
+
+// bus and chip statistics, reset with sim_reset_stats()
+typedef struct {
+	uint64_t bytes_clocked;			// all bytes clocked over the bus
+	uint64_t data_bytes_read;		// data bytes of READ_DATA/FAST_READ
+	uint64_t data_bytes_programmed;	// data bytes of PAGE_PROGRAM
+	uint32_t transactions;			// falling edges of CS
+	uint32_t page_programs;
+	uint32_t sector_erases;
+	uint32_t block_erases_32KB;
+	uint32_t block_erases_64KB;
+	uint32_t chip_erases;
+	uint32_t suspends;				// program/erase operations suspended
+	uint32_t ignored_instructions;	// sent while busy, powered down, waking up or without write enable
+	uint64_t busy_time_ns;			// time the chip spent programming/erasing
+	uint32_t bus_grants;			// the driver got the shared SPI bus
+	uint64_t max_bus_hold_ns;		// longest time the driver held the bus
+	uint32_t bus_acquires_in_interrupt;	// sim_bus_acquire() had to wait in a DMA callback (a deadlock on the µC)
+	uint32_t transactions_without_bus;	// CS pulled low while the driver didn't own the bus
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+// reset the chip: all bytes erased (0xFF), statistics and erase counters cleared, time = 0
+void sim_init(uint32_t spi_clock_hz);
+void sim_reset_stats(void);
+// SPI clock used to convert clocked bytes into time
+void sim_set_SPI_clock(uint32_t spi_clock_hz);
+// current simulated time in ns
+uint64_t sim_time_ns(void);
+// let time pass without bus activity (e.g. a timer tick)
+void sim_advance_time(uint64_t ns);
+// like the DWT cycle counter of a 72MHz Cortex-M3, every call takes one cycle
+uint32_t sim_cycle_counter(void);
+// direct access to the memory array, bypassing the bus (for checks and for preloading images)
+uint8_t* sim_memory(void);
+// number of times a 4kB sector has been erased since sim_init()
+uint32_t sim_sector_erase_count(uint32_t sector);
+// let the chip answer READ_SFDP_REG with 0xFF only, like chips without SFDP table
+extern bool sim_SFDP_disabled;
+bool sim_busy(void);
+bool sim_suspended(void);
+bool sim_powered_down(void);
+
+// bus interface used by the driver
+// error flag like SPI1_error, set by every transfer while sim_SPI_timeout is true
+// (like a real timeout, the transfer returns 0xFFFF then)
+extern uint8_t sim_SPI_error;
+extern bool sim_SPI_timeout;
+void sim_CS_low(void);
+void sim_CS_high(void);
+uint16_t sim_SPI_transmit(uint16_t tx_data);
+bool sim_SPI_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint32_t length);
+// the DMA transfers use 16bit frames from this length on (SPI_16BIT_MIN_LENGTH of SPI.h), which leave
+// the bytes swapped in pairs until sim_SPI_DMA_order()
+#define SIM_DMA_16BIT_MIN_LENGTH	16
+void sim_SPI_DMA_transfer(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void));
+void sim_SPI_DMA_transfer8(const uint8_t* tx_buf, uint8_t* rx_buf, uint16_t length, void (*callback)(void));
+void sim_SPI_DMA_order(uint8_t* rx_buf, uint16_t length);
+
+// shared SPI bus, like SPI_bus.h with one other device
+// max. bytes per transaction of the driver (0xFFFFFFFF = no limit, set by sim_init())
+extern uint32_t sim_bus_max_burst;
+// the next <sim_bus_refusals> sim_bus_request() or sim_bus_try() calls fail as if the other device had the bus
+extern uint32_t sim_bus_refusals;
+// called once right after sim_bus_acquire() got the bus, like an interrupt at that moment (NULL = none)
+extern void (*sim_bus_acquire_interrupt)(void);
+void sim_bus_acquire(void);
+bool sim_bus_request(void);
+bool sim_bus_try(void);
+// true if the driver is queued up for the bus (a failed sim_bus_request() and no grant since)
+bool sim_bus_waiting(void);
+void sim_bus_release(void);
+
+/* simulated serial link between a host PC and the µC (for the upload protocol)
+ * every byte takes 10 bit times (start, 8 data, stop bit) */
+#define SIM_UART_BUFFER_SIZE	8192
+void sim_UART_init(uint32_t baud_rate, void (*host_receive)(uint8_t data));
+// host side: the byte arrives one byte time after the previous one
+void sim_UART_host_send(uint8_t data);
+// µC side: sim_UART_available() lets a bit of time pass if nothing has arrived yet
+bool sim_UART_available(void);
+uint8_t sim_UART_read(void);
+// the byte is passed to host_receive() immediately
+void sim_UART_write(uint8_t data);
+
+#endif /* W25Q64JV_SIM_H_ */
@@ -0,0 +1,1101 @@
+/*	host test and benchmark of the W25Q64JV driver
+ *
+ *	the driver (W25Q64JV_SPI_FLASH_MEMORY/W25Q64JV.c) is compiled for the host
+ *	and linked against the simulated chip (W25Q64JV_sim.c). First a set of
+ *	regression checks is run, then the bus traffic and the simulated time of
+ *	typical operations are printed.
+ *
+ *	build and run with "make run", the exit code is the number of failed checks
+ *
+ *  see LICENCE.txt
+ */
+
+#include "W25Q64JV.h"
+#include "W25Q64JV_stream.h"
+#include "W25Q64JV_kvstore.h"
+#include "W25Q64JV_FTL.h"
+#include "W25Q64JV_upload.h"
+#include "W25Q64JV_dump.h"
+#include "W25Q64JV_assets.h"
+#include "W25Q64JV_log.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// SPI clock used for the simulation, 72MHz/SPI_BAUD_DIV_4
+#define SPI_CLOCK	18000000UL
+
+static int failed_checks = 0;
+
+static void check(bool condition, const char* description){
+	if(!condition){
+		failed_checks++;
+		printf("FAILED: %s\n", description);
+	}
+}
+
+static void fill_random(uint8_t* buffer, uint32_t length, uint32_t seed){
+	srand(seed);
+	for(uint32_t i = 0; i<length; i++){
+		buffer[i] = (uint8_t)rand();
+	}
+}
+
+static volatile bool callback_called;
+static void set_callback_called(void){
+	callback_called = true;
+}
+
+static uint32_t stream_offset;
+static uint8_t* stream_source;
+static void fill_page_from_source(uint8_t* buffer, uint16_t length){
+	memcpy(buffer, stream_source + stream_offset, length);
+	stream_offset += length;
+}
+
+/* REGRESSION CHECKS */
+
+static void test_probe(void){
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	check(W25Q64JV_geometry.SFDP && (W25Q64JV_geometry.manufacturer_ID == 0xEF) && (W25Q64JV_geometry.capacity_ID == 0x17), "probe reads JEDEC ID and SFDP");
+	check( (W25Q64JV_geometry.size == 0x800000) && (W25Q64JV_geometry.page_size == 256), "SFDP size and page size");
+	check( (W25Q64JV_geometry.num_erase_types == 3)
+		&& (W25Q64JV_geometry.erase_types[0].size == 0x1000) && (W25Q64JV_geometry.erase_types[0].instruction == SECTOR_ERASE_4KB)
+		&& (W25Q64JV_geometry.erase_types[1].size == 0x8000) && (W25Q64JV_geometry.erase_types[1].instruction == BLOCK_ERASE_32KB)
+		&& (W25Q64JV_geometry.erase_types[2].size == 0x10000) && (W25Q64JV_geometry.erase_types[2].instruction == BLOCK_ERASE_64KB), "SFDP erase types");
+	check( (W25Q64JV_geometry.erase_types[0].typical_time < W25Q64JV_geometry.erase_types[1].typical_time)
+		&& (W25Q64JV_geometry.erase_types[1].typical_time < W25Q64JV_geometry.erase_types[2].typical_time), "SFDP erase times");
+	check( (W25Q64JV_geometry.fast_read_instruction == FAST_READ) && (W25Q64JV_geometry.fast_read_dummy_cycles == 8), "fast read instruction");
+	// without SFDP, the size comes from the JEDEC ID
+	sim_SFDP_disabled = true;
+	W25Q64JV_geometry.size = 0;
+	init_W25Q64JV();
+	sim_SFDP_disabled = false;
+	check(!W25Q64JV_geometry.SFDP && (W25Q64JV_geometry.size == 0x800000), "probe without SFDP");
+	init_W25Q64JV();
+}
+
+static void test_program_and_read(void){
+	uint8_t data[256], readback[256];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 1);
+	write_W25Q64JV(0x001000, 256, data);
+	read_W25Q64JV(0x001000, 256, readback);
+	check(memcmp(data, readback, 256) == 0, "page program + read");
+	memset(readback, 0, sizeof(readback));
+	fast_read_W25Q64JV(0x001000, 256, (char*)readback);
+	check(memcmp(data, readback, 256) == 0, "page program + fast read");
+	check(sim_stats.ignored_instructions == 0, "no instruction ignored while programming");
+	// NOR flash: programming can only clear bits
+	uint8_t value = 0xF0;
+	write_W25Q64JV(0x002000, 1, &value);
+	value = 0x3C;
+	write_W25Q64JV(0x002000, 1, &value);
+	read_W25Q64JV(0x002000, 1, &value);
+	check(value == 0x30, "programming only clears bits");
+	// a single page program wraps around at the end of the page
+	fill_random(data, 32, 2);
+	write_W25Q64JV(0x0030F0, 32, data);
+	read_W25Q64JV(0x003000, 16, readback);
+	check(memcmp(data + 16, readback, 16) == 0, "page program wraps at page boundary");
+	check(sim_memory()[0x003100] == 0xFF, "page program doesn't touch the next page");
+}
+
+static void test_erase(void){
+	uint8_t data[256];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 3);
+	write_W25Q64JV(0x010000, 256, data);
+	write_W25Q64JV(0x011000, 256, data);
+	sector_erase_W25Q64JV(0x010000);
+	check(is_erased_W25Q64JV(0x010000, 0x1000), "sector erase");
+	check(!is_erased_W25Q64JV(0x011000, 0x1000), "sector erase doesn't touch the next sector");
+	block_erase_64KB_W25Q64JV(0x010000);
+	check(is_erased_W25Q64JV(0x010000, 0x10000), "64kB block erase");
+	check(sim_sector_erase_count(0x10) == 2, "sector erase counter");
+}
+
+static uint8_t DMA_data[100000], DMA_readback[100000];
+static volatile bool DMA_data_valid_in_callback;
+static void check_DMA_data(void){
+	callback_called = true;
+	DMA_data_valid_in_callback = (memcmp(DMA_data, DMA_readback, 0x1000) == 0);
+}
+
+static void test_DMA_read(void){
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(DMA_data, sizeof(DMA_data), 4);
+	memcpy(sim_memory() + 0x100000, DMA_data, sizeof(DMA_data));
+	// an even length, which a read without callback would move in 16bit frames
+	callback_called = false;
+	DMA_data_valid_in_callback = false;
+	fast_read_DMA_W25Q64JV(0x100000, 0x1000, DMA_readback, check_DMA_data);
+	check(callback_called && DMA_data_valid_in_callback, "DMA read calls callback with the data in order");
+	while( read_DMA_busy_W25Q64JV() );
+	// without a callback, the bytes are put in order by read_DMA_busy_W25Q64JV()
+	fast_read_DMA_W25Q64JV(0x100000, sizeof(DMA_data), DMA_readback, NULL);
+	while( read_DMA_busy_W25Q64JV() );
+	check(memcmp(DMA_data, DMA_readback, sizeof(DMA_data)) == 0, "DMA read of more than 64kB");
+}
+
+static void test_async(void){
+	uint8_t data[256];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 5);
+	write_W25Q64JV(0x020000, 256, data);
+	callback_called = false;
+	sector_erase_async_W25Q64JV(0x020000, set_callback_called);
+	check(poll_busy_W25Q64JV(), "async erase is busy right after start");
+	check(!callback_called, "async erase callback not called before the end");
+	// a tick that interrupts a transaction or finds the bus taken by another device keeps off the bus
+	uint64_t clocked = sim_stats.bytes_clocked;
+	select_W25Q64JV();
+	bool busy_while_selected = poll_busy_W25Q64JV();
+	deselect_W25Q64JV();
+	// the bus is granted already, but the chip isn't selected yet
+	sim_bus_acquire();
+	bool busy_before_select = poll_busy_W25Q64JV();
+	sim_bus_release();
+	sim_bus_refusals = 1;
+	bool busy_while_taken = poll_busy_W25Q64JV();
+	check(busy_while_selected && busy_before_select && busy_while_taken && (sim_stats.bytes_clocked == clocked), "poll_busy doesn't touch a bus in use");
+	check(!sim_bus_waiting(), "poll_busy doesn't queue up for a bus in use");
+	// a timer tick of 1ms
+	uint32_t ticks = 0;
+	while( poll_busy_W25Q64JV() ){
+		sim_advance_time(1000000);
+		ticks++;
+	}
+	check(callback_called, "async erase calls callback");
+	check( (ticks >= 44) && (ticks <= 46), "async erase takes the sector erase time");
+	check(is_erased_W25Q64JV(0x020000, 0x1000), "async sector erase");
+}
+
+static void test_suspend(void){
+	uint8_t data[256], readback[256];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 6);
+	write_W25Q64JV(0x030000, 256, data);
+	write_W25Q64JV(0x020000, 256, data);
+	callback_called = false;
+	sector_erase_async_W25Q64JV(0x020000, set_callback_called);
+	sim_advance_time(1000000);
+	// the erase is suspended for the read, the read time is tSUS + the transfer itself
+	uint64_t t1 = sim_time_ns();
+	read_W25Q64JV(0x030000, 256, readback);
+	uint64_t latency = sim_time_ns() - t1;
+	check(memcmp(data, readback, sizeof(data)) == 0, "read during a suspended erase");
+	check( (sim_stats.suspends == 1) && sim_busy() && !sim_suspended(), "erase suspended for the read and resumed");
+	check(latency < SIM_T_SUSPEND + 300*8000000000ULL/SPI_CLOCK, "read latency during an erase is bounded by tSUS");
+	// reads right after each other keep the min. time between resume and suspend
+	for(uint8_t read_counter = 0; read_counter<10; read_counter++){
+		fast_read_W25Q64JV(0x030000 + read_counter, 1, (char*)readback);
+		check(readback[0] == data[read_counter], "fast read during a suspended erase");
+	}
+	uint8_t DMA_readback[256];
+	fast_read_DMA_W25Q64JV(0x030000, 256, DMA_readback, NULL);
+	while( read_DMA_busy_W25Q64JV() );
+	check(memcmp(data, DMA_readback, sizeof(data)) == 0, "DMA read during a suspended erase");
+	check(sim_stats.ignored_instructions == 0, "no suspend too early after a resume");
+	uint32_t ticks = 1;
+	while( poll_busy_W25Q64JV() ){
+		sim_advance_time(1000000);
+		ticks++;
+	}
+	check(callback_called && (ticks >= 45) && (ticks <= 47), "suspended erase finishes");
+	check(is_erased_W25Q64JV(0x020000, 0x1000), "suspended erase completes the sector");
+	// a chip erase can't be suspended, the read has to wait for it
+	sim_reset_stats();
+	erase_chip_async_W25Q64JV(NULL);
+	read_W25Q64JV(0x030000, 256, readback);
+	check( (sim_stats.suspends == 0) && !sim_busy() && (readback[0] == 0xFF), "read waits for a chip erase");
+	while( poll_busy_W25Q64JV() );
+}
+
+static void test_power(void){
+	uint8_t data[256], readback[256];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 7);
+	write_W25Q64JV(0x040000, 256, data);
+	idle_W25Q64JV();
+	check(!sim_powered_down(), "no power-down before the idle timeout");
+	sim_advance_time(W25Q64JV_IDLE_TIMEOUT * 1000000ULL);
+	idle_W25Q64JV();
+	check(sim_powered_down() && powered_down_W25Q64JV(), "power-down after the idle timeout");
+	// the next read wakes the chip up, nothing is ignored during the wake-up time
+	sim_advance_time(500000000ULL);
+	sim_reset_stats();
+	uint64_t t1 = sim_time_ns();
+	read_W25Q64JV(0x040000, 256, readback);
+	check(!sim_powered_down() && (memcmp(data, readback, sizeof(data)) == 0), "transparent wake-up for a read");
+	check(sim_stats.ignored_instructions == 0, "read waits for the wake-up time");
+	check(sim_time_ns() - t1 < SIM_T_RELEASE_POWER_DOWN + 300*8000000000ULL/SPI_CLOCK, "wake-up adds only tRES1");
+	check( (W25Q64JV_power_stats.power_downs == 1) && (W25Q64JV_power_stats.wake_ups == 1)
+		&& (W25Q64JV_power_stats.residency_ms >= 500) && (W25Q64JV_power_stats.residency_ms <= 501), "power statistics");
+	// not while the chip is erasing in the background
+	sector_erase_async_W25Q64JV(0x040000, NULL);
+	sim_advance_time(W25Q64JV_IDLE_TIMEOUT * 1000000ULL);
+	idle_W25Q64JV();
+	check(!sim_powered_down(), "no power-down during an async erase");
+	while( poll_busy_W25Q64JV() ) sim_advance_time(1000000);
+	// a powered down chip can still be written
+	sim_advance_time(W25Q64JV_IDLE_TIMEOUT * 1000000ULL);
+	idle_W25Q64JV();
+	write_W25Q64JV(0x040000, 256, data);
+	check(verify_W25Q64JV(0x040000, 256, data) && (W25Q64JV_power_stats.wake_ups == 2), "write after a power-down");
+	set_idle_timeout_W25Q64JV(0);
+	sim_advance_time(1000000000ULL);
+	idle_W25Q64JV();
+	check(!sim_powered_down(), "idle timeout 0 disables the power-down");
+	set_idle_timeout_W25Q64JV(W25Q64JV_IDLE_TIMEOUT);
+}
+
+// what a 1ms timer interrupt of the application would do
+static void timer_tick(void){
+	poll_busy_W25Q64JV();
+	idle_W25Q64JV();
+}
+
+static void test_shared_bus(void){
+	static uint8_t data[0x10000], readback[0x10000];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 9);
+	memcpy(sim_memory() + 0x080000, data, sizeof(data));
+	// another device on the bus allows the flash to hold it for 300 bytes
+	sim_bus_max_burst = 300;
+	uint64_t max_hold = 300*8000000000ULL/SPI_CLOCK + SIM_T_RELEASE_POWER_DOWN;
+	sim_reset_stats();
+	read_W25Q64JV(0x080000, sizeof(readback), readback);
+	check( (memcmp(data, readback, sizeof(data)) == 0) && (sim_stats.max_bus_hold_ns <= max_hold), "read split into bursts");
+	check(sim_stats.bus_grants >= sizeof(data) / 296, "bus released after every burst");
+	memset(readback, 0, sizeof(readback));
+	sim_reset_stats();
+	fast_read_W25Q64JV(0x080000, sizeof(readback), (char*)readback);
+	check( (memcmp(data, readback, sizeof(data)) == 0) && (sim_stats.max_bus_hold_ns <= max_hold), "fast read split into bursts");
+	// the other device takes the bus between the chunks of a DMA read
+	memset(readback, 0, sizeof(readback));
+	sim_reset_stats();
+	sim_bus_refusals = 50;
+	fast_read_DMA_W25Q64JV(0x080000, sizeof(readback), readback, NULL);
+	while( read_DMA_busy_W25Q64JV() );
+	check( (memcmp(data, readback, sizeof(data)) == 0) && (sim_stats.max_bus_hold_ns <= max_hold) && (sim_bus_refusals == 0),
+		"DMA read continues after waiting for the bus");
+	// page programs, the busy wait and the blank check are split, too
+	sim_reset_stats();
+	write_W25Q64JV(0x0A0000, 256, data);
+	write_async_W25Q64JV(0x0A0100, 256, data, NULL);
+	while( poll_busy_W25Q64JV() );
+	check( verify_W25Q64JV(0x0A0000, 256, data) && verify_W25Q64JV(0x0A0100, 256, data) && (sim_stats.page_programs == 2)
+		&& (sim_stats.max_bus_hold_ns <= max_hold), "page programs within the bus burst length");
+	sim_bus_max_burst = 100;
+	sim_reset_stats();
+	write_W25Q64JV(0x0A0200, 256, data);
+	write_async_W25Q64JV(0x0A0300, 256, data, NULL);
+	while( poll_busy_W25Q64JV() );
+	check( verify_W25Q64JV(0x0A0200, 256, data) && verify_W25Q64JV(0x0A0300, 256, data) && (sim_stats.page_programs == 6)
+		&& (sim_stats.max_bus_hold_ns <= max_hold), "long page programs split into bursts");
+	sim_bus_max_burst = 300;
+	sim_reset_stats();
+	check( erase_verify_W25Q64JV(0x0B0000, 0x2000) && (sim_stats.max_bus_hold_ns <= max_hold), "erase and blank check split into bursts");
+	power_down_W25Q64JV();
+	power_up_W25Q64JV();
+	check(sim_stats.transactions_without_bus == 0, "every transaction owns the bus");
+	// a timer tick right after select_W25Q64JV() got the bus must not start a transaction of its own
+	sector_erase_async_W25Q64JV(0x0C0000, NULL);
+	sim_reset_stats();
+	sim_bus_acquire_interrupt = timer_tick;
+	memset(readback, 0, 16);
+	read_W25Q64JV(0x080000, 16, readback);
+	check( (memcmp(data, readback, 16) == 0) && (sim_stats.transactions_without_bus == 0), "a tick during select keeps off the bus");
+	while( poll_busy_W25Q64JV() ) sim_advance_time(1000000);
+	W25Q64JV_stream_t stream;
+	sim_reset_stats();
+	open_stream_W25Q64JV(&stream, 0x080000, sizeof(readback));
+	uint32_t received = 0;
+	while( !end_of_stream_W25Q64JV(&stream) ){
+		service_stream_W25Q64JV(&stream);
+		received += read_stream_W25Q64JV(&stream, &readback[received], sizeof(readback) - received);
+	}
+	check( (received == sizeof(data)) && (memcmp(data, readback, sizeof(data)) == 0) && (sim_stats.max_bus_hold_ns <= max_hold),
+		"stream refills split into bursts");
+	// reads during a background erase: the resume is sent before the bus is released in the
+	// DMA interrupt, the bus must never be acquired there
+	sim_reset_stats();
+	sector_erase_async_W25Q64JV(0x100000, NULL);
+	sim_advance_time(1000000);
+	sim_bus_refusals = 3;
+	fast_read_DMA_W25Q64JV(0x080000, 0x1000, readback, NULL);
+	while( read_DMA_busy_W25Q64JV() );
+	bool resumed = !sim_suspended();
+	open_stream_W25Q64JV(&stream, 0x080000, 0x1000);
+	do{
+		service_stream_W25Q64JV(&stream);
+	}while( stream_refill_busy_W25Q64JV() );
+	resumed = resumed && !sim_suspended();
+	while( poll_busy_W25Q64JV() ) sim_advance_time(1000000);
+	check( resumed && (sim_stats.suspends >= 2) && (sim_stats.bus_acquires_in_interrupt == 0) && (memcmp(data, readback, 0x1000) == 0),
+		"no bus acquire in the DMA interrupt when resuming");
+	sim_bus_max_burst = 0xFFFFFFFF;
+}
+
+static void test_write_buffer(void){
+	static uint8_t data[5000], readback[5000];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 6);
+	// unaligned start address and length
+	write_buffer_W25Q64JV(0x0300A7, sizeof(data), data);
+	read_W25Q64JV(0x0300A7, sizeof(data), readback);
+	check(memcmp(data, readback, sizeof(data)) == 0, "write_buffer across page boundaries");
+	check(sim_memory()[0x0300A6] == 0xFF, "write_buffer doesn't write before the start");
+	check(sim_memory()[0x0300A7 + sizeof(data)] == 0xFF, "write_buffer doesn't write after the end");
+	check(sim_stats.page_programs == 21, "write_buffer uses one program per page touched");
+	check(sim_stats.ignored_instructions == 0, "write_buffer waits for the chip");
+	stream_source = data;
+	stream_offset = 0;
+	write_stream_W25Q64JV(0x040010, sizeof(data), fill_page_from_source);
+	read_W25Q64JV(0x040010, sizeof(data), readback);
+	check(memcmp(data, readback, sizeof(data)) == 0, "write_stream across page boundaries");
+}
+
+static void test_erase_range(void){
+	uint8_t data[16];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 7);
+	// already erased: nothing to do
+	erase_range_W25Q64JV(0x000000, 0x40000);
+	check(sim_stats.sector_erases + sim_stats.block_erases_32KB + sim_stats.block_erases_64KB == 0, "erase_range skips erased regions");
+	// one dirty sector in a 64kB block: a single sector erase is faster
+	write_W25Q64JV(0x013000, sizeof(data), data);
+	sim_reset_stats();
+	erase_range_W25Q64JV(0x010000, 0x10000);
+	check( (sim_stats.sector_erases == 1) && (sim_stats.block_erases_64KB == 0), "erase_range erases only the dirty sector");
+	check(is_erased_W25Q64JV(0x013000, 0x1000), "erase_range erased the dirty sector");
+	// every sector dirty: one 64kB block, one 32kB block and sectors at the edges
+	for(uint32_t address = 0x0FF000; address < 0x11A000; address += 0x1000){
+		write_W25Q64JV(address, sizeof(data), data);
+	}
+	sim_reset_stats();
+	erase_range_W25Q64JV(0x0FF800, 0x11A000 - 0x0FF800);
+	check(sim_stats.block_erases_64KB == 1, "erase_range uses 64kB blocks");
+	check(sim_stats.block_erases_32KB == 1, "erase_range uses 32kB blocks");
+	check(sim_stats.sector_erases == 3, "erase_range uses sectors at the edges");
+	check(is_erased_W25Q64JV(0x0FF000, 0x11A000 - 0x0FF000), "erase_range erased the whole range");
+	// the blank check compares words, a single bit at the end of an odd length still counts
+	sim_memory()[0x120000 + 0xFFE] = 0xFE;
+	check(!is_erased_W25Q64JV(0x120000, 0xFFF) && is_erased_W25Q64JV(0x120000, 0xFFE) && is_erased_W25Q64JV(0x120FFF, 1), "blank check of odd lengths");
+	// a chip whose SFDP table lists an erase type smaller than a sector (e.g. a page erase)
+	W25Q64JV_geometry_t geometry = W25Q64JV_geometry;
+	memmove(&W25Q64JV_geometry.erase_types[1], &W25Q64JV_geometry.erase_types[0], 3*sizeof(W25Q64JV_erase_type_t));
+	W25Q64JV_geometry.erase_types[0] = (W25Q64JV_erase_type_t){0xDB, 256, 1};
+	W25Q64JV_geometry.num_erase_types = 4;
+	sim_reset_stats();
+	erase_range_W25Q64JV(0x120000, 0x1000);
+	W25Q64JV_geometry = geometry;
+	check( (sim_stats.sector_erases == 1) && is_erased_W25Q64JV(0x120000, 0x1000), "erase_range picks the sector erase by its size");
+}
+
+static void test_cache(void){
+	uint8_t data[256], readback[300];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	invalidate_cache_W25Q64JV();
+	W25Q64JV_cache_hits = 0;
+	W25Q64JV_cache_misses = 0;
+	fill_random(data, sizeof(data), 9);
+	write_W25Q64JV(0x050000, 256, data);
+	cached_read_W25Q64JV(0x050010, 16, readback);
+	cached_read_W25Q64JV(0x050020, 16, readback);
+	check( (W25Q64JV_cache_misses == 1) && (W25Q64JV_cache_hits == 1), "cache hit on second read of the same page");
+	// a read across a page boundary uses two entries
+	cached_read_W25Q64JV(0x0500F0, 32, readback);
+	check(memcmp(readback, data + 0xF0, 16) == 0, "cached read across page boundary");
+	check(W25Q64JV_cache_misses == 2, "cached read across page boundary loads the next page");
+	// programming updates the cached page
+	uint8_t value = 0x00;
+	write_W25Q64JV(0x050100, 1, &value);
+	cached_read_W25Q64JV(0x050100, 1, readback);
+	check(readback[0] == 0x00, "cache is updated by page program");
+	// erasing updates the cached page
+	sector_erase_W25Q64JV(0x050000);
+	uint32_t misses = W25Q64JV_cache_misses;
+	cached_read_W25Q64JV(0x050000, 256, readback);
+	check(readback[0] == 0xFF && readback[255] == 0xFF, "cache is updated by erase");
+	check(W25Q64JV_cache_misses == misses, "erase doesn't evict cached pages");
+	// least recently used page is replaced: touch 9 pages, the first one is gone
+	for(uint32_t page = 0; page < 9; page++){
+		cached_read_W25Q64JV(0x060000 + page*256, 1, readback);
+	}
+	misses = W25Q64JV_cache_misses;
+	cached_read_W25Q64JV(0x060100, 1, readback);
+	check(W25Q64JV_cache_misses == misses, "recently used page stays in the cache");
+	cached_read_W25Q64JV(0x060000, 1, readback);
+	check(W25Q64JV_cache_misses == misses + 1, "least recently used page is replaced");
+}
+
+static void test_stream(void){
+	static uint8_t data[10000], readback[10000];
+	static W25Q64JV_stream_t stream;
+	uint8_t other[16];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	fill_random(data, sizeof(data), 11);
+	memcpy(sim_memory() + 0x070123, data, sizeof(data));
+	open_stream_W25Q64JV(&stream, 0x070123, sizeof(data));
+	uint32_t received = 0;
+	uint32_t loops = 0;
+	while( !end_of_stream_W25Q64JV(&stream) && (loops++ < 100000) ){
+		service_stream_W25Q64JV(&stream);
+		// another transaction on the bus between the refills
+		read_W25Q64JV(0, sizeof(other), other);
+		// the reader takes fewer bytes than a refill delivers
+		received += read_stream_W25Q64JV(&stream, readback + received, 100);
+	}
+	check(received == sizeof(data), "stream delivers exactly the requested length");
+	check(memcmp(data, readback, sizeof(data)) == 0, "stream data with other transactions in between");
+}
+
+#define KV_TEST_START	0x200000
+#define KV_TEST_SECTORS	4
+
+static bool KV_equals(const char* key, const char* expected){
+	char value[64];
+	int32_t length = get_KV_W25Q64JV(key, (uint8_t*)value, sizeof(value) - 1);
+	if(length < 0) return expected == NULL;
+	value[length] = '\0';
+	return (expected != NULL) && (strcmp(value, expected) == 0);
+}
+
+static bool KV_set_string(const char* key, const char* value){
+	return set_KV_W25Q64JV(key, (const uint8_t*)value, strlen(value));
+}
+
+static void test_KV_store(void){
+	char value[64];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	invalidate_cache_W25Q64JV();
+	check(init_KV_store_W25Q64JV(KV_TEST_START, KV_TEST_SECTORS), "KV store init on erased flash");
+	check(KV_set_string("gain", "12") && KV_set_string("offset", "-3"), "KV set");
+	check(KV_equals("gain", "12") && KV_equals("offset", "-3"), "KV get");
+	check(KV_set_string("gain", "15") && KV_equals("gain", "15"), "KV overwrite");
+	check(KV_equals("missing", NULL), "KV get of a missing key");
+	check(delete_KV_W25Q64JV("offset") && KV_equals("offset", NULL), "KV delete");
+	check(count_KV_W25Q64JV() == 1, "KV count");
+	// the index is rebuilt from the log
+	init_KV_store_W25Q64JV(KV_TEST_START, KV_TEST_SECTORS);
+	check(KV_equals("gain", "15") && KV_equals("offset", NULL), "KV values after re-init");
+
+	// many updates: the oldest sectors are compacted
+	sim_reset_stats();
+	bool ok = true;
+	for(uint32_t update = 0; update < 2000; update++){
+		snprintf(value, sizeof(value), "calibration value number %lu", (unsigned long)update);
+		ok &= KV_set_string( (update % 3 == 0) ? "cal0" : ((update % 3 == 1) ? "cal1" : "cal2"), value);
+	}
+	check(ok, "KV set with garbage collection");
+	check(KV_equals("cal0", "calibration value number 1998") && KV_equals("cal1", "calibration value number 1999")
+		&& KV_equals("cal2", "calibration value number 1997") && KV_equals("gain", "15"), "KV values after garbage collection");
+	check(sim_stats.sector_erases < 2000 / 50, "KV updates cost page programs, not sector erases");
+	init_KV_store_W25Q64JV(KV_TEST_START, KV_TEST_SECTORS);
+	check(KV_equals("cal1", "calibration value number 1999") && KV_equals("gain", "15") && (count_KV_W25Q64JV() == 4), "KV values after garbage collection and re-init");
+
+	// power failure while writing: the record is cut off, the previous value stays valid
+	KV_set_string("mode", "old");
+	uint8_t* memory = sim_memory();
+	KV_set_string("mode", "new");
+	// find the last record and damage its value like an incomplete page program would
+	uint32_t address = KV_TEST_START + KV_TEST_SECTORS*0x1000 - 1;
+	while( memory[address] == 0xFF ) address--;
+	memory[address] = 0xFF;
+	memory[address - 1] = 0xFF;
+	init_KV_store_W25Q64JV(KV_TEST_START, KV_TEST_SECTORS);
+	check(KV_equals("mode", "old"), "KV keeps the old value after an incomplete write");
+	check(KV_set_string("mode", "newer") && KV_equals("mode", "newer"), "KV set after an incomplete write");
+	init_KV_store_W25Q64JV(KV_TEST_START, KV_TEST_SECTORS);
+	check(KV_equals("mode", "newer") && KV_equals("cal2", "calibration value number 1997"), "KV values after an incomplete write and re-init");
+
+	// power failure during a compaction: the copy in the former reserve sector is cut off,
+	// the oldest sector hasn't been erased yet
+	static uint8_t before[KV_TEST_SECTORS*0x1000];
+	uint8_t copy[0x1000];
+	uint32_t update = 0;
+	int16_t victim = -1, reserve = -1;
+	bool copied = false;
+	// wait for a compaction that copies records of other keys
+	while( !copied && (update < 1000) ){
+		memcpy(before, memory + KV_TEST_START, sizeof(before));
+		snprintf(value, sizeof(value), "setting %lu", (unsigned long)update++);
+		KV_set_string("cal1", value);
+		victim = -1;
+		reserve = -1;
+		for(int16_t sector = 0; sector < KV_TEST_SECTORS; sector++){
+			bool erased_before = true, erased_now = true;
+			for(uint32_t offset = 0; offset < 0x1000; offset++){
+				erased_before &= (before[sector*0x1000 + offset] == 0xFF);
+				erased_now &= (memory[KV_TEST_START + sector*0x1000 + offset] == 0xFF);
+			}
+			if(!erased_before && erased_now) victim = sector;
+			if(erased_before && !erased_now) reserve = sector;
+		}
+		if( (victim >= 0) && (reserve >= 0) ){
+			memcpy(copy, memory + KV_TEST_START + reserve*0x1000, sizeof(copy));
+			// sector header (8 bytes), record header (6 bytes), key
+			copied = (memcmp(&copy[14], "cal1", 4) != 0);
+		}
+	}
+	memcpy(memory + KV_TEST_START, before, sizeof(before));
+	memcpy(memory + KV_TEST_START + reserve*0x1000, copy, sizeof(copy));
+	// the first copied record is cut off
+	memory[KV_TEST_START + reserve*0x1000 + 16] = 0xFF;
+	invalidate_cache_W25Q64JV();
+	char expected[64];
+	snprintf(expected, sizeof(expected), "setting %lu", (unsigned long)update - 2);
+	init_KV_store_W25Q64JV(KV_TEST_START, KV_TEST_SECTORS);
+	check( copied && KV_equals("cal1", expected) && KV_equals("mode", "newer") && KV_equals("gain", "15"),
+		"KV values after an interrupted compaction");
+	ok = true;
+	for(update = 0; update < 200; update++){
+		ok &= KV_set_string("cal0", "after the compaction");
+	}
+	init_KV_store_W25Q64JV(KV_TEST_START, KV_TEST_SECTORS);
+	check(ok && KV_equals("cal0", "after the compaction") && KV_equals("cal1", expected), "KV not full after an interrupted compaction");
+}
+
+#define FTL_TEST_START		0x300000
+#define FTL_TEST_SECTORS	8
+
+static void test_FTL(void){
+	static uint8_t expected[FTL_TEST_SECTORS][FTL_BLOCK_SIZE];
+	static uint8_t buffer[FTL_BLOCK_SIZE];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	invalidate_cache_W25Q64JV();
+	check(!init_FTL_W25Q64JV(FTL_TEST_START + 1, FTL_TEST_SECTORS), "FTL rejects an unaligned start address");
+	check(init_FTL_W25Q64JV(FTL_TEST_START, FTL_TEST_SECTORS), "FTL init on erased flash");
+	uint16_t blocks = num_blocks_FTL_W25Q64JV();
+	check(blocks == FTL_TEST_SECTORS - FTL_SPARE_SECTORS, "FTL number of blocks");
+	read_FTL_W25Q64JV(0, 0, FTL_BLOCK_SIZE, buffer);
+	check(buffer[0] == 0xFF && buffer[FTL_BLOCK_SIZE - 1] == 0xFF, "FTL unwritten block reads 0xFF");
+	check(!write_FTL_W25Q64JV(blocks, 0, 1, buffer) && !write_FTL_W25Q64JV(0, FTL_BLOCK_SIZE - 1, 2, buffer), "FTL rejects writes outside of the blocks");
+
+	// whole blocks, then partial overwrites of some of them
+	for(uint16_t block = 0; block < blocks; block++){
+		fill_random(expected[block], FTL_BLOCK_SIZE, 200 + block);
+		write_FTL_W25Q64JV(block, 0, FTL_BLOCK_SIZE, expected[block]);
+	}
+	bool ok = true;
+	for(uint32_t update = 0; update < 300; update++){
+		uint16_t block = update % 2;
+		uint32_t offset = (update * 97) % (FTL_BLOCK_SIZE - 300);
+		fill_random(&expected[block][offset], 300, update);
+		ok &= write_FTL_W25Q64JV(block, offset, 300, &expected[block][offset]);
+	}
+	check(ok, "FTL partial writes");
+	ok = true;
+	for(uint16_t block = 0; block < blocks; block++){
+		read_FTL_W25Q64JV(block, 0, FTL_BLOCK_SIZE, buffer);
+		ok &= (memcmp(buffer, expected[block], FTL_BLOCK_SIZE) == 0);
+	}
+	check(ok, "FTL read back");
+	uint32_t min_count, max_count;
+	erase_counts_FTL_W25Q64JV(&min_count, &max_count);
+	check(max_count - min_count <= FTL_WEAR_THRESHOLD + 2, "FTL spreads the erases over all sectors");
+
+	// the block map is rebuilt from the sector headers
+	init_FTL_W25Q64JV(FTL_TEST_START, FTL_TEST_SECTORS);
+	ok = true;
+	for(uint16_t block = 0; block < blocks; block++){
+		read_FTL_W25Q64JV(block, 0, FTL_BLOCK_SIZE, buffer);
+		ok &= (memcmp(buffer, expected[block], FTL_BLOCK_SIZE) == 0);
+	}
+	check(ok, "FTL read back after re-init");
+	uint32_t min_after, max_after;
+	erase_counts_FTL_W25Q64JV(&min_after, &max_after);
+	check(min_after == min_count && max_after == max_count, "FTL erase counts survive a re-init");
+
+	// power failure before the commit: the data pages of the new copy are written, the header isn't
+	uint8_t* memory = sim_memory();
+	fill_random(buffer, FTL_BLOCK_SIZE, 999);
+	write_FTL_W25Q64JV(3, 0, FTL_BLOCK_SIZE, buffer);
+	uint32_t new_copy = FTL_TEST_START;
+	while( memcmp(&memory[new_copy + 0x100], buffer, 16) != 0 ) new_copy += 0x1000;
+	memset(&memory[new_copy + 8], 0xFF, 8);
+	// ... and the old copy was not erased yet
+	uint32_t old_copy = FTL_TEST_START;
+	while( memory[old_copy + 8] != 0xFF ) old_copy += 0x1000;
+	memcpy(&memory[old_copy], &memory[new_copy], 8);
+	memcpy(&memory[old_copy + 0x100], expected[3], FTL_BLOCK_SIZE);
+	uint32_t sequence = 1;
+	uint32_t block_id = 3 | (0xFFFCUL << 16);
+	memcpy(&memory[old_copy + 8], &sequence, 4);
+	memcpy(&memory[old_copy + 12], &block_id, 4);
+	init_FTL_W25Q64JV(FTL_TEST_START, FTL_TEST_SECTORS);
+	read_FTL_W25Q64JV(3, 0, FTL_BLOCK_SIZE, buffer);
+	check(memcmp(buffer, expected[3], FTL_BLOCK_SIZE) == 0, "FTL keeps the old copy after an incomplete write");
+	fill_random(expected[3], FTL_BLOCK_SIZE, 1000);
+	write_FTL_W25Q64JV(3, 0, FTL_BLOCK_SIZE, expected[3]);
+	init_FTL_W25Q64JV(FTL_TEST_START, FTL_TEST_SECTORS);
+	ok = true;
+	for(uint16_t block = 0; block < blocks; block++){
+		read_FTL_W25Q64JV(block, 0, FTL_BLOCK_SIZE, buffer);
+		ok &= (memcmp(buffer, expected[block], FTL_BLOCK_SIZE) == 0);
+	}
+	check(ok, "FTL write and re-init after an incomplete write");
+}
+
+/* a host that uploads <upload_image> with the upload protocol (go-back-N with a window of UPLOAD_WINDOW frames)
+ * frame <corrupt_frame> is damaged and frame <drop_frame> is lost the first time they are sent */
+#define UPLOAD_TEST_START	0x400080
+#define UPLOAD_TEST_LENGTH	50000
+#define UPLOAD_BAUD_RATE	921600
+
+static uint8_t upload_image[UPLOAD_TEST_LENGTH];
+static struct {
+	uint32_t num_frames, base, next, sent;
+	uint32_t corrupt_frame, drop_frame;
+	uint32_t retransmissions;
+	uint8_t reply[2], reply_length;
+} host;
+
+static void host_send_frame(uint32_t frame){
+	uint32_t offset = frame * UPLOAD_CHUNK_SIZE;
+	uint16_t length = (UPLOAD_TEST_LENGTH - offset < UPLOAD_CHUNK_SIZE) ? (UPLOAD_TEST_LENGTH - offset) : UPLOAD_CHUNK_SIZE;
+	uint8_t header[3] = {(uint8_t)frame, (uint8_t)length, (uint8_t)(length >> 8)};
+	uint16_t crc = upload_CRC16(upload_image + offset, length, upload_CRC16(header, 3, 0xFFFF));
+	if(frame < host.sent) host.retransmissions++;
+	else host.sent = frame + 1;
+	if(frame == host.drop_frame){
+		host.drop_frame = 0xFFFFFFFF;
+		return;
+	}
+	sim_UART_host_send(UPLOAD_SYNC);
+	for(uint8_t i = 0; i<3; i++) sim_UART_host_send(header[i]);
+	for(uint16_t i = 0; i<length; i++){
+		uint8_t data = upload_image[offset + i];
+		if( (frame == host.corrupt_frame) && (i == 100) ){
+			data ^= 0x10;
+			host.corrupt_frame = 0xFFFFFFFF;
+		}
+		sim_UART_host_send(data);
+	}
+	sim_UART_host_send((uint8_t)crc);
+	sim_UART_host_send((uint8_t)(crc >> 8));
+}
+
+static void host_receive(uint8_t data){
+	host.reply[host.reply_length++] = data;
+	if(host.reply_length < 2) return;
+	host.reply_length = 0;
+	// the frame number with the received sequence number in the window
+	uint32_t frame = host.base + (uint8_t)(host.reply[1] - (uint8_t)host.base);
+	if(host.reply[0] == UPLOAD_ACK){
+		if(frame < host.next) host.base = frame + 1;
+	}else if(host.reply[0] == UPLOAD_NAK){
+		if(frame <= host.next){
+			host.base = frame;
+			host.next = frame;
+		}
+	}
+	while( (host.next < host.num_frames) && (host.next - host.base < UPLOAD_WINDOW) ){
+		host_send_frame(host.next++);
+	}
+}
+
+static bool upload_test_image(uint32_t corrupt_frame, uint32_t drop_frame){
+	memset(&host, 0, sizeof(host));
+	host.num_frames = (UPLOAD_TEST_LENGTH + UPLOAD_CHUNK_SIZE - 1) / UPLOAD_CHUNK_SIZE;
+	host.corrupt_frame = corrupt_frame;
+	host.drop_frame = drop_frame;
+	sim_UART_init(UPLOAD_BAUD_RATE, host_receive);
+	return upload_W25Q64JV(UPLOAD_TEST_START, UPLOAD_TEST_LENGTH);
+}
+
+static void test_upload(void){
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	invalidate_cache_W25Q64JV();
+	fill_random(upload_image, UPLOAD_TEST_LENGTH, 77);
+	check(upload_test_image(0xFFFFFFFF, 0xFFFFFFFF), "upload finished");
+	check(memcmp(sim_memory() + UPLOAD_TEST_START, upload_image, UPLOAD_TEST_LENGTH) == 0, "uploaded data");
+	check(host.retransmissions == 0, "upload without errors needs no retransmissions");
+
+	erase_range_W25Q64JV(UPLOAD_TEST_START, UPLOAD_TEST_LENGTH);
+	fill_random(upload_image, UPLOAD_TEST_LENGTH, 78);
+	check(upload_test_image(20, 90), "upload with a damaged and a lost frame finished");
+	check(memcmp(sim_memory() + UPLOAD_TEST_START, upload_image, UPLOAD_TEST_LENGTH) == 0, "uploaded data after retransmissions");
+	check( (host.retransmissions > 0) && (host.retransmissions <= 2*UPLOAD_WINDOW), "upload retransmits only the window after an error");
+
+	// the host stops sending
+	sim_UART_init(UPLOAD_BAUD_RATE, NULL);
+	check(!upload_W25Q64JV(UPLOAD_TEST_START, UPLOAD_TEST_LENGTH), "upload timeout");
+}
+
+static uint8_t dump_received[0x4000];
+static uint32_t dump_received_length;
+static void dump_receive(uint8_t data){
+	if(dump_received_length < sizeof(dump_received)) dump_received[dump_received_length++] = data;
+}
+
+static void test_dump(void){
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	invalidate_cache_W25Q64JV();
+	uint8_t* memory = sim_memory();
+	// check value of the CRC32
+	memcpy(memory + 0x1234, "123456789", 9);
+	dump_received_length = 0;
+	sim_UART_init(921600, dump_receive);
+	uint32_t crc = dump_W25Q64JV(0x1234, 9, true);
+	const uint8_t trailer[4] = {0x26, 0x39, 0xF4, 0xCB};
+	check( (crc == 0xCBF43926) && (dump_received_length == 13) && (memcmp(dump_received, "123456789", 9) == 0)
+		&& (memcmp(dump_received + 9, trailer, 4) == 0), "dump with CRC32 trailer");
+	// several buffers, the last one partly filled
+	fill_random(memory + 0x10000, 3000, 21);
+	dump_received_length = 0;
+	dump_W25Q64JV(0x10000, 3000, false);
+	check( (dump_received_length == 3000) && (memcmp(dump_received, memory + 0x10000, 3000) == 0), "dump of several buffers");
+}
+
+static void test_integrity(void){
+	static uint8_t data[3000];
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	invalidate_cache_W25Q64JV();
+	uint8_t* memory = sim_memory();
+	memcpy(memory + 0x5000, "123456789", 9);
+	check(crc32_W25Q64JV(0x5000, 9) == 0xCBF43926, "CRC32 check value");
+	check(crc32_buffer_W25Q64JV(crc32_buffer_W25Q64JV(0, (const uint8_t*)"1234", 4), (const uint8_t*)"56789", 5) == 0xCBF43926, "CRC32 in pieces");
+	fill_random(data, sizeof(data), 31);
+	check(write_verify_W25Q64JV(0x6080, sizeof(data), data), "write and verify");
+	check(crc32_W25Q64JV(0x6080, sizeof(data)) == crc32_buffer_W25Q64JV(0, data, sizeof(data)), "CRC32 of a range");
+	// a bit that doesn't get programmed (e.g. a worn out cell)
+	memory[0x6080 + 2000] |= 0x01;
+	data[2000] &= ~0x01;
+	check(!verify_W25Q64JV(0x6080, sizeof(data), data), "verify detects a wrong bit");
+	check(write_verify_W25Q64JV(0x20000, sizeof(data), data), "verify after write on erased flash");
+	// bus failure
+	sim_SPI_timeout = true;
+	check(!is_erased_W25Q64JV(0x100000, 16), "blank check fails on an SPI error");
+	uint8_t readback[16];
+	check(!read_W25Q64JV(0x6080, sizeof(readback), readback), "read fails on an SPI error");
+	check(!cached_read_W25Q64JV(0x6080, sizeof(readback), readback), "cached read fails on an SPI error");
+	sim_SPI_timeout = false;
+	check(cached_read_W25Q64JV(0x6080, sizeof(readback), readback) && (memcmp(readback, data, sizeof(readback)) == 0), "failed read isn't cached");
+	check(erase_verify_W25Q64JV(0x6080, sizeof(data)) && is_erased_W25Q64JV(0x6000, 0x1000), "erase and blank check");
+}
+
+#define ASSET_TEST_IMAGE	0x300000
+
+// put an asset image like W25Q64JV_HOST_ASSET_PACKER builds it into the chip
+static void put_asset_image(uint32_t address, const char** names, const uint32_t* lengths, uint16_t num_assets){
+	static W25Q64JV_asset_t entries[ASSETS_MAX];
+	memset(entries, 0, sizeof(entries));
+	uint32_t offset = ASSET_HEADER_SIZE + num_assets*ASSET_ENTRY_SIZE;
+	for(uint16_t index = 0; index < num_assets; index++){
+		offset = (offset + W25Q64JV_PAGE_SIZE - 1) & ~(W25Q64JV_PAGE_SIZE - 1);
+		strcpy(entries[index].name, names[index]);
+		entries[index].offset = offset;
+		entries[index].length = lengths[index];
+		entries[index].sample_rate = 8000 * (index + 1);
+		entries[index].format = ASSET_FORMAT_U8;
+		fill_random(sim_memory() + address + offset, lengths[index], 100 + index);
+		offset += lengths[index];
+	}
+	uint32_t header[4] = {ASSET_MAGIC, num_assets | (ASSET_ENTRY_SIZE << 16), crc32_buffer_W25Q64JV(0, (uint8_t*)entries, num_assets*ASSET_ENTRY_SIZE), 0xFFFFFFFF};
+	memcpy(sim_memory() + address, header, sizeof(header));
+	memcpy(sim_memory() + address + ASSET_HEADER_SIZE, entries, num_assets*ASSET_ENTRY_SIZE);
+}
+
+static void test_assets(void){
+	static uint8_t expected[5000], readback[5000];
+	static W25Q64JV_stream_t stream;
+	const char* names[] = {"startup", "click", "alarm", "a_long_name_15c"};
+	const uint32_t lengths[] = {5000, 1, 777, 300};
+	check(sizeof(W25Q64JV_asset_t) == ASSET_ENTRY_SIZE, "asset entry size");
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	check(!mount_assets_W25Q64JV(ASSET_TEST_IMAGE) && (find_asset_W25Q64JV("startup") == NULL), "no assets in an erased chip");
+	put_asset_image(ASSET_TEST_IMAGE, names, lengths, 4);
+	check(mount_assets_W25Q64JV(ASSET_TEST_IMAGE) && (num_assets_W25Q64JV() == 4), "mount the asset directory");
+	// the lookup doesn't touch the bus
+	sim_reset_stats();
+	const W25Q64JV_asset_t* alarm = find_asset_W25Q64JV("alarm");
+	check( (alarm != NULL) && (alarm == asset_W25Q64JV(2)) && (alarm->length == 777) && (alarm->sample_rate == 24000), "find an asset by name");
+	check( (find_asset_W25Q64JV("a_long_name_15c") == asset_W25Q64JV(3)) && (find_asset_W25Q64JV("alar") == NULL)
+		&& (find_asset_W25Q64JV("alarms") == NULL) && (asset_W25Q64JV(4) == NULL), "asset lookup misses");
+	check(sim_stats.transactions == 0, "asset lookup from RAM");
+	// each clip is streamed up to its last byte, and not further
+	for(uint16_t index = 0; index < 4; index++){
+		const W25Q64JV_asset_t* asset = asset_W25Q64JV(index);
+		fill_random(expected, asset->length, 100 + index);
+		open_asset_stream_W25Q64JV(&stream, asset);
+		uint32_t received = 0;
+		while( !end_of_stream_W25Q64JV(&stream) ){
+			service_stream_W25Q64JV(&stream);
+			received += read_stream_W25Q64JV(&stream, readback + received, sizeof(readback) - received);
+		}
+		check( (received == asset->length) && (memcmp(expected, readback, received) == 0), "asset stream ends at the end of the clip");
+	}
+	// a damaged directory is rejected
+	sim_memory()[ASSET_TEST_IMAGE + ASSET_HEADER_SIZE + 40] ^= 1;
+	check(!mount_assets_W25Q64JV(ASSET_TEST_IMAGE) && (num_assets_W25Q64JV() == 0) && (find_asset_W25Q64JV("startup") == NULL), "asset directory CRC");
+}
+
+#define LOG_TEST_START		0x400000
+#define LOG_TEST_SECTORS	64
+
+// append <count> records holding a counter from <first> on, with different lengths
+static bool append_counted_records(uint32_t first, uint32_t count){
+	uint8_t record[LOG_MAX_RECORD];
+	memset(record, 0xA5, sizeof(record));
+	for(uint32_t counter = first; counter < first + count; counter++){
+		memcpy(record, &counter, sizeof(counter));
+		if( !append_log_W25Q64JV(record, 4 + counter % 37) ) return false;
+		service_log_W25Q64JV();
+		// one record per ms
+		sim_advance_time(1000000);
+	}
+	flush_log_W25Q64JV();
+	return true;
+}
+
+// read the whole log, it must hold the counters up to <last>; returns the number of records
+static uint32_t check_counted_records(uint32_t last, bool* ok){
+	log_cursor_t cursor;
+	uint8_t record[LOG_MAX_RECORD];
+	uint32_t timestamp, previous_timestamp = 0;
+	uint32_t counter, expected = 0, count = 0;
+	int16_t length;
+	*ok = true;
+	rewind_log_W25Q64JV(&cursor);
+	while( (length = read_log_W25Q64JV(&cursor, &timestamp, record, sizeof(record))) >= 0 ){
+		memcpy(&counter, record, sizeof(counter));
+		if(count == 0) expected = counter;
+		if( (counter != expected) || (length != (int16_t)(4 + counter % 37)) || (timestamp < previous_timestamp) ) *ok = false;
+		previous_timestamp = timestamp;
+		expected++;
+		count++;
+	}
+	if(expected != last + 1) *ok = false;
+	return count;
+}
+
+static void test_log(void){
+	bool ok;
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+	// some old data in the area
+	memset(sim_memory() + LOG_TEST_START + 0x3000, 0x12, 0x2000);
+	check(init_log_W25Q64JV(LOG_TEST_START, LOG_TEST_SECTORS), "init an empty log");
+	check(append_counted_records(0, 1000), "append records");
+	check( (check_counted_records(999, &ok) == 1000) && ok, "read the log");
+	// after a reset the log continues at its head
+	init_log_W25Q64JV(LOG_TEST_START, LOG_TEST_SECTORS);
+	check( (check_counted_records(999, &ok) == 1000) && ok, "log found after a reset");
+	check(append_counted_records(1000, 500) && (check_counted_records(1499, &ok) == 1500) && ok, "log continued after a reset");
+	// several laps: the oldest records are overwritten
+	check(append_counted_records(1500, 20000), "append records for several laps");
+	uint32_t count = check_counted_records(21499, &ok);
+	check(ok && (count > (LOG_TEST_SECTORS - 2) * (W25Q64JV_SECTOR_SIZE / 32)) && (count < 21500), "log wraps around");
+	sim_reset_stats();
+	init_log_W25Q64JV(LOG_TEST_START, LOG_TEST_SECTORS);
+	check(sim_stats.transactions < 20, "binary search for the head");
+	check( (check_counted_records(21499, &ok) == count) && ok, "wrapped log found after a reset");
+	// a reset while the sector ahead of the head was erased: only half of it is erased
+	for(uint32_t sector = 0; sector < LOG_TEST_SECTORS; sector++){
+		uint32_t address = LOG_TEST_START + sector*W25Q64JV_SECTOR_SIZE;
+		if( (sim_memory()[address] == 0xFF) && (sim_memory()[address + 0x800] == 0xFF) ){
+			memset(sim_memory() + address + 0x800, 0, 0x800);
+			break;
+		}
+	}
+	init_log_W25Q64JV(LOG_TEST_START, LOG_TEST_SECTORS);
+	check(append_counted_records(21500, 3000) && (check_counted_records(24499, &ok) > 0) && ok, "interrupted erase ahead");
+	check(log_stats.dropped == 0, "no records dropped at 1000 records/s");
+}
+
+/* BENCHMARKS */
+
+static void print_stats(const char* name, uint32_t payload_bytes){
+	double time_ms = sim_time_ns() / 1e6;
+	printf("%-40s %10.2f ms %10llu bytes clocked %8u transactions",
+		name, time_ms, (unsigned long long)sim_stats.bytes_clocked, sim_stats.transactions);
+	if(payload_bytes > 0 && time_ms > 0){
+		printf(" %8.1f kB/s", payload_bytes / time_ms);
+	}
+	printf("\n");
+}
+
+static void start_benchmark(void){
+	sim_init(SPI_CLOCK);
+	init_W25Q64JV();
+}
+
+static void benchmark(void){
+	static uint8_t buffer[0x10000];
+	printf("\nsimulated SPI clock: %lu Hz\n", SPI_CLOCK);
+
+	start_benchmark();
+	read_W25Q64JV(0, sizeof(buffer), buffer);
+	print_stats("read 64kB", sizeof(buffer));
+
+	start_benchmark();
+	for(uint32_t address = 0; address < sizeof(buffer); address += 16){
+		read_W25Q64JV(address, 16, buffer);
+	}
+	print_stats("read 64kB in 16 byte pieces", sizeof(buffer));
+
+	start_benchmark();
+	invalidate_cache_W25Q64JV();
+	srand(10);
+	for(uint32_t read_counter = 0; read_counter < 4096; read_counter++){
+		// small reads from 6 metadata pages
+		cached_read_W25Q64JV( (rand() % 6)*0x1000 + (rand() % 16)*16, 16, buffer);
+	}
+	print_stats("4096 random 16 byte reads, cached", 0);
+	start_benchmark();
+	invalidate_cache_W25Q64JV();
+	srand(10);
+	for(uint32_t read_counter = 0; read_counter < 4096; read_counter++){
+		read_W25Q64JV( (rand() % 6)*0x1000 + (rand() % 16)*16, 16, buffer);
+	}
+	print_stats("4096 random 16 byte reads, no cache", 0);
+
+	start_benchmark();
+	fast_read_DMA_W25Q64JV(0, sizeof(buffer), buffer, NULL);
+	print_stats("DMA read 64kB", sizeof(buffer));
+
+	// small reads while a 64kB block is erased in the background
+	start_benchmark();
+	block_erase_64KB_async_W25Q64JV(0x100000, NULL);
+	uint64_t max_latency = 0;
+	for(uint32_t read_counter = 0; read_counter < 1000; read_counter++){
+		uint64_t t1 = sim_time_ns();
+		read_W25Q64JV(read_counter*16, 16, buffer);
+		if(sim_time_ns() - t1 > max_latency) max_latency = sim_time_ns() - t1;
+		sim_advance_time(100000);
+	}
+	while( poll_busy_W25Q64JV() ) sim_advance_time(1000000);
+	print_stats("1000 reads during a 64kB block erase", 0);
+	printf("  max. read latency %.1f us (%u suspends), without suspend up to %.0f us\n",
+		max_latency / 1e3, sim_stats.suspends, SIM_T_BLOCK_ERASE_64KB / 1e3);
+
+	start_benchmark();
+	fill_random(buffer, sizeof(buffer), 8);
+	write_buffer_W25Q64JV(0x80, sizeof(buffer), buffer);
+	print_stats("write 64kB (unaligned)", sizeof(buffer));
+	printf("%-40s %10.2f ms\n", "  datasheet program time (tPP)", (sizeof(buffer)/256 + 1) * SIM_T_PAGE_PROGRAM / 1e6);
+
+	// dirty every second sector of 1MB
+	start_benchmark();
+	for(uint32_t address = 0; address < 0x100000; address += 0x2000){
+		sim_memory()[address] = 0;
+	}
+	sim_reset_stats();
+	erase_range_W25Q64JV(0, 0x100000);
+	print_stats("erase 1MB (half of the sectors dirty)", 0);
+	printf("  %u sector, %u 32kB block, %u 64kB block erases\n", sim_stats.sector_erases, sim_stats.block_erases_32KB, sim_stats.block_erases_64KB);
+
+	start_benchmark();
+	init_KV_store_W25Q64JV(KV_TEST_START, KV_TEST_SECTORS);
+	sim_reset_stats();
+	for(uint32_t update = 0; update < 1000; update++){
+		fill_random(buffer, 16, update);
+		set_KV_W25Q64JV( (update % 2) ? "key1" : "key2", buffer, 16);
+	}
+	print_stats("1000 KV updates (16 byte values)", 0);
+	printf("  %u page programs, %u sector erases\n", sim_stats.page_programs, sim_stats.sector_erases);
+	start_benchmark();
+	fill_random(upload_image, UPLOAD_TEST_LENGTH, 79);
+	upload_test_image(0xFFFFFFFF, 0xFFFFFFFF);
+	print_stats("upload 50000 bytes at 921600 baud", UPLOAD_TEST_LENGTH);
+	printf("%-40s %10.2f ms\n", "  line rate", UPLOAD_TEST_LENGTH * (UPLOAD_CHUNK_SIZE + 6.0) / UPLOAD_CHUNK_SIZE * 10000.0 / UPLOAD_BAUD_RATE);
+
+	start_benchmark();
+	sim_UART_init(921600, NULL);
+	dump_W25Q64JV(0, 0x10000, true);
+	print_stats("dump 64kB at 921600 baud", 0x10000);
+	printf("%-40s %10.2f ms\n", "  line rate", 0x10000 * 10000.0 / 921600);
+
+	// records of 32 bytes as fast as possible
+	start_benchmark();
+	init_log_W25Q64JV(LOG_TEST_START, LOG_TEST_SECTORS);
+	sim_reset_stats();
+	uint64_t t_log = sim_time_ns();
+	memset(buffer, 0x5A, 32);
+	for(uint32_t record = 0; record < 0x80000 / (32 + LOG_RECORD_HEADER_SIZE); ){
+		if( append_log_W25Q64JV(buffer, 32) ) record++;
+		service_log_W25Q64JV();
+	}
+	flush_log_W25Q64JV();
+	print_stats("log 512kB in 32 byte records", 0x80000);
+	printf("  %u pages, %u sector erases, %.1f kB/s, datasheet limit (tPP and tSE) %.1f kB/s\n", log_stats.pages, log_stats.erases,
+		0x80000 / ((sim_time_ns() - t_log) / 1e6),
+		(W25Q64JV_SECTOR_SIZE - LOG_SECTOR_HEADER_SIZE) / ((16*SIM_T_PAGE_PROGRAM + SIM_T_SECTOR_ERASE) / 1e6));
+
+	start_benchmark();
+	crc32_W25Q64JV(0, 0x10000);
+	print_stats("CRC32 of 64kB", 0x10000);
+
+	// 90% of the writes go to 4 hot blocks, the rest of the blocks is rarely changed
+	start_benchmark();
+	init_FTL_W25Q64JV(FTL_TEST_START, 64);
+	for(uint16_t block = 0; block < num_blocks_FTL_W25Q64JV(); block++){
+		fill_random(buffer, FTL_BLOCK_SIZE, block);
+		write_FTL_W25Q64JV(block, 0, FTL_BLOCK_SIZE, buffer);
+	}
+	memset(&FTL_stats, 0, sizeof(FTL_stats));
+	sim_reset_stats();
+	srand(11);
+	for(uint32_t update = 0; update < 10000; update++){
+		uint16_t block = (rand() % 10) ? (rand() % 4) : (rand() % num_blocks_FTL_W25Q64JV());
+		fill_random(buffer, 64, update);
+		write_FTL_W25Q64JV(block, (rand() % 60)*64, 64, buffer);
+	}
+	print_stats("10000 FTL writes (64 bytes, 90% hot)", 0);
+	uint32_t min_count, max_count;
+	erase_counts_FTL_W25Q64JV(&min_count, &max_count);
+	printf("  write amplification %.1f, %u erases, erase count min %u max %u, %u static moves\n",
+		(double)FTL_stats.flash_bytes_written / FTL_stats.host_bytes_written, FTL_stats.erases,
+		min_count, max_count, FTL_stats.static_moves);
+	printf("  without wear leveling the hottest sector would be erased about %u times\n", 10000*9/10/4);
+}
+
+int main(void){
+	test_probe();
+	test_program_and_read();
+	test_erase();
+	test_DMA_read();
+	test_async();
+	test_suspend();
+	test_power();
+	test_shared_bus();
+	test_write_buffer();
+	test_erase_range();
+	test_cache();
+	test_stream();
+	test_KV_store();
+	test_FTL();
+	test_upload();
+	test_dump();
+	test_integrity();
+	test_assets();
+	test_log();
+	if(failed_checks == 0){
+		printf("all checks passed\n");
+	}else{
+		printf("%d check(s) failed\n", failed_checks);
+	}
+	benchmark();
+	return failed_checks;
+}
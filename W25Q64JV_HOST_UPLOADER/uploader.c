@@ -0,0 +1,309 @@
+/*	uploader for the W25Q64JV flash tool
+ *
+ *	writes a file into the W25Q64JV via the flash tool (W25Q64JV_SPI_FLASH_MEMORY/main.c)
+ *	with the framed upload protocol described in W25Q64JV_SPI_FLASH_MEMORY/W25Q64JV_upload.h:
+ *	every frame is protected by a CRC, up to UPLOAD_WINDOW frames are sent ahead and after
+ *	a NAK or a timeout the frames from the first one that has not been acknowledged on are
+ *	sent again.
+ *
+ *	at the end, the CRC32 that the flash tool calculates from the data read back is compared
+ *	with the one of the file.
+ *
+ *	usage: W25Q64JV_upload <serial port> <file> <address in HEX> [baud rate] [--erase]
+ *	the baud rate must match TOOL_BAUD_RATE of the flash tool (default 9600).
+ *	With --erase, the memory range is erased first (menu 9 of the flash tool).
+ *
+ *  see LICENCE.txt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+
+// must match W25Q64JV_upload.h
+#define UPLOAD_CHUNK_SIZE	256
+#define UPLOAD_WINDOW		4
+#define UPLOAD_SYNC			0xA5
+#define UPLOAD_ACK			0x06
+#define UPLOAD_NAK			0x15
+
+#define FLASH_SIZE			0x800000
+// without an answer for this time, the frames are sent again
+#define REPLY_TIMEOUT_MS	2000
+#define MAX_TIMEOUTS		10
+
+static int port;
+
+static speed_t baud_constant(long baud_rate){
+	switch(baud_rate){
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+#ifdef B460800
+	case 460800: return B460800;
+	case 921600: return B921600;
+	case 1000000: return B1000000;
+	case 2000000: return B2000000;
+#endif
+	default: return 0;
+	}
+}
+
+static bool open_port(const char* name, long baud_rate){
+	speed_t speed = baud_constant(baud_rate);
+	if(speed == 0){
+		fprintf(stderr, "unsupported baud rate %ld\n", baud_rate);
+		return false;
+	}
+	port = open(name, O_RDWR | O_NOCTTY);
+	if(port < 0){
+		perror(name);
+		return false;
+	}
+	struct termios settings;
+	tcgetattr(port, &settings);
+	// 8 data bits, no parity, 1 stop bit, no flow control, no translation of any characters
+	cfmakeraw(&settings);
+	settings.c_cflag |= (CLOCAL | CREAD);
+	settings.c_cflag &= ~(CSTOPB | CRTSCTS);
+	cfsetispeed(&settings, speed);
+	cfsetospeed(&settings, speed);
+	tcsetattr(port, TCSANOW, &settings);
+	tcflush(port, TCIOFLUSH);
+	return true;
+}
+
+// read one byte, returns false after <timeout_ms>
+static bool read_byte(uint8_t* data, int timeout_ms){
+	struct pollfd descriptor = {port, POLLIN, 0};
+	if(poll(&descriptor, 1, timeout_ms) <= 0) return false;
+	return read(port, data, 1) == 1;
+}
+
+static void write_bytes(const void* data, size_t length){
+	const uint8_t* bytes = data;
+	while(length > 0){
+		ssize_t written = write(port, bytes, length);
+		if(written <= 0) continue;
+		bytes += written;
+		length -= written;
+	}
+}
+
+static void write_string(const char* string){
+	write_bytes(string, strlen(string));
+}
+
+// wait until <text> has been received, returns false if no byte arrives for <timeout_ms>
+static bool wait_for(const char* text, int timeout_ms){
+	size_t matched = 0;
+	size_t length = strlen(text);
+	uint8_t data;
+	while(matched < length){
+		if( !read_byte(&data, timeout_ms) ) return false;
+		if(data == (uint8_t)text[matched]){
+			matched++;
+		}else{
+			matched = (data == (uint8_t)text[0]) ? 1 : 0;
+		}
+	}
+	return true;
+}
+
+// choose a menu entry of the flash tool and answer its questions for address and length
+static bool menu_command(char command, uint32_t address, uint32_t length){
+	char string[32];
+	// the tool only listens after printing the menu, so try again if it was busy
+	bool prompt = false;
+	for(int attempt = 0; (attempt < 3) && !prompt; attempt++){
+		write_bytes(&command, 1);
+		prompt = wait_for("HEX format: ", 2000);
+	}
+	if(!prompt){
+		fprintf(stderr, "no answer from the flash tool\n");
+		return false;
+	}
+	snprintf(string, sizeof(string), "%X\n", address);
+	write_string(string);
+	if( !wait_for("decimal format: ", 2000) ) return false;
+	snprintf(string, sizeof(string), "%u\n", length);
+	write_string(string);
+	return true;
+}
+
+// CRC-16/CCITT, like upload_CRC16() in W25Q64JV_upload.c
+static uint16_t CRC16(const uint8_t* data, uint32_t length, uint16_t crc){
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		crc ^= (uint16_t)data[byte_counter] << 8;
+		for(uint8_t bit = 0; bit < 8; bit++){
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+// CRC32 (polynomial 0xEDB88320), like crc32_W25Q64JV() in W25Q64JV.c
+static uint32_t CRC32(const uint8_t* data, uint32_t length){
+	uint32_t crc = 0xFFFFFFFF;
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		crc ^= data[byte_counter];
+		for(uint8_t bit = 0; bit < 8; bit++){
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+		}
+	}
+	return ~crc;
+}
+
+static void send_frame(const uint8_t* image, uint32_t length, uint32_t frame){
+	uint8_t buffer[UPLOAD_CHUNK_SIZE + 6];
+	uint32_t offset = frame * UPLOAD_CHUNK_SIZE;
+	uint16_t frame_length = (length - offset < UPLOAD_CHUNK_SIZE) ? (length - offset) : UPLOAD_CHUNK_SIZE;
+	buffer[0] = UPLOAD_SYNC;
+	buffer[1] = (uint8_t)frame;
+	buffer[2] = (uint8_t)frame_length;
+	buffer[3] = (uint8_t)(frame_length >> 8);
+	memcpy(&buffer[4], image + offset, frame_length);
+	uint16_t crc = CRC16(&buffer[1], 3 + frame_length, 0xFFFF);
+	buffer[4 + frame_length] = (uint8_t)crc;
+	buffer[5 + frame_length] = (uint8_t)(crc >> 8);
+	write_bytes(buffer, frame_length + 6);
+}
+
+static double seconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool upload(const uint8_t* image, uint32_t length){
+	uint32_t num_frames = (length + UPLOAD_CHUNK_SIZE - 1) / UPLOAD_CHUNK_SIZE;
+	uint32_t base = 0;	// oldest frame without ACK
+	uint32_t next = 0;	// next frame to send
+	uint32_t retransmissions = 0;
+	int timeouts = 0;
+	uint8_t reply[2];
+	// the flash tool requests the first frame with a NAK
+	do{
+		if( !read_byte(&reply[0], 5000) ){
+			fprintf(stderr, "the flash tool didn't start the upload\n");
+			return false;
+		}
+	}while(reply[0] != UPLOAD_NAK);
+	read_byte(&reply[1], REPLY_TIMEOUT_MS);
+	double start = seconds();
+	while(base < num_frames){
+		while( (next < num_frames) && (next - base < UPLOAD_WINDOW) ){
+			send_frame(image, length, next++);
+		}
+		if( !read_byte(&reply[0], REPLY_TIMEOUT_MS) || !read_byte(&reply[1], REPLY_TIMEOUT_MS) ){
+			if(++timeouts > MAX_TIMEOUTS){
+				fprintf(stderr, "\nno answer, upload aborted\n");
+				return false;
+			}
+			// go back to the first frame without ACK
+			retransmissions += next - base;
+			next = base;
+			continue;
+		}
+		timeouts = 0;
+		// the frame number that belongs to the sequence number
+		uint32_t frame = base + (uint8_t)(reply[1] - (uint8_t)base);
+		if( (reply[0] == UPLOAD_ACK) && (frame < next) ){
+			base = frame + 1;
+		}else if( (reply[0] == UPLOAD_NAK) && (frame <= next) ){
+			retransmissions += next - frame;
+			base = frame;
+			next = frame;
+		}
+		if( (base % 16 == 0) || (base == num_frames) ){
+			double time = seconds() - start;
+			printf("\r%u / %u bytes, %.1f kB/s, %u frames sent again", (base == num_frames) ? length : base * UPLOAD_CHUNK_SIZE,
+				length, (time > 0) ? base * UPLOAD_CHUNK_SIZE / time / 1000 : 0, retransmissions);
+			fflush(stdout);
+		}
+	}
+	printf("\n");
+	return true;
+}
+
+int main(int argc, char* argv[]){
+	if(argc < 4){
+		fprintf(stderr, "usage: %s <serial port> <file> <address in HEX> [baud rate] [--erase]\n", argv[0]);
+		return 1;
+	}
+	uint32_t address = strtoul(argv[3], NULL, 16);
+	long baud_rate = 9600;
+	bool erase = false;
+	for(int argument = 4; argument < argc; argument++){
+		if(strcmp(argv[argument], "--erase") == 0) erase = true;
+		else baud_rate = strtol(argv[argument], NULL, 10);
+	}
+
+	FILE* file = fopen(argv[2], "rb");
+	if(file == NULL){
+		perror(argv[2]);
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	if( (length <= 0) || (address + length > FLASH_SIZE) ){
+		fprintf(stderr, "the file doesn't fit into the chip at address 0x%X\n", address);
+		return 1;
+	}
+	uint8_t* image = malloc(length);
+	if( (image == NULL) || (fread(image, 1, length, file) != (size_t)length) ){
+		fprintf(stderr, "can't read %s\n", argv[2]);
+		return 1;
+	}
+	fclose(file);
+
+	if( !open_port(argv[1], baud_rate) ) return 1;
+	if(erase){
+		printf("erasing...\n");
+		// a chip erase takes up to ~1min
+		if( !menu_command('9', address, length) || !wait_for("finished erasing.", 120000) ){
+			fprintf(stderr, "erasing failed\n");
+			return 1;
+		}
+		// wait for the menu
+		wait_for("sectors)\n", 2000);
+	}
+	printf("uploading %ld bytes to 0x%06X...\n", length, address);
+	if( !menu_command('8', address, length) || !wait_for("send data now!\n", 2000) ){
+		fprintf(stderr, "the flash tool refused the upload\n");
+		return 1;
+	}
+	if( !upload(image, length) ) return 1;
+	// the flash tool reads the data back and sends its CRC32
+	char crc_string[9] = {0};
+	if( !wait_for("writing finished. CRC32: ", 5000) ){
+		fprintf(stderr, "no confirmation from the flash tool\n");
+		return 1;
+	}
+	for(int character = 0; character < 8; character++){
+		if( !read_byte((uint8_t*)&crc_string[character], 2000) || (crc_string[character] == '\n') ){
+			crc_string[character] = 0;
+			break;
+		}
+	}
+	uint32_t crc = CRC32(image, length);
+	if(strtoul(crc_string, NULL, 16) != crc){
+		fprintf(stderr, "verification failed: CRC32 of the chip %s, of the file %X\n", crc_string, crc);
+		return 1;
+	}
+	printf("finished, CRC32 %X verified.\n", crc);
+	free(image);
+	close(port);
+	return 0;
+}
@@ -2,12 +2,24 @@
  *  see LICENCE.txt
  */
 #include "W25Q64JV.h"
+#include <string.h>
 
 // this function is the only one that has to be modified when porting to another platform
 // it has to set up the SPI and the GPIO needed for SPI(including one for the CS line)
 void init_W25Q64JV(){
-	// f_SPI = 72MHz/SPI_BAUD_DIV_X
-	init_SPI1(false, (SPI_MODE_0 | SPI_MSB_FIRST | SPI_8BIT_FRAME | SPI_BAUD_DIV_256) );
+#ifdef W25Q64JV_HOST_SIM
+	// the simulated chip needs no hardware setup
+	CS_PIN_HIGH();
+#else
+	// f_SPI = 72MHz/W25Q64JV_SPI_BAUD_DIV (see W25Q64JV_SPI_device)
+	init_SPI1(false, W25Q64JV_SPI_device.config | SPI_8BIT_FRAME);
+	// DMA channels for bulk transfers
+	init_SPI1_DMA();
+	// the bus may be shared with other devices (see SPI_bus.h)
+	SPI1_bus_register(&W25Q64JV_SPI_device);
+	// enable the CPU cycle counter used for the µs delays
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 	// setup a GPIO pin, e.g. PA4 as output for the CS(chip select) line
 	// enable clock for GPIO port
 	RCC->APB2ENR |= RCC_APB2ENR_IOPAEN;
@@ -15,106 +27,703 @@ void init_W25Q64JV(){
 	GPIOA->CRL &= ~(GPIO_CRL_MODE4 | GPIO_CRL_CNF4);
 	GPIOA->CRL |= GPIO_CRL_MODE4_1 | GPIO_CRL_MODE4_0;
 	// CS high
-	CS_HIGH();
+	CS_PIN_HIGH();
+#endif
+	// the chip may still be powered down if only the µC was reset
+	power_up_W25Q64JV();
+	W25Q64JV_power_stats = (W25Q64JV_power_stats_t){0};
+	probe_W25Q64JV();
 }
 
-void power_down_W25Q64JV(){
+/*
+ *	device discovery (see W25Q64JV.h)
+ */
+
+// the W25Q64JV, used until probe_W25Q64JV() finds something else
+W25Q64JV_geometry_t W25Q64JV_geometry = {
+	0xEF, 0x40, 0x17, false, W25Q64JV_SIZE, W25Q64JV_PAGE_SIZE, 3,
+	{ {SECTOR_ERASE_4KB, W25Q64JV_SECTOR_SIZE, W25Q64JV_T_SECTOR_ERASE},
+	  {BLOCK_ERASE_32KB, W25Q64JV_BLOCK_32KB_SIZE, W25Q64JV_T_BLOCK_ERASE_32KB},
+	  {BLOCK_ERASE_64KB, W25Q64JV_BLOCK_64KB_SIZE, W25Q64JV_T_BLOCK_ERASE_64KB} },
+	FAST_READ, 8
+};
+
+#define SFDP_SIGNATURE	0x50444653	// "SFDP"
+
+// read <length> bytes of the SFDP table, returns false on an SPI error
+static bool read_SFDP(uint32_t address, uint8_t length, uint8_t* destination_ptr){
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
-	SPI_transmit(POWER_DOWN);
+	SPI_transmit(READ_SFDP_REG);
+	// send 24bit address MSB first
+	SPI_transmit( (uint8_t)(address>>16) );
+	SPI_transmit( (uint8_t)(address>>8) );
+	SPI_transmit( (uint8_t)(address) );
+	//send 8 dummy clocks, i.e. 1 dummy byte
+	SPI_transmit(0xFF);
+	bool ok = SPI_transfer(NULL, destination_ptr, length);
 	// CS high, transmission finished
 	CS_HIGH();
-	// it takes >3µs for the W25Q64JV to wake up from power-down mode
-	// delay(3µs)
+	return ok;
 }
 
-void power_up_W25Q64JV(){
+static uint32_t little_endian_32(const uint8_t* bytes){
+	return bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+// typical erase time from DWORD 10 of the SFDP basic flash parameter table: (count+1) * unit
+static uint16_t SFDP_erase_time(uint32_t dword10, uint8_t type){
+	static const uint16_t unit[4] = {1, 16, 128, 1000};
+	uint32_t field = dword10 >> (4 + 7*type);
+	return ( (field & 0x1F) + 1 ) * unit[(field >> 5) & 0x03];
+}
+
+// read the basic flash parameter table (JESD216), returns false if the chip has none
+static bool read_basic_parameter_table(){
+	uint8_t header[16];
+	// SFDP header and the first parameter header
+	if( !read_SFDP(0, sizeof(header), header) ) return false;
+	if( (little_endian_32(header) != SFDP_SIGNATURE) || (header[8] != 0x00) || (header[15] != 0xFF) ) return false;
+	uint8_t num_dwords = header[11];
+	uint32_t table_address = header[12] | ((uint32_t)header[13] << 8) | ((uint32_t)header[14] << 16);
+	if(num_dwords < 9) return false;
+	if(num_dwords > 11) num_dwords = 11;
+	uint8_t table[11*4];
+	if( !read_SFDP(table_address, num_dwords*4, table) ) return false;
+
+	// DWORD 2: density in bits
+	uint32_t density = little_endian_32(&table[4]);
+	uint32_t size;
+	if(density & 0x80000000){
+		// 2^N bits
+		uint32_t exponent = density & 0x7FFFFFFF;
+		size = ( (exponent >= 3) && (exponent <= 27) ) ? (1UL << (exponent - 3)) : 0x1000000;
+	}else{
+		size = (density + 1) / 8;
+	}
+	// only 3 byte addresses
+	if( (size == 0) || (size > 0x1000000) ) size = 0x1000000;
+	W25Q64JV_geometry.size = size;
+
+	// DWORD 8 and 9: size (2^N bytes) and instruction of up to 4 erase types
+	W25Q64JV_erase_type_t erase_types[4];
+	uint8_t num_erase_types = 0;
+	for(uint8_t type = 0; type < 4; type++){
+		uint8_t exponent = table[28 + 2*type];
+		if( (exponent == 0) || (exponent > 24) ) continue;
+		erase_types[num_erase_types].size = 1UL << exponent;
+		erase_types[num_erase_types].instruction = table[29 + 2*type];
+		erase_types[num_erase_types].typical_time = 0;
+		// DWORD 10: typical erase times (JESD216A and later)
+		if(num_dwords >= 10) erase_types[num_erase_types].typical_time = SFDP_erase_time(little_endian_32(&table[36]), type);
+		// otherwise assume that a 4kB sector and a 64kB block take about as long as with the W25Q64JV
+		if(erase_types[num_erase_types].typical_time == 0){
+			erase_types[num_erase_types].typical_time = (erase_types[num_erase_types].size <= W25Q64JV_SECTOR_SIZE) ? W25Q64JV_T_SECTOR_ERASE : W25Q64JV_T_BLOCK_ERASE_64KB;
+		}
+		num_erase_types++;
+	}
+	if(num_erase_types > 0){
+		// sort by size (insertion sort of max. 4 entries)
+		for(uint8_t i = 1; i < num_erase_types; i++){
+			W25Q64JV_erase_type_t erase_type = erase_types[i];
+			uint8_t j = i;
+			while( (j > 0) && (erase_types[j-1].size > erase_type.size) ){
+				erase_types[j] = erase_types[j-1];
+				j--;
+			}
+			erase_types[j] = erase_type;
+		}
+		memcpy(W25Q64JV_geometry.erase_types, erase_types, sizeof(erase_types));
+		W25Q64JV_geometry.num_erase_types = num_erase_types;
+	}
+
+	// DWORD 11: page size (2^N bytes)
+	if(num_dwords >= 11) W25Q64JV_geometry.page_size = 1 << ((table[40] >> 4) & 0x0F);
+	// the table only describes the dual/quad read modes, which need more data lines than this
+	// wiring has. FAST_READ (0x0B) always has 8 dummy clocks.
+	W25Q64JV_geometry.fast_read_instruction = FAST_READ;
+	W25Q64JV_geometry.fast_read_dummy_cycles = 8;
+	return true;
+}
+
+/* identify the chip with its JEDEC ID and SFDP table and fill W25Q64JV_geometry
+returns false if no chip answered (then the values of the W25Q64JV are kept) */
+bool probe_W25Q64JV(){
+	uint8_t ID[3];
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
-	SPI_transmit(RELEASE_PWR_DWN_ID);
+	SPI_transmit(JEDEC_ID);
+	// manufacturer ID, memory type, capacity
+	for(uint8_t byte_counter = 0; byte_counter<3; byte_counter++){
+		ID[byte_counter] = SPI_transmit(0xFF);
+	}
 	// CS high, transmission finished
 	CS_HIGH();
+	// a missing chip reads as 0x00 or 0xFF
+	if( (ID[0] == 0x00) || (ID[0] == 0xFF) ) return false;
+	W25Q64JV_geometry.manufacturer_ID = ID[0];
+	W25Q64JV_geometry.memory_type = ID[1];
+	W25Q64JV_geometry.capacity_ID = ID[2];
+	W25Q64JV_geometry.SFDP = read_basic_parameter_table();
+	if(!W25Q64JV_geometry.SFDP){
+		// the size is 2^capacity ID bytes for the W25Qxx series, e.g. 0x15 = 2MB (W25Q16)
+		if( (ID[2] >= 0x11) && (ID[2] <= 0x18) ) W25Q64JV_geometry.size = 1UL << ID[2];
+	}
+	invalidate_cache_W25Q64JV();
+	return true;
+}
+
+/*	read cache
+ *
+ *	small reads pay for the instruction and the 24bit address on every call.
+ *	The cache keeps the last recently used pages in RAM, a page that is not
+ *	in the cache replaces the least recently used one. It is write-through: all
+ *	write and erase functions of this driver apply the same change to cached
+ *	pages (programming clears bits, erasing sets them), so the cache never has
+ *	to be reloaded from the chip. If the chip is written without this driver,
+ *	call invalidate_cache_W25Q64JV().
+ */
+
+uint32_t W25Q64JV_cache_hits = 0;
+uint32_t W25Q64JV_cache_misses = 0;
+
+#if W25Q64JV_CACHE_PAGES > 255
+#error "W25Q64JV_CACHE_PAGES is too large, the cache entries are counted with uint8_t"
+#endif
+
+#if W25Q64JV_CACHE_PAGES > 0
+static struct {
+	uint32_t page_address;
+	uint32_t last_used;
+	bool valid;
+	uint8_t data[W25Q64JV_PAGE_SIZE];
+} cache[W25Q64JV_CACHE_PAGES];
+static uint32_t cache_use_counter = 0;
+
+// return the cache entry holding the page at <page_address>, or -1
+static int16_t cache_find(uint32_t page_address){
+	for(uint8_t entry = 0; entry < W25Q64JV_CACHE_PAGES; entry++){
+		if( cache[entry].valid && (cache[entry].page_address == page_address) ) return entry;
+	}
+	return -1;
+}
+#endif
+
+// apply a page program to the cached copy of the page
+static void cache_program(uint32_t address, uint16_t length, uint8_t* source_ptr){
+#if W25Q64JV_CACHE_PAGES > 0
+	int16_t entry = cache_find(address & ~(W25Q64JV_PAGE_SIZE - 1));
+	if(entry < 0) return;
+	// like the chip, wrap around at the end of the page
+	for(uint16_t byte_counter = 0; byte_counter<length; byte_counter++){
+		cache[entry].data[(uint8_t)(address + byte_counter)] &= source_ptr[byte_counter];
+	}
+#else
+	(void)address;
+	(void)length;
+	(void)source_ptr;
+#endif
+}
+
+// apply an erase of <size> bytes (sector, block or chip) to the cached pages
+static void cache_erase(uint32_t address, uint32_t size){
+#if W25Q64JV_CACHE_PAGES > 0
+	address &= ~(size - 1);
+	for(uint8_t entry = 0; entry < W25Q64JV_CACHE_PAGES; entry++){
+		if( cache[entry].valid && (cache[entry].page_address - address < size) ){
+			memset(cache[entry].data, 0xFF, W25Q64JV_PAGE_SIZE);
+		}
+	}
+#else
+	(void)address;
+	(void)size;
+#endif
+}
+
+void invalidate_cache_W25Q64JV(){
+#if W25Q64JV_CACHE_PAGES > 0
+	for(uint8_t entry = 0; entry < W25Q64JV_CACHE_PAGES; entry++){
+		cache[entry].valid = false;
+	}
+#endif
+}
+
+// read <length> bytes via the cache, returns false on an SPI error
+// reads that are larger than the cache bypass it (they would only flush it)
+bool cached_read_W25Q64JV(uint32_t address, uint32_t length, uint8_t* destination_ptr){
+#if W25Q64JV_CACHE_PAGES > 0
+	if(length >= W25Q64JV_CACHE_PAGES*W25Q64JV_PAGE_SIZE){
+		return read_W25Q64JV(address, length, destination_ptr);
+	}
+	while(length > 0){
+		uint32_t page_address = address & ~(W25Q64JV_PAGE_SIZE - 1);
+		uint32_t offset = address - page_address;
+		uint32_t chunk = W25Q64JV_PAGE_SIZE - offset;
+		if(chunk > length) chunk = length;
+		int16_t entry = cache_find(page_address);
+		if(entry >= 0){
+			W25Q64JV_cache_hits++;
+		}else{
+			W25Q64JV_cache_misses++;
+			// replace an empty or else the least recently used entry
+			entry = 0;
+			for(uint8_t candidate = 0; candidate < W25Q64JV_CACHE_PAGES; candidate++){
+				if(!cache[candidate].valid){
+					entry = candidate;
+					break;
+				}
+				if(cache[candidate].last_used < cache[entry].last_used) entry = candidate;
+			}
+			// a page that wasn't read correctly isn't cached
+			cache[entry].valid = false;
+			if( !read_W25Q64JV(page_address, W25Q64JV_PAGE_SIZE, cache[entry].data) ) return false;
+			cache[entry].page_address = page_address;
+			cache[entry].valid = true;
+		}
+		cache[entry].last_used = ++cache_use_counter;
+		memcpy(destination_ptr, &cache[entry].data[offset], chunk);
+		destination_ptr += chunk;
+		address += chunk;
+		length -= chunk;
+	}
+	return true;
+#else
+	return read_W25Q64JV(address, length, destination_ptr);
+#endif
+}
+
+/*	power management
+ *
+ *	in power-down mode the chip draws ~1µA instead of ~10µA standby current, but it
+ *	ignores every instruction except RELEASE_PWR_DWN_ID. CS_LOW() and CS_HIGH() are
+ *	mapped to select_W25Q64JV() and deselect_W25Q64JV(), so every transaction (also
+ *	those of the other modules) wakes the chip up first if necessary and the time of
+ *	the last transaction is known. idle_W25Q64JV() powers the chip down after
+ *	idle_timeout ms without a transaction.
+ */
+
+W25Q64JV_power_stats_t W25Q64JV_power_stats;
+static bool powered_down = false;
+// a transaction is running or waiting for the bus
+static volatile bool selected = false;
+static uint32_t idle_timeout = W25Q64JV_IDLE_TIMEOUT;
+// TIME_MS() at the end of the last transaction and at the last power-down
+static uint32_t last_access = 0;
+static uint32_t power_down_time = 0;
+
+// max. number of data bytes of a transaction after <header> bytes of instruction, address and dummies,
+// so that it doesn't hold a shared bus longer than allowed
+static uint32_t bus_burst(uint8_t header){
+	uint32_t burst = BUS_MAX_BURST();
+	return (burst > header) ? burst - header : 1;
+}
+
+// wait for <us> microseconds, measured with the CPU cycle counter
+static void wait_us(uint32_t us){
+	uint32_t t1 = CYCLE_COUNTER();
+	while( (uint32_t)(CYCLE_COUNTER() - t1) < us*CYCLES_PER_US );
+}
+
+// wake the chip up, the caller owns the bus
+static void release_power_down(){
+	// CS low, SPI slave starts to listen
+	CS_PIN_LOW();
+	// send instruction
+	SPI_transmit(RELEASE_PWR_DWN_ID);
+	// CS high, transmission finished
+	CS_PIN_HIGH();
 	// it takes >3µs for the W25Q64JV to wake up from power-down mode
-	// delay(3µs)
+	wait_us(W25Q64JV_T_RELEASE_POWER_DOWN);
+	if(powered_down){
+		powered_down = false;
+		W25Q64JV_power_stats.wake_ups++;
+		W25Q64JV_power_stats.residency_ms += TIME_MS() - power_down_time;
+	}
+}
+
+void select_W25Q64JV(){
+	// set before the bus is granted, so idle_W25Q64JV() or poll_busy_W25Q64JV() in an interrupt
+	// don't start a transaction of their own (their CS_HIGH() would give the bus away)
+	selected = true;
+	// other devices on the bus finish their transaction first
+	BUS_ACQUIRE();
+	if(powered_down) release_power_down();
+	CS_PIN_LOW();
+}
+
+void deselect_W25Q64JV(){
+	CS_PIN_HIGH();
+	last_access = TIME_MS();
+	BUS_RELEASE();
+	// cleared after the bus has been given back, for the same reason
+	selected = false;
 }
 
-void read_W25Q64JV(uint32_t address, uint32_t length, uint8_t* destination_ptr){
+void power_down_W25Q64JV(){
+	if(powered_down) return;
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
-	SPI_transmit(READ_DATA);
-	// send 24bit address MSB first
-	SPI_transmit( (uint8_t)(address>>16) );
-	SPI_transmit( (uint8_t)(address>>8) );
-	SPI_transmit( (uint8_t)(address) );
-	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
-		destination_ptr[byte_counter] = SPI_transmit(0xFF);
-	}
+	SPI_transmit(POWER_DOWN);
 	// CS high, transmission finished
 	CS_HIGH();
+	powered_down = true;
+	power_down_time = TIME_MS();
+	W25Q64JV_power_stats.power_downs++;
+}
+
+void power_up_W25Q64JV(){
+	BUS_ACQUIRE();
+	release_power_down();
+	BUS_RELEASE();
+}
+
+bool powered_down_W25Q64JV(){
+	return powered_down;
+}
+
+// power the chip down after <timeout> ms without a transaction, 0 = never
+void set_idle_timeout_W25Q64JV(uint32_t timeout){
+	idle_timeout = timeout;
 }
 
-void fast_read_W25Q64JV(uint32_t address, uint32_t length, char* destination_ptr){
+/*	suspend/resume
+ *
+ *	while the chip is programming or erasing, it ignores reads. A sector erase takes
+ *	~45ms, which is far too long for e.g. an audio player waiting for samples. So if
+ *	an operation started by one of the *_async_* functions is still running, the read
+ *	functions of this driver suspend it (ERASE_PROGRAM_SUSPEND), read and resume it
+ *	(ERASE_PROGRAM_RESUME). The read is delayed by max. tSUS = 20µs.
+ *	NOTE: the data of the page/sector that is being programmed/erased is undefined while
+ *	it is suspended. A chip erase can't be suspended, reads wait until it's finished.
+ */
+
+// state of the program/erase operation running in the background
+static volatile bool async_active = false;
+static bool async_suspendable = false;
+// suspended for a read, the BUSY bit is cleared although the operation isn't finished
+static volatile bool async_suspended = false;
+static void (*async_callback)(void);
+// CYCLE_COUNTER() value of the last resume
+static uint32_t last_resume = 0;
+uint32_t W25Q64JV_suspends = 0;
+
+uint8_t get_status_register2(){
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
-	SPI_transmit(FAST_READ);
-	// send 24bit address MSB first
-	SPI_transmit( (uint8_t)(address>>16) );
-	SPI_transmit( (uint8_t)(address>>8) );
-	SPI_transmit( (uint8_t)(address) );
-	//send 8 dummy clocks, i.e. 1 dummy byte
-	SPI_transmit(0xFF);
-	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
-		destination_ptr[byte_counter] = SPI_transmit(0xFF);
-	}
+	SPI_transmit(READ_STATUS_REG_2);
+	// receive register content
+	uint8_t register_content = SPI_transmit(0xFF);
 	// CS high, transmission finished
 	CS_HIGH();
+	return register_content;
 }
 
-// write a page of 1-256bytes to previously erased(!!!) locations
-void write_W25Q64JV(uint32_t address, uint16_t length, uint8_t* source_ptr){
+/* make the chip accept reads: suspend a running program/erase or wait for it
+returns true if the operation has to be resumed with resume_W25Q64JV() after the read */
+bool suspend_W25Q64JV(){
+	if(!async_active) return false;
+	if(!async_suspendable){
+		// chip erase
+		while( get_status_register1() & STATUS_REG_1_BUSY_BIT );
+		return false;
+	}
+	if( !(get_status_register1() & STATUS_REG_1_BUSY_BIT) ) return false;
+	// the operation must run for tSUS after a resume, or it might never finish
+	while( (uint32_t)(CYCLE_COUNTER() - last_resume) < W25Q64JV_T_SUSPEND*CYCLES_PER_US );
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
-	SPI_transmit(WRITE_ENABLE);
+	SPI_transmit(ERASE_PROGRAM_SUSPEND);
 	// CS high, transmission finished
 	CS_HIGH();
-	//eventually a small delay is needed here, depends on your µC's speed
-	asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
+	// the chip clears the BUSY bit within tSUS
+	wait_us(W25Q64JV_T_SUSPEND);
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	wait_busy_flag_W25Q64JV();
+	// CS high, transmission finished
+	CS_HIGH();
+	// if the operation finished right before the suspend, there is nothing to resume
+	if( !(get_status_register2() & STATUS_REG_2_SUS_BIT) ) return false;
+	async_suspended = true;
+	W25Q64JV_suspends++;
+	return true;
+}
+
+// continue the operation interrupted by suspend_W25Q64JV() if it returned true
+void resume_W25Q64JV(bool suspended){
+	if(!suspended) return;
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
-	SPI_transmit(PAGE_PROGRAM);
+	SPI_transmit(ERASE_PROGRAM_RESUME);
+	// CS high, the chip continues programming/erasing now
+	CS_HIGH();
+	last_resume = CYCLE_COUNTER();
+	async_suspended = false;
+}
+
+/* end a read transaction (CS high) and resume the operation suspended for it if <suspended> is true
+the resume is sent before the bus is released, so this can be called from an interrupt
+(e.g. at the end of a DMA read) without acquiring the bus there */
+void end_read_W25Q64JV(bool suspended){
+	if(suspended){
+		// the rising edge of CS ends the read, the bus is kept for the resume
+		CS_PIN_HIGH();
+		asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
+		CS_PIN_LOW();
+		// send instruction
+		SPI_transmit(ERASE_PROGRAM_RESUME);
+		last_resume = CYCLE_COUNTER();
+		async_suspended = false;
+	}
+	// CS high, transmission finished, the bus is released
+	CS_HIGH();
+}
+
+/*	shared bus
+ *
+ *	the bus is requested in select_W25Q64JV() and released in deselect_W25Q64JV(). So
+ *	that other devices don't have to wait too long, reads are split into bursts that fit
+ *	into the max. hold time (see W25Q64JV_SPI_device), each one is a transaction of its own.
+ *	Writes are not split, a page program takes max. 260 bytes on the bus.
+ */
+
+#ifndef W25Q64JV_HOST_SIM
+// SPI settings of the chip, the application may change the priority and the max. hold time
+SPI_device_t W25Q64JV_SPI_device = {.config = (SPI_MODE_0 | SPI_MSB_FIRST | W25Q64JV_SPI_BAUD_DIV), .priority = W25Q64JV_BUS_PRIORITY, .max_hold_us = 0};
+#endif
+
+// max. number of data bytes of one fast read transaction (within the max. hold time of the bus)
+uint32_t max_read_burst_W25Q64JV(){
+	return bus_burst(4 + W25Q64JV_geometry.fast_read_dummy_cycles/8);
+}
+
+// returns false if the bus got stuck (the data is invalid then)
+bool read_W25Q64JV(uint32_t address, uint32_t length, uint8_t* destination_ptr){
+	bool ok = true;
+	bool suspended = suspend_W25Q64JV();
+	uint32_t burst = bus_burst(4);
+	while( ok && (length > 0) ){
+		uint32_t chunk = (length > burst) ? burst : length;
+		// CS low, SPI slave starts to listen
+		CS_LOW();
+		// send instruction
+		SPI_transmit(READ_DATA);
+		// send 24bit address MSB first
+		SPI_transmit( (uint8_t)(address>>16) );
+		SPI_transmit( (uint8_t)(address>>8) );
+		SPI_transmit( (uint8_t)(address) );
+		// data phase without a timeout check for every byte
+		ok = SPI_transfer(NULL, destination_ptr, chunk);
+		// CS high, transmission finished
+		CS_HIGH();
+		address += chunk;
+		destination_ptr += chunk;
+		length -= chunk;
+	}
+	resume_W25Q64JV(suspended);
+	return ok;
+}
+
+// CS low and send the fast read instruction with the address and the dummy clocks
+static void start_fast_read(uint32_t address){
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	// send instruction
+	SPI_transmit(W25Q64JV_geometry.fast_read_instruction);
 	// send 24bit address MSB first
 	SPI_transmit( (uint8_t)(address>>16) );
 	SPI_transmit( (uint8_t)(address>>8) );
-	// from datasheet: If an entire 256 byte page is to be programmed, the last address byte (the 8 LSB) should be set to 0.
-	if(length == 256){
-		SPI_transmit(0);
+	SPI_transmit( (uint8_t)(address) );
+	//send the dummy clocks, 8 per byte
+	for(uint8_t dummy = 0; dummy < W25Q64JV_geometry.fast_read_dummy_cycles/8; dummy++){
+		SPI_transmit(0xFF);
+	}
+}
+
+// returns false if the bus got stuck (the data is invalid then)
+bool fast_read_W25Q64JV(uint32_t address, uint32_t length, char* destination_ptr){
+	bool ok = true;
+	bool suspended = suspend_W25Q64JV();
+	uint32_t burst = max_read_burst_W25Q64JV();
+	while( ok && (length > 0) ){
+		uint32_t chunk = (length > burst) ? burst : length;
+		start_fast_read(address);
+		// data phase without a timeout check for every byte
+		ok = SPI_transfer(NULL, (uint8_t*)destination_ptr, chunk);
+		// CS high, transmission finished
+		CS_HIGH();
+		address += chunk;
+		destination_ptr += chunk;
+		length -= chunk;
+	}
+	resume_W25Q64JV(suspended);
+	return ok;
+}
+
+// state of the DMA read that is currently running
+static volatile bool DMA_read_active = false;
+static uint32_t DMA_read_address;
+static uint32_t DMA_read_remaining;
+static uint8_t* DMA_read_destination;
+static void (*DMA_read_callback)(void);
+static bool DMA_read_suspended;
+// the whole read, its bytes are put in order chunk by chunk once it's finished
+static uint8_t* DMA_read_start;
+static uint32_t DMA_read_length;
+static uint32_t DMA_read_chunk_size;
+static bool DMA_read_unordered = false;
+// a read with a callback uses 8bit frames, its bytes are in order when the callback runs
+static bool DMA_read_frames8;
+// the bus was given to another device after a chunk, the next one starts when it's free again
+static volatile bool DMA_read_waiting = false;
+
+static void DMA_read_chunk_done();
+
+// start the transaction for the next chunk, its data bytes are moved by DMA
+static void DMA_read_next_chunk(){
+	uint32_t chunk = DMA_read_chunk_size;
+	if(chunk > DMA_read_remaining) chunk = DMA_read_remaining;
+	uint8_t* chunk_destination = DMA_read_destination;
+	start_fast_read(DMA_read_address);
+	DMA_read_address += chunk;
+	DMA_read_destination += chunk;
+	DMA_read_remaining -= chunk;
+	if(DMA_read_frames8){
+		SPI_DMA_transfer8(NULL, chunk_destination, chunk, DMA_read_chunk_done);
 	}else{
-		SPI_transmit( (uint8_t)(address) );
+		SPI_DMA_transfer(NULL, chunk_destination, chunk, DMA_read_chunk_done);
 	}
-	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
-		SPI_transmit(source_ptr[byte_counter]);
+}
+
+// called from the DMA interrupt when a chunk has been received
+static void DMA_read_chunk_done(){
+	if(DMA_read_remaining > 0){
+		// CS high, the bus can be handed over to another device now
+		CS_HIGH();
+		// continue right away if the bus is free, waiting for it isn't possible in the interrupt
+		if( BUS_REQUEST() ){
+			DMA_read_next_chunk();
+		}else{
+			DMA_read_waiting = true;
+		}
+		return;
 	}
-	// CS high, transmission finished
-	CS_HIGH();
-	//eventually a small delay is needed here, depends on your µC's speed
-	asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
-	// CS low, SPI slave starts to listen
-	CS_LOW();
-	// poll status register 1 to check the BUSY bit which indicates that writing procedure is over
-	wait_busy_flag_W25Q64JV();
-	CS_HIGH();
+	// the suspended program/erase is resumed before the bus is released
+	end_read_W25Q64JV(DMA_read_suspended);
+	DMA_read_active = false;
+	if(DMA_read_callback) DMA_read_callback();
+}
+
+// read <length> bytes using DMA, the function returns as soon as the transfer has been started
+// when the transfer is finished, <callback> is called from the DMA interrupt (may be NULL)
+// NOTE: the SPI bus must not be used for anything else until read_DMA_busy_W25Q64JV() returns false,
+//       except by other devices via the bus manager
+//       with a callback, the bytes are moved in 8bit frames, so the data is valid when <callback> runs
+//       without one, the faster 16bit frames are used and the data is only valid after
+//       read_DMA_busy_W25Q64JV() returned false (it puts the bytes in order, see SPI_DMA_order)
+void fast_read_DMA_W25Q64JV(uint32_t address, uint32_t length, uint8_t* destination_ptr, void (*callback)(void)){
+	DMA_read_active = true;
+	DMA_read_waiting = false;
+	DMA_read_address = address;
+	DMA_read_remaining = length;
+	DMA_read_destination = destination_ptr;
+	DMA_read_callback = callback;
+	DMA_read_start = destination_ptr;
+	DMA_read_length = length;
+	DMA_read_frames8 = (callback != NULL);
+	DMA_read_unordered = !DMA_read_frames8;
+	DMA_read_suspended = suspend_W25Q64JV();
+	// the data bytes are moved by DMA in chunks of max. 64kB (or less, see max_read_burst_W25Q64JV())
+	DMA_read_chunk_size = max_read_burst_W25Q64JV();
+	if(DMA_read_chunk_size > W25Q64JV_DMA_CHUNK) DMA_read_chunk_size = W25Q64JV_DMA_CHUNK;
+	if(length == 0){
+		resume_W25Q64JV(DMA_read_suspended);
+		DMA_read_active = false;
+		if(callback) callback();
+	}else{
+		DMA_read_next_chunk();
+	}
+}
+
+// check if a DMA read is still running
+// a read that had to give the bus to another device is continued here when the bus is free
+// when it's finished, the bytes are put in order here, outside of the DMA interrupt
+bool read_DMA_busy_W25Q64JV(){
+	if( DMA_read_waiting && BUS_REQUEST() ){
+		DMA_read_waiting = false;
+		DMA_read_next_chunk();
+	}
+	if(DMA_read_active) return true;
+	if(DMA_read_unordered){
+		DMA_read_unordered = false;
+		for(uint32_t offset = 0; offset < DMA_read_length; offset += DMA_read_chunk_size){
+			uint32_t chunk = DMA_read_length - offset;
+			if(chunk > DMA_read_chunk_size) chunk = DMA_read_chunk_size;
+			SPI_DMA_order(DMA_read_start + offset, chunk);
+		}
+	}
+	return false;
+}
+
+// write a page of 1-256bytes to previously erased(!!!) locations
+// on a shared bus, the page is split into several page programs of max. bus_burst(4) bytes
+// returns false if the bus got stuck (the content of the page is unknown then)
+bool write_W25Q64JV(uint32_t address, uint16_t length, uint8_t* source_ptr){
+	bool ok = true;
+	cache_program(address, length, source_ptr);
+	uint32_t burst = bus_burst(4);
+	while( ok && (length > 0) ){
+		uint16_t chunk = (length > burst) ? burst : length;
+		// CS low, SPI slave starts to listen
+		CS_LOW();
+		// send instruction
+		SPI_transmit(WRITE_ENABLE);
+		// CS high, transmission finished
+		CS_HIGH();
+		//eventually a small delay is needed here, depends on your µC's speed
+		asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
+		// CS low, SPI slave starts to listen
+		CS_LOW();
+		// send instruction
+		SPI_transmit(PAGE_PROGRAM);
+		// send 24bit address MSB first
+		SPI_transmit( (uint8_t)(address>>16) );
+		SPI_transmit( (uint8_t)(address>>8) );
+		// from datasheet: If an entire 256 byte page is to be programmed, the last address byte (the 8 LSB) should be set to 0.
+		if(chunk == 256){
+			SPI_transmit(0);
+		}else{
+			SPI_transmit( (uint8_t)(address) );
+		}
+		ok = SPI_transfer(source_ptr, NULL, chunk);
+		// CS high, transmission finished
+		CS_HIGH();
+		//eventually a small delay is needed here, depends on your µC's speed
+		asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
+		// CS low, SPI slave starts to listen
+		CS_LOW();
+		// poll status register 1 to check the BUSY bit which indicates that writing procedure is over
+		wait_busy_flag_W25Q64JV();
+		CS_HIGH();
+		address += chunk;
+		source_ptr += chunk;
+		length -= chunk;
+	}
+	if(!ok) invalidate_cache_W25Q64JV();
+	return ok;
 }
 
 
 // erases a sector of 4Kbytes starting from the address specified
 // then wait until the BUSY bit in status register 1 is cleared, i.e. erasing is finished
 void sector_erase_W25Q64JV(uint32_t address){
+	cache_erase(address, W25Q64JV_SECTOR_SIZE);
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
@@ -146,6 +755,7 @@ void sector_erase_W25Q64JV(uint32_t address){
 // erases a block of 32Kbytes starting from the address specified
 // then wait until the BUSY bit in status register 1 is cleared, i.e. erasing is finished
 void block_erase_32KB_W25Q64JV(uint32_t address){
+	cache_erase(address, W25Q64JV_BLOCK_32KB_SIZE);
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
@@ -177,6 +787,7 @@ void block_erase_32KB_W25Q64JV(uint32_t address){
 // erases a block of 64Kbytes starting from the address specified
 // then wait until the BUSY bit in status register 1 is cleared, i.e. erasing is finished
 void block_erase_64KB_W25Q64JV(uint32_t address){
+	cache_erase(address, W25Q64JV_BLOCK_64KB_SIZE);
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
@@ -206,6 +817,7 @@ void block_erase_64KB_W25Q64JV(uint32_t address){
 }
 
 void erase_chip_W25Q64JV(){
+	cache_erase(0, W25Q64JV_geometry.size);
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
@@ -295,20 +907,466 @@ uint8_t get_status_register1(){
 }
 
 void wait_busy_flag_W25Q64JV(){
+	// a shared bus is given to the other devices between bursts of polls
+	uint32_t burst = bus_burst(1);
+	while(1){
+		// CS low, SPI slave starts to listen
+		CS_LOW();
+		// send instruction
+		SPI_transmit(READ_STATUS_REG_1);
+		// poll status register 1 and check busy bit
+		for(uint32_t poll = 0; poll < burst; poll++){
+			if( !(SPI_transmit(0xFF) & STATUS_REG_1_BUSY_BIT) ) return;
+		}
+		CS_HIGH();
+	}
+}
+
+/*	non-blocking program and erase
+ *
+ *	the *_async_* functions only send the instruction and return while the chip
+ *	is still busy. poll_busy_W25Q64JV() reads status register 1 once per call
+ *	(a 2 byte transaction) and calls the completion callback as soon as the BUSY
+ *	bit is cleared. Call it from a timer tick or from the main loop: while the bus
+ *	is in use (by this driver or another device), it returns true without touching it.
+ */
+
+// set the write enable latch and send an instruction followed by a 24bit address
+static void start_erase(uint8_t instruction, uint32_t address){
 	// CS low, SPI slave starts to listen
 	CS_LOW();
 	// send instruction
-	SPI_transmit(READ_STATUS_REG_1);
-	// poll status register 1 and check busy bit
-	while( SPI_transmit(0xFF) & STATUS_REG_1_BUSY_BIT );
-	return;
+	SPI_transmit(WRITE_ENABLE);
+	// CS high, transmission finished
+	CS_HIGH();
+	//eventually a small delay is needed here, depends on your µC's speed
+	asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	// send instruction
+	SPI_transmit(instruction);
+	// send 24bit address of block to be erased (MSB first)
+	SPI_transmit( (uint8_t)(address>>16) );
+	SPI_transmit( (uint8_t)(address>>8) );
+	SPI_transmit( (uint8_t)(address) );
+	// CS high, the chip starts erasing now
+	CS_HIGH();
 }
 
+// write a page of 1-256bytes to previously erased(!!!) locations without waiting for the chip
+// the data is clocked out before the function returns, so <source_ptr> may be reused right away
+// on a shared bus, the first parts of a page longer than bus_burst(4) are programmed by
+// write_W25Q64JV(), only the last one runs in the background
+// returns false if the bus got stuck (the content of the page is unknown then)
+bool write_async_W25Q64JV(uint32_t address, uint16_t length, uint8_t* source_ptr, void (*callback)(void)){
+	uint32_t burst = bus_burst(4);
+	if(length > burst){
+		uint16_t first = length - ((length - 1) % burst + 1);
+		if( !write_W25Q64JV(address, first, source_ptr) ) return false;
+		address += first;
+		source_ptr += first;
+		length -= first;
+	}
+	async_active = true;
+	async_suspendable = true;
+	async_callback = callback;
+	cache_program(address, length, source_ptr);
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	// send instruction
+	SPI_transmit(WRITE_ENABLE);
+	// CS high, transmission finished
+	CS_HIGH();
+	//eventually a small delay is needed here, depends on your µC's speed
+	asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	// send instruction
+	SPI_transmit(PAGE_PROGRAM);
+	// send 24bit address MSB first
+	SPI_transmit( (uint8_t)(address>>16) );
+	SPI_transmit( (uint8_t)(address>>8) );
+	// from datasheet: If an entire 256 byte page is to be programmed, the last address byte (the 8 LSB) should be set to 0.
+	if(length == 256){
+		SPI_transmit(0);
+	}else{
+		SPI_transmit( (uint8_t)(address) );
+	}
+	bool ok = SPI_transfer(source_ptr, NULL, length);
+	// CS high, the chip starts programming now
+	CS_HIGH();
+	if(!ok) invalidate_cache_W25Q64JV();
+	return ok;
+}
 
+// start erasing a sector of 4Kbytes and return without waiting for the chip
+void sector_erase_async_W25Q64JV(uint32_t address, void (*callback)(void)){
+	async_active = true;
+	async_suspendable = true;
+	async_callback = callback;
+	cache_erase(address, W25Q64JV_SECTOR_SIZE);
+	start_erase(SECTOR_ERASE_4KB, address);
+}
 
+// start erasing a block of 32Kbytes and return without waiting for the chip
+void block_erase_32KB_async_W25Q64JV(uint32_t address, void (*callback)(void)){
+	async_active = true;
+	async_suspendable = true;
+	async_callback = callback;
+	cache_erase(address, W25Q64JV_BLOCK_32KB_SIZE);
+	start_erase(BLOCK_ERASE_32KB, address);
+}
 
+// start erasing a block of 64Kbytes and return without waiting for the chip
+void block_erase_64KB_async_W25Q64JV(uint32_t address, void (*callback)(void)){
+	async_active = true;
+	async_suspendable = true;
+	async_callback = callback;
+	cache_erase(address, W25Q64JV_BLOCK_64KB_SIZE);
+	start_erase(BLOCK_ERASE_64KB, address);
+}
 
+// start erasing the whole chip (takes up to ~1min) and return without waiting for the chip
+void erase_chip_async_W25Q64JV(void (*callback)(void)){
+	async_active = true;
+	async_suspendable = false;
+	async_callback = callback;
+	cache_erase(0, W25Q64JV_geometry.size);
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	// send instruction
+	SPI_transmit(WRITE_ENABLE);
+	// CS high, transmission finished
+	CS_HIGH();
+	//eventually a small delay is needed here, depends on your µC's speed
+	asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	// send instruction
+	SPI_transmit(CHIP_ERASE);
+	// CS high, the chip starts erasing now
+	CS_HIGH();
+}
+
+// check once if the operation started by one of the *_async_* functions is finished
+// returns true while the chip is still busy, calls the completion callback when it's done
+bool poll_busy_W25Q64JV(){
+	if(!async_active) return false;
+	// the bus is occupied by a read or the tick interrupted a transaction, try again at the next tick
+	if(DMA_read_active || async_suspended || selected) return true;
+	// the bus is in use, waiting for it here could block the interrupted code
+	// (BUS_TRY() doesn't queue up for it, the bus would be granted while no code uses it)
+	if( !BUS_TRY() ) return true;
+	if( get_status_register1() & STATUS_REG_1_BUSY_BIT ) return true;
+	async_active = false;
+	if(async_callback) async_callback();
+	return false;
+}
+
+// check if an operation started by one of the *_async_* functions is still pending
+// (this does not access the chip, the state is updated by poll_busy_W25Q64JV())
+bool async_busy_W25Q64JV(){
+	return async_active;
+}
+
+/* call regularly from the main loop or a timer tick: powers the chip down when it has been idle
+for the idle timeout, i.e. no transaction, no program/erase in the background and no DMA read */
+void idle_W25Q64JV(){
+	if( powered_down || selected || (idle_timeout == 0) ) return;
+	if( async_active || DMA_read_active ) return;
+	if( (uint32_t)(TIME_MS() - last_access) < idle_timeout ) return;
+	// like poll_busy_W25Q64JV(), never wait for the bus here
+	if( !BUS_TRY() ) return;
+	power_down_W25Q64JV();
+	BUS_RELEASE();
+}
+
+// number of bytes that can be programmed from <address> on without crossing a page boundary
+static uint16_t page_chunk(uint32_t address, uint32_t length){
+	uint32_t chunk = W25Q64JV_PAGE_SIZE - (address % W25Q64JV_PAGE_SIZE);
+	return (length < chunk) ? length : chunk;
+}
+
+// write <length> bytes from RAM to previously erased(!!!) locations starting at any address
+// the data is split into page programs, a program instruction that would cross a page boundary
+// would wrap around to the beginning of the same page
+void write_buffer_W25Q64JV(uint32_t address, uint32_t length, uint8_t* source_ptr){
+	while(length > 0){
+		uint16_t chunk = page_chunk(address, length);
+		// the previous page has to be finished before the next one can be sent
+		while( poll_busy_W25Q64JV() );
+		write_async_W25Q64JV(address, chunk, source_ptr, NULL);
+		address += chunk;
+		source_ptr += chunk;
+		length -= chunk;
+	}
+	while( poll_busy_W25Q64JV() );
+}
+
+// write <length> bytes to previously erased(!!!) locations starting at any address
+// the data is requested page by page from <fill_page> (e.g. received via USART) and the data
+// of the next page is fetched while the chip is still busy programming the current one
+void write_stream_W25Q64JV(uint32_t address, uint32_t length, void (*fill_page)(uint8_t* buffer, uint16_t length)){
+	// the data is clocked out completely by write_async_W25Q64JV(), so one buffer is enough
+	uint8_t page_buffer[W25Q64JV_PAGE_SIZE];
+	if(length == 0) return;
+	uint16_t chunk = page_chunk(address, length);
+	fill_page(page_buffer, chunk);
+	while(1){
+		// the previous page has to be finished before the next one can be sent
+		while( poll_busy_W25Q64JV() );
+		write_async_W25Q64JV(address, chunk, page_buffer, NULL);
+		address += chunk;
+		length -= chunk;
+		if(length == 0) break;
+		// stage the next page while the chip is programming
+		chunk = page_chunk(address, length);
+		fill_page(page_buffer, chunk);
+	}
+	while( poll_busy_W25Q64JV() );
+}
+
+// check if all <length> bytes starting at <address> read 0xFF, i.e. are erased
+// the data is received with 16bit frames in pieces of 64 bytes and compared a word at a time,
+// reading stops after the piece with the first byte that is not erased
+bool is_erased_W25Q64JV(uint32_t address, uint32_t length){
+	bool erased = true;
+	uint32_t words[16];
+	// a dead bus reads 0xFF, too
+	SPI_error = 0;
+	bool suspended = suspend_W25Q64JV();
+	uint32_t burst = bus_burst(4);
+	while( erased && (length > 0) ){
+		uint32_t chunk = (length > burst) ? burst : length;
+		// CS low, SPI slave starts to listen
+		CS_LOW();
+		// send instruction
+		SPI_transmit(READ_DATA);
+		// send 24bit address MSB first
+		SPI_transmit( (uint8_t)(address>>16) );
+		SPI_transmit( (uint8_t)(address>>8) );
+		SPI_transmit( (uint8_t)(address) );
+		address += chunk;
+		length -= chunk;
+		while( erased && (chunk > 0) ){
+			uint32_t piece = (chunk > sizeof(words)) ? sizeof(words) : chunk;
+			// the bytes of the last word that aren't received compare as erased
+			words[(piece - 1) / 4] = 0xFFFFFFFF;
+			erased = SPI_transfer(NULL, (uint8_t*)words, piece);
+			for(uint32_t word = 0; word < (piece + 3) / 4; word++){
+				if(words[word] != 0xFFFFFFFF) erased = false;
+			}
+			chunk -= piece;
+		}
+		// CS high, transmission finished
+		CS_HIGH();
+	}
+	resume_W25Q64JV(suspended);
+	return erased && !SPI_error;
+}
+
+// the 4kB sector erase of all these chips, if the SFDP table doesn't list it
+static const W25Q64JV_erase_type_t default_sector_erase = {SECTOR_ERASE_4KB, W25Q64JV_SECTOR_SIZE, W25Q64JV_T_SECTOR_ERASE};
+
+// the erase type of W25Q64JV_geometry that erases <size> bytes, or NULL
+static const W25Q64JV_erase_type_t* find_erase_type(uint32_t size){
+	for(uint8_t type = 0; type < W25Q64JV_geometry.num_erase_types; type++){
+		if(W25Q64JV_geometry.erase_types[type].size == size) return &W25Q64JV_geometry.erase_types[type];
+	}
+	return NULL;
+}
+
+// erase one block with the instruction of an erase type and wait until it's finished
+static void erase_block(const W25Q64JV_erase_type_t* erase_type, uint32_t address){
+	cache_erase(address, erase_type->size);
+	start_erase(erase_type->instruction, address);
+	// CS low, SPI slave starts to listen
+	CS_LOW();
+	// poll status register 1 to check the BUSY bit which indicates that erase procedure is over
+	wait_busy_flag_W25Q64JV();
+	// CS high, transmission finished
+	CS_HIGH();
+}
 
+/* erase all sectors (4kB) that contain at least one byte of the range [address, address+length)
+ *
+ * the range is covered from low to high addresses with the largest block that is aligned and
+ * fits into the rest of the range (the erase types of W25Q64JV_geometry, e.g. 64kB, 32kB, else 4kB).
+ * Before a block is erased, each of its sectors is checked: sectors which are already erased are
+ * skipped and if only a few sectors of a block contain data, erasing just these sectors is faster
+ * than erasing the whole block (compared with the typical erase times of the chip).
+ * NOTE: data in the same sector(s) but outside of the range is erased, too
+ */
+void erase_range_W25Q64JV(uint32_t address, uint32_t length){
+	if(length == 0) return;
+	// the table may also list erase types smaller than a sector, so the sector erase is found by its size
+	const W25Q64JV_erase_type_t* sector_erase = find_erase_type(W25Q64JV_SECTOR_SIZE);
+	if(sector_erase == NULL) sector_erase = &default_sector_erase;
+	// extend the range to whole sectors
+	uint32_t end = address + length;
+	address &= ~(W25Q64JV_SECTOR_SIZE - 1);
+	end = (end + W25Q64JV_SECTOR_SIZE - 1) & ~(W25Q64JV_SECTOR_SIZE - 1);
+	if(end > W25Q64JV_geometry.size) end = W25Q64JV_geometry.size;
 
+	while(address < end){
+		// the largest block (max. 64kB = 16 sectors) that is aligned and fits
+		const W25Q64JV_erase_type_t* block_erase = sector_erase;
+		for(uint8_t type = 0; type < W25Q64JV_geometry.num_erase_types; type++){
+			const W25Q64JV_erase_type_t* erase_type = &W25Q64JV_geometry.erase_types[type];
+			if( (erase_type->size > W25Q64JV_SECTOR_SIZE) && (erase_type->size <= W25Q64JV_BLOCK_64KB_SIZE)
+					&& (address % erase_type->size == 0) && (end - address >= erase_type->size) ){
+				block_erase = erase_type;
+			}
+		}
+		uint32_t block_size = block_erase->size;
+		// find the sectors of this block that still contain data
+		uint16_t dirty_sectors = 0;
+		uint8_t num_dirty_sectors = 0;
+		for(uint8_t sector = 0; sector < block_size/W25Q64JV_SECTOR_SIZE; sector++){
+			if( !is_erased_W25Q64JV(address + sector*W25Q64JV_SECTOR_SIZE, W25Q64JV_SECTOR_SIZE) ){
+				dirty_sectors |= (1<<sector);
+				num_dirty_sectors++;
+			}
+		}
+		if(num_dirty_sectors == 0){
+			// nothing to do
+		}else if( (uint32_t)num_dirty_sectors*sector_erase->typical_time < block_erase->typical_time ){
+			for(uint8_t sector = 0; sector < block_size/W25Q64JV_SECTOR_SIZE; sector++){
+				if(dirty_sectors & (1<<sector)){
+					erase_block(sector_erase, address + sector*W25Q64JV_SECTOR_SIZE);
+				}
+			}
+		}else{
+			erase_block(block_erase, address);
+		}
+		address += block_size;
+	}
+}
 
 
+/*
+ *	integrity checks
+ *	the chip doesn't report failed program or erase operations (e.g. of a worn out
+ *	sector), the only way to detect them is to read the data back. Longer ranges are
+ *	read through two DMA buffers: the next one is filled while the CPU checks the other.
+ */
+
+// CRC32 lookup table (polynomial 0xEDB88320), kept in the flash memory of the µC
+static const uint32_t crc32_table[256] = {
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+	0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+	0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+	0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172, 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+	0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+	0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924, 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+	0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+	0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E, 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+	0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+	0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0, 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+	0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+	0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A, 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+	0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+	0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC, 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+	0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+	0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236, 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+	0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+	0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38, 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+	0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+	0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2, 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+	0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+	0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94, 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+static uint8_t scan_buffer[2][W25Q64JV_PAGE_SIZE];
+static uint32_t scan_crc;
+static const uint8_t* scan_expected;
+
+/* pass <length> bytes from <address> on to <process> in pieces of max. W25Q64JV_PAGE_SIZE bytes
+returns false as soon as <process> returns false or if an SPI error occurred */
+static bool scan_range(uint32_t address, uint32_t length, bool (*process)(const uint8_t* data, uint16_t length)){
+	bool result = true;
+	uint8_t current = 0;
+	uint16_t chunk = (length < W25Q64JV_PAGE_SIZE) ? length : W25Q64JV_PAGE_SIZE;
+	SPI_error = 0;
+	if(chunk > 0){
+		fast_read_DMA_W25Q64JV(address, chunk, scan_buffer[current], NULL);
+	}
+	while(length > 0){
+		while( read_DMA_busy_W25Q64JV() );
+		address += chunk;
+		length -= chunk;
+		// start reading the next piece...
+		uint16_t next_chunk = (length < W25Q64JV_PAGE_SIZE) ? length : W25Q64JV_PAGE_SIZE;
+		if(next_chunk > 0){
+			fast_read_DMA_W25Q64JV(address, next_chunk, scan_buffer[current ^ 1], NULL);
+		}
+		// ... while this one is processed
+		if( !process(scan_buffer[current], chunk) ){
+			result = false;
+			break;
+		}
+		current ^= 1;
+		chunk = next_chunk;
+	}
+	while( read_DMA_busy_W25Q64JV() );
+	return result && !SPI_error;
+}
+
+// update the CRC32 (the common one used by zip, PNG, etc.) with <length> bytes from RAM
+// start with crc = 0, the result of one call can be passed to the next one
+uint32_t crc32_buffer_W25Q64JV(uint32_t crc, const uint8_t* data_ptr, uint32_t length){
+	crc = ~crc;
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		crc = crc32_table[(crc ^ data_ptr[byte_counter]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static bool scan_crc32(const uint8_t* data, uint16_t length){
+	scan_crc = crc32_buffer_W25Q64JV(scan_crc, data, length);
+	return true;
+}
+
+// CRC32 of <length> bytes of the chip from <address> on
+uint32_t crc32_W25Q64JV(uint32_t address, uint32_t length){
+	scan_crc = 0;
+	scan_range(address, length, scan_crc32);
+	return scan_crc;
+}
+
+static bool scan_compare(const uint8_t* data, uint16_t length){
+	bool equal = (memcmp(data, scan_expected, length) == 0);
+	scan_expected += length;
+	return equal;
+}
+
+// compare <length> bytes of the chip from <address> on with the data in RAM, returns true if they are equal
+bool verify_W25Q64JV(uint32_t address, uint32_t length, const uint8_t* expected_ptr){
+	scan_expected = expected_ptr;
+	return scan_range(address, length, scan_compare);
+}
+
+// like write_buffer_W25Q64JV(), but the data is read back afterwards, returns false if it doesn't match
+bool write_verify_W25Q64JV(uint32_t address, uint32_t length, uint8_t* source_ptr){
+	write_buffer_W25Q64JV(address, length, source_ptr);
+	return verify_W25Q64JV(address, length, source_ptr);
+}
+
+// like erase_range_W25Q64JV(), followed by a blank check of all erased sectors, returns false if a byte is not 0xFF
+bool erase_verify_W25Q64JV(uint32_t address, uint32_t length){
+	erase_range_W25Q64JV(address, length);
+	uint32_t start = address - (address % W25Q64JV_SECTOR_SIZE);
+	uint32_t end = address + length;
+	if(end % W25Q64JV_SECTOR_SIZE) end += W25Q64JV_SECTOR_SIZE - (end % W25Q64JV_SECTOR_SIZE);
+	return is_erased_W25Q64JV(start, end - start);
+}
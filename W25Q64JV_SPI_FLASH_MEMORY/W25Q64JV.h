@@ -5,21 +5,138 @@
 #ifndef W25Q64JV_H_
 #define W25Q64JV_H_
 
-#include "stm32f1xx.h"
 #include "W25Q64JV_instruction_set.h"
+
+#ifdef W25Q64JV_HOST_SIM
+// host build (e.g. Linux) against the simulated chip in W25Q64JV_HOST_SIMULATOR
+#include "W25Q64JV_sim.h"
+#else
+#include "stm32f1xx.h"
 #include "SPI.h" //the SPI driver
+#include "SPI_bus.h" //the SPI bus manager
 
-// these 3 defines allow easy porting to another platform
-#define CS_LOW()	GPIOA->BSRR=GPIO_BSRR_BR4	//pull chip select line low
-#define CS_HIGH()	GPIOA->BSRR=GPIO_BSRR_BS4	//push chip select line high
+// these defines allow easy porting to another platform
+#define CS_PIN_LOW()	GPIOA->BSRR=GPIO_BSRR_BR4	//pull chip select line low
+#define CS_PIN_HIGH()	GPIOA->BSRR=GPIO_BSRR_BS4	//push chip select line high
 #define SPI_transmit SPI1_transmit				//transmit & receive 1 byte via SPI
+#define SPI_transfer SPI1_transfer16			//transmit & receive a buffer via SPI (polling, 16bit frames for long buffers)
+#define SPI_DMA_transfer SPI1_DMA_transfer16	//transmit & receive a buffer via SPI using DMA (16bit frames for long reads)
+#define SPI_DMA_transfer8 SPI1_DMA_transfer	//transmit & receive a buffer via SPI using DMA (8bit frames, bytes in order)
+#define SPI_DMA_order SPI1_DMA_order16		//put the bytes received by SPI_DMA_transfer in order (not in the interrupt)
+#define SPI_error SPI1_error					//set by SPI_transmit and SPI_transfer on a timeout
+#define BUS_ACQUIRE()	SPI1_bus_acquire(&W25Q64JV_SPI_device)		//wait for the SPI bus (shared with other devices)
+#define BUS_REQUEST()	SPI1_bus_request(&W25Q64JV_SPI_device)		//get the SPI bus if it's free, without waiting
+#define BUS_TRY()	SPI1_bus_try(&W25Q64JV_SPI_device)			//get the SPI bus only if nobody has it, without queuing up
+#define BUS_RELEASE()	SPI1_bus_release(&W25Q64JV_SPI_device)		//give the SPI bus to the next device
+#define BUS_MAX_BURST()	SPI1_bus_burst_length(&W25Q64JV_SPI_device)	//max. bytes per transaction
+#define CYCLE_COUNTER()	(DWT->CYCCNT)			//CPU clock cycles (enabled in init_W25Q64JV)
+#define CYCLES_PER_US	72						//72MHz CPU clock
+#define TIME_MS()	sysTick_Time				//system time in ms
+
+// SPI clock of the chip: f_SPI = 72MHz/SPI_BAUD_DIV_x
+#ifndef W25Q64JV_SPI_BAUD_DIV
+#define W25Q64JV_SPI_BAUD_DIV	SPI_BAUD_DIV_256
+#endif
+// priority of the chip on the shared SPI bus (see SPI_bus.h)
+#ifndef W25Q64JV_BUS_PRIORITY
+#define W25Q64JV_BUS_PRIORITY	1
+#endif
+extern SPI_device_t W25Q64JV_SPI_device;
+#endif
+
+// every transaction starts and ends here, the chip is woken up from power-down automatically
+#define CS_LOW()	select_W25Q64JV()
+#define CS_HIGH()	deselect_W25Q64JV()
+
+// memory organisation
+#define W25Q64JV_SIZE		0x800000	// 8MB
+#define W25Q64JV_PAGE_SIZE	256
+#define W25Q64JV_SECTOR_SIZE	0x1000		// 4kB
+#define W25Q64JV_BLOCK_32KB_SIZE	0x8000
+#define W25Q64JV_BLOCK_64KB_SIZE	0x10000
+
+// typical erase times in ms (from the datasheet), used to choose the fastest erase instructions
+// if the chip has no SFDP table
+#define W25Q64JV_T_SECTOR_ERASE		45
+#define W25Q64JV_T_BLOCK_ERASE_32KB	120
+#define W25Q64JV_T_BLOCK_ERASE_64KB	150
+// time in µs until the chip accepts instructions after RELEASE_PWR_DWN_ID
+#define W25Q64JV_T_RELEASE_POWER_DOWN	3
+// default time in ms without a transaction until idle_W25Q64JV() powers the chip down
+#define W25Q64JV_IDLE_TIMEOUT		100
+// max. time in µs until a program/erase is suspended, also the min. time between resume and the next suspend
+#define W25Q64JV_T_SUSPEND			20
+
+/*	device discovery
+ *	init_W25Q64JV() reads the JEDEC ID and the SFDP (serial flash discoverable parameters)
+ *	table of the chip and describes it in W25Q64JV_geometry, so the driver also works with
+ *	other sizes (e.g. W25Q16/32/128) without recompiling. Before init and if the chip doesn't
+ *	answer, the values of the W25Q64JV are used.
+ *	NOTE: the sector size (4kB) and the page size (256 bytes) are the same for all of these chips
+ *	and stay compile-time constants. Only 3 byte addresses are supported (max. 16MB).
+ */
+typedef struct {
+	uint8_t instruction;
+	uint32_t size;			// bytes
+	uint16_t typical_time;	// ms
+} W25Q64JV_erase_type_t;
+
+typedef struct {
+	uint8_t manufacturer_ID;	// JEDEC ID, 0xEF for Winbond
+	uint8_t memory_type;
+	uint8_t capacity_ID;		// log2 of the size, e.g. 0x17 for 8MB
+	bool SFDP;					// true if the following values come from the SFDP table
+	uint32_t size;				// bytes
+	uint16_t page_size;
+	uint8_t num_erase_types;
+	W25Q64JV_erase_type_t erase_types[4];	// sorted by size, the smallest first
+	uint8_t fast_read_instruction;
+	uint8_t fast_read_dummy_cycles;
+} W25Q64JV_geometry_t;
+
+extern W25Q64JV_geometry_t W25Q64JV_geometry;
+
+// number of pages (256 bytes each) kept in the RAM read cache (max. 255), 0 disables the cache
+// it should be kept small, e.g. 8 pages use 2kB of the 20kB SRAM
+#ifndef W25Q64JV_CACHE_PAGES
+#define W25Q64JV_CACHE_PAGES	0
+#endif
+
+// max. number of bytes moved by one DMA transfer (limited by the 16bit DMA counter)
+#define W25Q64JV_DMA_CHUNK	0xFFFF
+
+/*	power management
+ *	after W25Q64JV_IDLE_TIMEOUT ms (see set_idle_timeout_W25Q64JV()) without a transaction,
+ *	idle_W25Q64JV() puts the chip into power-down mode. The next transaction wakes it up
+ *	(+3µs), so callers don't have to care about it, they only have to call idle_W25Q64JV()
+ *	regularly, e.g. from the main loop or a timer interrupt.
+ *	residency_ms is updated when the chip wakes up.
+ */
+typedef struct {
+	uint32_t power_downs;
+	uint32_t wake_ups;
+	uint32_t residency_ms;	// total time spent in power-down
+} W25Q64JV_power_stats_t;
+
+extern W25Q64JV_power_stats_t W25Q64JV_power_stats;
 
 void init_W25Q64JV();
+bool probe_W25Q64JV();
+void select_W25Q64JV();
+void deselect_W25Q64JV();
 void power_down_W25Q64JV();
 void power_up_W25Q64JV();
-void read_W25Q64JV(uint32_t address, uint32_t length, uint8_t* destination_ptr);
-void fast_read_W25Q64JV(uint32_t address, uint32_t length, char* destination_ptr);
-void write_W25Q64JV(uint32_t address, uint16_t length, uint8_t* source_ptr);
+bool powered_down_W25Q64JV();
+void set_idle_timeout_W25Q64JV(uint32_t timeout);
+void idle_W25Q64JV();
+bool read_W25Q64JV(uint32_t address, uint32_t length, uint8_t* destination_ptr);
+bool fast_read_W25Q64JV(uint32_t address, uint32_t length, char* destination_ptr);
+// without a callback, the read uses 16bit frames and the data is valid once read_DMA_busy_W25Q64JV()
+// returned false; with a callback, it uses 8bit frames and the data is valid when the callback runs
+void fast_read_DMA_W25Q64JV(uint32_t address, uint32_t length, uint8_t* destination_ptr, void (*callback)(void));
+bool read_DMA_busy_W25Q64JV();
+uint32_t max_read_burst_W25Q64JV();
+bool write_W25Q64JV(uint32_t address, uint16_t length, uint8_t* source_ptr);
 void sector_erase_W25Q64JV(uint32_t address);
 void block_erase_32KB_W25Q64JV(uint32_t address);
 void block_erase_64KB_W25Q64JV(uint32_t address);
@@ -28,5 +145,38 @@ uint64_t get_unique_ID_W25Q64JV();
 void reset_W25Q64JV();
 uint8_t get_status_register1();
 void wait_busy_flag_W25Q64JV();
+// non-blocking program/erase: start the operation, then call poll_busy_W25Q64JV()
+// periodically (e.g. from a timer tick) until it returns false
+bool write_async_W25Q64JV(uint32_t address, uint16_t length, uint8_t* source_ptr, void (*callback)(void));
+void sector_erase_async_W25Q64JV(uint32_t address, void (*callback)(void));
+void block_erase_32KB_async_W25Q64JV(uint32_t address, void (*callback)(void));
+void block_erase_64KB_async_W25Q64JV(uint32_t address, void (*callback)(void));
+void erase_chip_async_W25Q64JV(void (*callback)(void));
+bool poll_busy_W25Q64JV();
+bool async_busy_W25Q64JV();
+// used by the read functions to read while an async program/erase is running
+bool suspend_W25Q64JV();
+void resume_W25Q64JV(bool suspended);
+void end_read_W25Q64JV(bool suspended);
+uint8_t get_status_register2();
+extern uint32_t W25Q64JV_suspends;
+// write any amount of data to previously erased locations, page boundaries are handled internally
+void write_buffer_W25Q64JV(uint32_t address, uint32_t length, uint8_t* source_ptr);
+void write_stream_W25Q64JV(uint32_t address, uint32_t length, void (*fill_page)(uint8_t* buffer, uint16_t length));
+// erase any address range with as few and as fast erase instructions as possible
+bool is_erased_W25Q64JV(uint32_t address, uint32_t length);
+void erase_range_W25Q64JV(uint32_t address, uint32_t length);
+// read through the RAM cache (see W25Q64JV_CACHE_PAGES), the cache is kept up to date
+// by all write and erase functions of this driver
+bool cached_read_W25Q64JV(uint32_t address, uint32_t length, uint8_t* destination_ptr);
+void invalidate_cache_W25Q64JV();
+extern uint32_t W25Q64JV_cache_hits;
+extern uint32_t W25Q64JV_cache_misses;
+// integrity checks: the data is read back to detect failed program/erase operations
+uint32_t crc32_buffer_W25Q64JV(uint32_t crc, const uint8_t* data_ptr, uint32_t length);
+uint32_t crc32_W25Q64JV(uint32_t address, uint32_t length);
+bool verify_W25Q64JV(uint32_t address, uint32_t length, const uint8_t* expected_ptr);
+bool write_verify_W25Q64JV(uint32_t address, uint32_t length, uint8_t* source_ptr);
+bool erase_verify_W25Q64JV(uint32_t address, uint32_t length);
 
 #endif /* W25Q64JV_H_ */
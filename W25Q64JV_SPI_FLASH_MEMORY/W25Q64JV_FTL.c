@@ -0,0 +1,232 @@
+/*	wear-leveling flash translation layer (FTL) for the W25Q64JV
+ *
+ *  see LICENCE.txt
+ */
+#include "W25Q64JV_FTL.h"
+#include <string.h>
+
+// "FTL1"
+#define FTL_MAGIC		0x314C5446
+#define FTL_NONE		0xFFFF
+#define FTL_UNKNOWN		0xFFFFFFFF
+
+// first bytes of the header page of each physical sector
+typedef struct {
+	// written right after the erase
+	uint32_t magic;
+	uint32_t erase_count;
+	// written when the sector holds a complete logical block (0xFF.. while the sector is free)
+	uint32_t sequence;
+	uint16_t block;
+	uint16_t block_check;	// ~block
+} FTL_header_t;
+
+FTL_stats_t FTL_stats;
+
+static uint32_t FTL_start_address;
+static uint16_t FTL_num_sectors;
+static uint16_t FTL_num_blocks;
+static uint32_t FTL_sequence;
+static uint16_t writes_since_check;
+// logical block -> physical sector
+static uint16_t block_map[FTL_MAX_SECTORS];
+// physical sector -> logical block (FTL_NONE = free)
+static uint16_t sector_owner[FTL_MAX_SECTORS];
+static uint32_t erase_count[FTL_MAX_SECTORS];
+
+// one page while blocks are copied
+static uint8_t page_buffer[W25Q64JV_PAGE_SIZE];
+
+static uint32_t sector_address(uint16_t sector){
+	return FTL_start_address + (uint32_t)sector*W25Q64JV_SECTOR_SIZE;
+}
+
+// erase a physical sector, count it and mark it as free
+static void recycle_sector(uint16_t sector){
+	sector_erase_W25Q64JV(sector_address(sector));
+	FTL_stats.erases++;
+	erase_count[sector]++;
+	uint32_t header[2] = {FTL_MAGIC, erase_count[sector]};
+	write_buffer_W25Q64JV(sector_address(sector), sizeof(header), (uint8_t*)header);
+	FTL_stats.flash_bytes_written += sizeof(header);
+	sector_owner[sector] = FTL_NONE;
+}
+
+// return the free sector with the lowest (<most_worn> = false) or highest erase count
+static uint16_t find_free_sector(bool most_worn){
+	uint16_t found = FTL_NONE;
+	for(uint16_t sector = 0; sector < FTL_num_sectors; sector++){
+		if(sector_owner[sector] != FTL_NONE) continue;
+		if( (found == FTL_NONE) || (most_worn ? (erase_count[sector] > erase_count[found]) : (erase_count[sector] < erase_count[found])) ){
+			found = sector;
+		}
+	}
+	return found;
+}
+
+static bool all_erased(const uint8_t* data, uint32_t length){
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		if(data[byte_counter] != 0xFF) return false;
+	}
+	return true;
+}
+
+/* write a new version of <block> into the free sector <target>
+ * the bytes [offset, offset+length) are taken from <source_ptr>, all others from the old version
+ * (so with length = 0 the block is just moved)
+ */
+static void rewrite_block(uint16_t block, uint16_t target, uint32_t offset, uint32_t length, const uint8_t* source_ptr){
+	uint16_t old_sector = block_map[block];
+	uint32_t target_address = sector_address(target);
+	// a write that was interrupted by a power failure may have left data in a free sector
+	if( !is_erased_W25Q64JV(target_address + W25Q64JV_PAGE_SIZE, FTL_BLOCK_SIZE) ){
+		recycle_sector(target);
+	}
+	for(uint32_t page_offset = 0; page_offset < FTL_BLOCK_SIZE; page_offset += W25Q64JV_PAGE_SIZE){
+		// the old content of the page
+		if(old_sector != FTL_NONE){
+			read_W25Q64JV(sector_address(old_sector) + W25Q64JV_PAGE_SIZE + page_offset, W25Q64JV_PAGE_SIZE, page_buffer);
+		}else{
+			memset(page_buffer, 0xFF, W25Q64JV_PAGE_SIZE);
+		}
+		// merge the new data
+		if( (length > 0) && (offset < page_offset + W25Q64JV_PAGE_SIZE) && (offset + length > page_offset) ){
+			uint32_t start = (offset > page_offset) ? offset : page_offset;
+			uint32_t end = (offset + length < page_offset + W25Q64JV_PAGE_SIZE) ? offset + length : page_offset + W25Q64JV_PAGE_SIZE;
+			memcpy(&page_buffer[start - page_offset], &source_ptr[start - offset], end - start);
+		}
+		// an erased page doesn't have to be programmed
+		if( !all_erased(page_buffer, W25Q64JV_PAGE_SIZE) ){
+			write_buffer_W25Q64JV(target_address + W25Q64JV_PAGE_SIZE + page_offset, W25Q64JV_PAGE_SIZE, page_buffer);
+			FTL_stats.flash_bytes_written += W25Q64JV_PAGE_SIZE;
+		}
+	}
+	// commit: from now on, the new version is the valid one
+	uint32_t commit[2] = {++FTL_sequence, (uint32_t)block | ((uint32_t)(uint16_t)~block << 16)};
+	write_buffer_W25Q64JV(target_address + 8, sizeof(commit), (uint8_t*)commit);
+	FTL_stats.flash_bytes_written += sizeof(commit);
+	block_map[block] = target;
+	sector_owner[target] = block;
+	if(old_sector != FTL_NONE) recycle_sector(old_sector);
+}
+
+// move the block with the lowest erase count to the most worn free sector if the difference is too big
+static void static_wear_leveling(){
+	uint16_t coldest = FTL_NONE;
+	for(uint16_t sector = 0; sector < FTL_num_sectors; sector++){
+		if(sector_owner[sector] == FTL_NONE) continue;
+		if( (coldest == FTL_NONE) || (erase_count[sector] < erase_count[coldest]) ) coldest = sector;
+	}
+	uint16_t most_worn = find_free_sector(true);
+	if( (coldest == FTL_NONE) || (most_worn == FTL_NONE) ) return;
+	if(erase_count[most_worn] <= erase_count[coldest] + FTL_WEAR_THRESHOLD) return;
+	// the static data goes to the worn sector, its old sector becomes free for the frequently written data
+	rewrite_block(sector_owner[coldest], most_worn, 0, 0, NULL);
+	FTL_stats.static_moves++;
+}
+
+/* mount the FTL and rebuild the block map from the sector headers
+arguments:		start_address	=	first byte of the FTL area, must be the beginning of a sector
+				num_sectors		=	number of 4kB sectors (FTL_SPARE_SECTORS+1 ... FTL_MAX_SECTORS)
+the number of logical blocks is num_sectors - FTL_SPARE_SECTORS
+returns false if the arguments are invalid */
+bool init_FTL_W25Q64JV(uint32_t start_address, uint16_t num_sectors){
+	if( (start_address % W25Q64JV_SECTOR_SIZE) || (num_sectors <= FTL_SPARE_SECTORS) || (num_sectors > FTL_MAX_SECTORS) ) return false;
+	if(start_address + (uint32_t)num_sectors*W25Q64JV_SECTOR_SIZE > W25Q64JV_geometry.size) return false;
+	FTL_start_address = start_address;
+	FTL_num_sectors = num_sectors;
+	FTL_num_blocks = num_sectors - FTL_SPARE_SECTORS;
+	FTL_sequence = 0;
+	writes_since_check = 0;
+	memset(&FTL_stats, 0, sizeof(FTL_stats));
+	for(uint16_t block = 0; block < FTL_MAX_SECTORS; block++){
+		block_map[block] = FTL_NONE;
+	}
+
+	// read all headers, a sector that doesn't belong to a block (anymore) has to be recycled
+	bool recycle[FTL_MAX_SECTORS];
+	uint32_t sequence[FTL_MAX_SECTORS];
+	uint64_t erase_count_sum = 0;
+	uint16_t known_counts = 0;
+	for(uint16_t sector = 0; sector < num_sectors; sector++){
+		FTL_header_t header;
+		read_W25Q64JV(sector_address(sector), sizeof(header), (uint8_t*)&header);
+		sector_owner[sector] = FTL_NONE;
+		recycle[sector] = false;
+		if(header.magic != FTL_MAGIC){
+			// never used by the FTL or the erase was interrupted
+			erase_count[sector] = FTL_UNKNOWN;
+			recycle[sector] = true;
+			continue;
+		}
+		erase_count[sector] = header.erase_count;
+		erase_count_sum += header.erase_count;
+		known_counts++;
+		if(header.sequence == 0xFFFFFFFF) continue;	// free
+		if( ((header.block ^ header.block_check) != 0xFFFF) || (header.block >= FTL_num_blocks) ){
+			// incomplete commit
+			recycle[sector] = true;
+			continue;
+		}
+		sequence[sector] = header.sequence;
+		if(header.sequence > FTL_sequence) FTL_sequence = header.sequence;
+		uint16_t other = block_map[header.block];
+		if(other != FTL_NONE){
+			// the old copy of a block is still there if the power failed before it was erased
+			if(sequence[other] > header.sequence){
+				recycle[sector] = true;
+				continue;
+			}
+			sector_owner[other] = FTL_NONE;
+			recycle[other] = true;
+		}
+		block_map[header.block] = sector;
+		sector_owner[sector] = header.block;
+	}
+	// a lost erase count is replaced by the average
+	uint32_t average = known_counts ? (uint32_t)(erase_count_sum / known_counts) : 0;
+	for(uint16_t sector = 0; sector < num_sectors; sector++){
+		if(erase_count[sector] == FTL_UNKNOWN) erase_count[sector] = average;
+		if(recycle[sector]) recycle_sector(sector);
+	}
+	return true;
+}
+
+// number of logical blocks of FTL_BLOCK_SIZE bytes
+uint16_t num_blocks_FTL_W25Q64JV(){
+	return FTL_num_blocks;
+}
+
+// read <length> bytes from <offset> in a logical block, a block that has never been written reads 0xFF
+bool read_FTL_W25Q64JV(uint16_t block, uint32_t offset, uint32_t length, uint8_t* destination_ptr){
+	if( (block >= FTL_num_blocks) || (offset + length > FTL_BLOCK_SIZE) ) return false;
+	if(block_map[block] == FTL_NONE){
+		memset(destination_ptr, 0xFF, length);
+	}else{
+		read_W25Q64JV(sector_address(block_map[block]) + W25Q64JV_PAGE_SIZE + offset, length, destination_ptr);
+	}
+	return true;
+}
+
+// overwrite <length> bytes at <offset> in a logical block, the rest of the block is kept
+// (the block is always written to a new sector, so it's best to write whole blocks)
+bool write_FTL_W25Q64JV(uint16_t block, uint32_t offset, uint32_t length, const uint8_t* source_ptr){
+	if( (block >= FTL_num_blocks) || (offset + length > FTL_BLOCK_SIZE) ) return false;
+	rewrite_block(block, find_free_sector(false), offset, length, source_ptr);
+	FTL_stats.host_bytes_written += length;
+	if(++writes_since_check >= FTL_STATIC_CHECK_INTERVAL){
+		writes_since_check = 0;
+		static_wear_leveling();
+	}
+	return true;
+}
+
+// lowest and highest erase count of all sectors of the FTL
+void erase_counts_FTL_W25Q64JV(uint32_t* min_count, uint32_t* max_count){
+	*min_count = FTL_UNKNOWN;
+	*max_count = 0;
+	for(uint16_t sector = 0; sector < FTL_num_sectors; sector++){
+		if(erase_count[sector] < *min_count) *min_count = erase_count[sector];
+		if(erase_count[sector] > *max_count) *max_count = erase_count[sector];
+	}
+}
@@ -0,0 +1,52 @@
+/*	wear-leveling flash translation layer (FTL) for the W25Q64JV
+ *
+ *	a sector of the W25Q64JV survives about 100k erase cycles. If the same
+ *	sectors are overwritten all the time (e.g. by a data logger), they wear
+ *	out while the rest of the chip is still new. The FTL offers a block
+ *	device of logical blocks instead. Every write of a logical block goes to
+ *	a free physical sector with a low erase count, the old one is erased and
+ *	becomes free (dynamic wear leveling). Blocks that are never rewritten
+ *	would keep their sectors forever, so from time to time such a block is
+ *	moved to a heavily worn free sector (static wear leveling).
+ *
+ *	the first page of each physical sector holds its header: the erase count
+ *	is written right after the erase, the logical block number and a sequence
+ *	number are added when a block has been written completely (commit). If
+ *	the power fails during a write, the commit is missing and the old copy of
+ *	the block is still valid at the next init.
+ *	So a logical block has FTL_BLOCK_SIZE = 15 pages = 3840 bytes.
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef W25Q64JV_FTL_H_
+#define W25Q64JV_FTL_H_
+
+#include "W25Q64JV.h"
+
+#define FTL_BLOCK_SIZE		(W25Q64JV_SECTOR_SIZE - W25Q64JV_PAGE_SIZE)
+// max. number of physical sectors managed by the FTL (8 bytes RAM each)
+#define FTL_MAX_SECTORS		128
+// physical sectors that are not available as logical blocks, at least 2
+#define FTL_SPARE_SECTORS	2
+// a static block is moved when the difference of the erase counts exceeds this value
+#define FTL_WEAR_THRESHOLD	16
+// check for static blocks after this many writes
+#define FTL_STATIC_CHECK_INTERVAL	16
+
+typedef struct {
+	uint32_t host_bytes_written;	// bytes passed to write_FTL_W25Q64JV()
+	uint32_t flash_bytes_written;	// bytes programmed into the chip (data pages and headers)
+	uint32_t erases;				// sector erases
+	uint32_t static_moves;			// blocks moved by the static wear leveling
+} FTL_stats_t;
+
+extern FTL_stats_t FTL_stats;
+
+bool init_FTL_W25Q64JV(uint32_t start_address, uint16_t num_sectors);
+uint16_t num_blocks_FTL_W25Q64JV();
+bool read_FTL_W25Q64JV(uint16_t block, uint32_t offset, uint32_t length, uint8_t* destination_ptr);
+bool write_FTL_W25Q64JV(uint16_t block, uint32_t offset, uint32_t length, const uint8_t* source_ptr);
+void erase_counts_FTL_W25Q64JV(uint32_t* min_count, uint32_t* max_count);
+
+#endif /* W25Q64JV_FTL_H_ */
@@ -0,0 +1,85 @@
+/*	asset directory: named clips (e.g. sounds) in a flash image
+ *
+ *  see LICENCE.txt
+ */
+#include "W25Q64JV_assets.h"
+#include <string.h>
+
+typedef struct {
+	uint32_t magic;
+	uint16_t num_assets;
+	uint16_t entry_size;
+	uint32_t crc;			// CRC32 of all entries
+	uint32_t reserved;
+} asset_header_t;
+
+static uint32_t image_address;
+static uint16_t asset_count = 0;
+static W25Q64JV_asset_t assets[ASSETS_MAX];
+// hash of the name -> index of the asset + 1 (0 = empty)
+static uint8_t name_index[ASSET_INDEX_SIZE];
+
+// FNV-1a hash of the name
+static uint32_t hash_name(const char* name){
+	uint32_t hash = 2166136261UL;
+	for(uint8_t i = 0; (i < ASSET_NAME_LENGTH) && name[i]; i++){
+		hash = (hash ^ (uint8_t)name[i]) * 16777619UL;
+	}
+	return hash;
+}
+
+/* read the directory of the image at <address> into RAM
+returns false if there is no valid directory (then no assets are available) */
+bool mount_assets_W25Q64JV(uint32_t address){
+	asset_header_t header;
+	asset_count = 0;
+	memset(name_index, 0, sizeof(name_index));
+	read_W25Q64JV(address, sizeof(header), (uint8_t*)&header);
+	if( (header.magic != ASSET_MAGIC) || (header.entry_size != ASSET_ENTRY_SIZE) || (header.num_assets > ASSETS_MAX) ) return false;
+	read_W25Q64JV(address + ASSET_HEADER_SIZE, (uint32_t)header.num_assets*ASSET_ENTRY_SIZE, (uint8_t*)assets);
+	if(crc32_buffer_W25Q64JV(0, (uint8_t*)assets, (uint32_t)header.num_assets*ASSET_ENTRY_SIZE) != header.crc) return false;
+	for(uint16_t index = 0; index < header.num_assets; index++){
+		if( (uint64_t)address + assets[index].offset + assets[index].length > W25Q64JV_geometry.size ) return false;
+	}
+	for(uint16_t index = 0; index < header.num_assets; index++){
+		W25Q64JV_asset_t* asset = &assets[index];
+		asset->name[ASSET_NAME_LENGTH] = '\0';
+		// a name that is used twice is found with its first entry
+		if(find_asset_W25Q64JV(asset->name) != NULL) continue;
+		uint16_t slot = hash_name(asset->name) & (ASSET_INDEX_SIZE - 1);
+		while(name_index[slot] != 0){
+			slot = (slot + 1) & (ASSET_INDEX_SIZE - 1);
+		}
+		name_index[slot] = index + 1;
+	}
+	image_address = address;
+	asset_count = header.num_assets;
+	return true;
+}
+
+uint16_t num_assets_W25Q64JV(){
+	return asset_count;
+}
+
+// the asset with the index <index> (0 ... num_assets_W25Q64JV()-1), NULL if there is none
+const W25Q64JV_asset_t* asset_W25Q64JV(uint16_t index){
+	if(index >= asset_count) return NULL;
+	return &assets[index];
+}
+
+// the asset called <name>, NULL if there is none
+const W25Q64JV_asset_t* find_asset_W25Q64JV(const char* name){
+	uint16_t slot = hash_name(name) & (ASSET_INDEX_SIZE - 1);
+	// the table is never full, so an empty slot ends the search
+	while(name_index[slot] != 0){
+		const W25Q64JV_asset_t* asset = &assets[name_index[slot] - 1];
+		if(strncmp(asset->name, name, ASSET_NAME_LENGTH + 1) == 0) return asset;
+		slot = (slot + 1) & (ASSET_INDEX_SIZE - 1);
+	}
+	return NULL;
+}
+
+// stream the data of <asset>, end_of_stream_W25Q64JV() becomes true after its last byte
+void open_asset_stream_W25Q64JV(W25Q64JV_stream_t* stream, const W25Q64JV_asset_t* asset){
+	open_stream_W25Q64JV(stream, image_address + asset->offset, asset->length);
+}
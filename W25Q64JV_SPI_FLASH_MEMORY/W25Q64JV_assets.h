@@ -0,0 +1,57 @@
+/*	asset directory: named clips (e.g. sounds) in a flash image
+ *
+ *	the image is built on the PC with W25Q64JV_HOST_ASSET_PACKER and written into
+ *	the chip, e.g. with W25Q64JV_HOST_UPLOADER. It starts with a directory:
+ *		header		magic "AST1", number of entries, CRC32 of the entries
+ *		entries		ASSET_ENTRY_SIZE bytes each, see W25Q64JV_asset_t
+ *		data		each asset starts at a page boundary
+ *	all numbers are little endian, the offsets are relative to the start of the
+ *	image, so the image can be written to any address.
+ *
+ *	mount_assets_W25Q64JV() copies the directory into RAM once, a clip is then found
+ *	by its index or by its name (hash table) without accessing the chip. Its data can
+ *	be read with open_asset_stream_W25Q64JV(), the stream ends exactly at the end of
+ *	the clip.
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef W25Q64JV_ASSETS_H_
+#define W25Q64JV_ASSETS_H_
+
+#include "W25Q64JV.h"
+#include "W25Q64JV_stream.h"
+
+// "AST1"
+#define ASSET_MAGIC			0x31545341
+#define ASSET_HEADER_SIZE	16
+#define ASSET_ENTRY_SIZE	32
+// max. length of a name, without the terminating 0
+#define ASSET_NAME_LENGTH	15
+// max. number of assets kept in RAM (32 bytes each)
+#define ASSETS_MAX			32
+// size of the name hash table, a power of two larger than ASSETS_MAX
+#define ASSET_INDEX_SIZE	64
+
+// sample format of a clip
+#define ASSET_FORMAT_RAW	0	// anything else, e.g. a picture
+#define ASSET_FORMAT_U8		1	// 8 bit unsigned PCM, mono
+#define ASSET_FORMAT_S16LE	2	// 16 bit signed PCM, little endian, mono
+
+// one directory entry, exactly as it is stored in the flash
+typedef struct {
+	char name[ASSET_NAME_LENGTH + 1];	// terminated by 0
+	uint32_t offset;					// first byte, relative to the start of the image
+	uint32_t length;					// bytes
+	uint32_t sample_rate;				// Hz, 0 for ASSET_FORMAT_RAW
+	uint8_t format;
+	uint8_t reserved[3];
+} W25Q64JV_asset_t;
+
+bool mount_assets_W25Q64JV(uint32_t address);
+uint16_t num_assets_W25Q64JV();
+const W25Q64JV_asset_t* asset_W25Q64JV(uint16_t index);
+const W25Q64JV_asset_t* find_asset_W25Q64JV(const char* name);
+void open_asset_stream_W25Q64JV(W25Q64JV_stream_t* stream, const W25Q64JV_asset_t* asset);
+
+#endif /* W25Q64JV_ASSETS_H_ */
@@ -0,0 +1,67 @@
+/*	fast dump of the W25Q64JV memory via USART1
+ *
+ *  see LICENCE.txt
+ */
+#include "W25Q64JV_dump.h"
+
+#ifdef W25Q64JV_HOST_SIM
+// the simulated USART sends the whole buffer at once
+typedef struct {
+	const uint8_t* data_ptr;
+	uint16_t length;
+	volatile bool done;
+} USART1_DMA_buffer_t;
+static bool USART1_DMA_queue(USART1_DMA_buffer_t* buffer){
+	for(uint16_t byte_counter = 0; byte_counter<buffer->length; byte_counter++){
+		sim_UART_write(buffer->data_ptr[byte_counter]);
+	}
+	buffer->done = true;
+	return true;
+}
+#define USART1_DMA_queue_idle()	true
+#define USART1_transmit(data)	sim_UART_write(data)
+#else
+#include "usart1.h"
+#endif
+
+static uint8_t dump_buffer[2][DUMP_BUFFER_SIZE];
+static USART1_DMA_buffer_t dump_tx[2];
+
+/* send <length> bytes from <address> on via USART1, followed by their CRC32 if <append_checksum> is true
+returns the CRC32 */
+uint32_t dump_W25Q64JV(uint32_t address, uint32_t length, bool append_checksum){
+	uint32_t crc = 0;
+	uint8_t current = 0;
+	dump_tx[0].done = true;
+	dump_tx[1].done = true;
+	uint16_t chunk = (length < DUMP_BUFFER_SIZE) ? length : DUMP_BUFFER_SIZE;
+	// the first buffer has to be filled before the USART can start
+	fast_read_DMA_W25Q64JV(address, chunk, dump_buffer[current], NULL);
+	while( read_DMA_busy_W25Q64JV() );
+	while(length > 0){
+		// queue the current buffer, it goes out right after the other one...
+		dump_tx[current].data_ptr = dump_buffer[current];
+		dump_tx[current].length = chunk;
+		USART1_DMA_queue(&dump_tx[current]);
+		address += chunk;
+		length -= chunk;
+		// ... while the other one is filled with the next chunk as soon as it has been sent
+		uint16_t next_chunk = (length < DUMP_BUFFER_SIZE) ? length : DUMP_BUFFER_SIZE;
+		if(next_chunk > 0){
+			while( !dump_tx[current ^ 1].done );
+			fast_read_DMA_W25Q64JV(address, next_chunk, dump_buffer[current ^ 1], NULL);
+		}
+		// ... and the CPU calculates the checksum
+		crc = crc32_buffer_W25Q64JV(crc, dump_buffer[current], chunk);
+		while( read_DMA_busy_W25Q64JV() );
+		current ^= 1;
+		chunk = next_chunk;
+	}
+	while( !USART1_DMA_queue_idle() );
+	if(append_checksum){
+		for(uint8_t byte_counter = 0; byte_counter<4; byte_counter++){
+			USART1_transmit( (uint8_t)(crc >> (8*byte_counter)) );
+		}
+	}
+	return crc;
+}
@@ -0,0 +1,24 @@
+/*	fast dump of the W25Q64JV memory via USART1
+ *
+ *	two RAM buffers are used alternately (ping-pong): while the USART1 TX DMA
+ *	sends one of them, the SPI RX DMA fills the other one with the next part of
+ *	the memory. The filled buffer is queued behind the one being sent (see
+ *	USART1_DMA_queue()), so the dump runs at the full USART line rate without
+ *	gaps, independently of the SPI clock.
+ *	Optionally, the CRC32 of the data (the common one used by zip, PNG, etc.)
+ *	is appended as a 4 byte trailer, LSB first.
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef W25Q64JV_DUMP_H_
+#define W25Q64JV_DUMP_H_
+
+#include "W25Q64JV.h"
+
+// size of each of the two buffers
+#define DUMP_BUFFER_SIZE	512
+
+uint32_t dump_W25Q64JV(uint32_t address, uint32_t length, bool append_checksum);
+
+#endif /* W25Q64JV_DUMP_H_ */
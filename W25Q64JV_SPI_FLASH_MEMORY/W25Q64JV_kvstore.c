@@ -0,0 +1,371 @@
+/*	log-structured key-value store on the W25Q64JV
+ *
+ *  see LICENCE.txt
+ */
+#include "W25Q64JV_kvstore.h"
+#include <string.h>
+
+// "KVS1", marks a sector that belongs to the log
+#define KV_SECTOR_MAGIC		0x3153564B
+#define KV_EMPTY			0xFFFFFFFF
+#define KV_RECORD_VALUE		0xFF
+#define KV_RECORD_DELETED	0x00
+
+// written at the beginning of each sector when it is added to the log
+typedef struct {
+	uint32_t magic;
+	// counts up with every sector added, the highest number is the head of the log
+	uint32_t sequence;
+} KV_sector_header_t;
+
+// followed by the key (without '\0') and the value
+typedef struct {
+	uint8_t key_length;		// 0xFF = free space, the log ends here
+	uint8_t type;			// KV_RECORD_VALUE or KV_RECORD_DELETED
+	uint16_t value_length;
+	uint16_t crc;			// CRC16 over key_length, type, value_length, key and value
+} KV_record_header_t;
+
+#define KV_RECORD_MAX_SIZE	(sizeof(KV_record_header_t) + KV_MAX_KEY_LENGTH + KV_MAX_VALUE_LENGTH)
+
+// location of the log
+static uint32_t KV_start_address;
+static uint16_t KV_num_sectors;
+// the sectors in use follow each other (cyclically) from the oldest to the head sector
+static uint16_t oldest_sector;
+static uint16_t head_sector;
+static uint16_t used_sectors;
+static uint32_t head_offset;
+static uint32_t head_sequence;
+
+// RAM index, open addressing with linear probing
+static struct {
+	uint16_t hash;
+	uint32_t address;
+} KV_index[KV_INDEX_SIZE];
+static uint16_t KV_count;
+
+// holds one complete record while it is written or copied
+static uint8_t record_buffer[KV_RECORD_MAX_SIZE];
+
+static uint32_t sector_address(uint16_t sector){
+	return KV_start_address + (uint32_t)sector*W25Q64JV_SECTOR_SIZE;
+}
+
+// CRC-16/CCITT (polynomial 0x1021)
+static uint16_t crc16(const uint8_t* data, uint32_t length, uint16_t crc){
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		crc ^= (uint16_t)data[byte_counter] << 8;
+		for(uint8_t bit = 0; bit < 8; bit++){
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+static uint16_t record_crc(KV_record_header_t* header, const uint8_t* key_and_value){
+	uint16_t crc = crc16((const uint8_t*)header, 4, 0xFFFF);
+	return crc16(key_and_value, header->key_length + header->value_length, crc);
+}
+
+// FNV-1a hash of the key, folded to 16bit
+static uint16_t hash_key(const char* key, uint8_t key_length){
+	uint32_t hash = 2166136261UL;
+	for(uint8_t i = 0; i < key_length; i++){
+		hash = (hash ^ (uint8_t)key[i]) * 16777619UL;
+	}
+	return (uint16_t)(hash ^ (hash >> 16));
+}
+
+// read the record at <address> into record_buffer and check it
+// returns the size of the record, or 0 if there is no valid record (free space or corrupted)
+static uint32_t read_record(uint32_t address, uint32_t sector_end, KV_record_header_t* header){
+	if(address + sizeof(KV_record_header_t) > sector_end) return 0;
+	cached_read_W25Q64JV(address, sizeof(KV_record_header_t), (uint8_t*)header);
+	if( (header->key_length == 0) || (header->key_length > KV_MAX_KEY_LENGTH) ) return 0;
+	if(header->value_length > KV_MAX_VALUE_LENGTH) return 0;
+	uint32_t size = sizeof(KV_record_header_t) + header->key_length + header->value_length;
+	if(address + size > sector_end) return 0;
+	memcpy(record_buffer, header, sizeof(KV_record_header_t));
+	cached_read_W25Q64JV(address + sizeof(KV_record_header_t), size - sizeof(KV_record_header_t), &record_buffer[sizeof(KV_record_header_t)]);
+	if( record_crc(header, &record_buffer[sizeof(KV_record_header_t)]) != header->crc ) return 0;
+	return size;
+}
+
+// return the index slot of <key>, or -1 if the key is not in the store
+static int16_t find_key(const char* key, uint8_t key_length, uint16_t hash){
+	uint8_t stored_key[sizeof(KV_record_header_t) + KV_MAX_KEY_LENGTH];
+	uint16_t slot = hash & (KV_INDEX_SIZE - 1);
+	while(KV_index[slot].address != KV_EMPTY){
+		if(KV_index[slot].hash == hash){
+			// same hash, compare the key stored in the flash
+			cached_read_W25Q64JV(KV_index[slot].address, sizeof(KV_record_header_t) + key_length, stored_key);
+			if( (stored_key[0] == key_length) && (memcmp(&stored_key[sizeof(KV_record_header_t)], key, key_length) == 0) ){
+				return slot;
+			}
+		}
+		slot = (slot + 1) & (KV_INDEX_SIZE - 1);
+	}
+	return -1;
+}
+
+// add the key to the index or update its address, returns false if the index is full
+static bool index_set(const char* key, uint8_t key_length, uint32_t address){
+	uint16_t hash = hash_key(key, key_length);
+	int16_t slot = find_key(key, key_length, hash);
+	if(slot < 0){
+		// keep at least one empty slot, it ends the search
+		if(KV_count >= KV_INDEX_SIZE - 1) return false;
+		slot = hash & (KV_INDEX_SIZE - 1);
+		while(KV_index[slot].address != KV_EMPTY){
+			slot = (slot + 1) & (KV_INDEX_SIZE - 1);
+		}
+		KV_index[slot].hash = hash;
+		KV_count++;
+	}
+	KV_index[slot].address = address;
+	return true;
+}
+
+// remove a slot from the index and move the following entries back so that the search still finds them
+static void index_remove(uint16_t slot){
+	uint16_t empty = slot;
+	KV_index[empty].address = KV_EMPTY;
+	KV_count--;
+	while(1){
+		slot = (slot + 1) & (KV_INDEX_SIZE - 1);
+		if(KV_index[slot].address == KV_EMPTY) return;
+		uint16_t home = KV_index[slot].hash & (KV_INDEX_SIZE - 1);
+		// the entry can be moved if its home slot is not between the empty slot and its current slot
+		if( ((slot - home) & (KV_INDEX_SIZE - 1)) >= ((slot - empty) & (KV_INDEX_SIZE - 1)) ){
+			KV_index[empty] = KV_index[slot];
+			KV_index[slot].address = KV_EMPTY;
+			empty = slot;
+		}
+	}
+}
+
+// apply a valid record found in the log to the index
+static void index_record(uint32_t address, KV_record_header_t* header){
+	const char* key = (const char*)&record_buffer[sizeof(KV_record_header_t)];
+	if(header->type == KV_RECORD_DELETED){
+		int16_t slot = find_key(key, header->key_length, hash_key(key, header->key_length));
+		if(slot >= 0) index_remove(slot);
+	}else{
+		index_set(key, header->key_length, address);
+	}
+}
+
+// add the next sector to the log and make it the head
+static void open_next_sector(){
+	uint16_t next = (used_sectors == 0) ? head_sector : (head_sector + 1) % KV_num_sectors;
+	uint32_t address = sector_address(next);
+	// a sector left over from an interrupted erase may not be erased completely
+	if( !is_erased_W25Q64JV(address, W25Q64JV_SECTOR_SIZE) ){
+		sector_erase_W25Q64JV(address);
+	}
+	KV_sector_header_t header = {KV_SECTOR_MAGIC, ++head_sequence};
+	write_buffer_W25Q64JV(address, sizeof(header), (uint8_t*)&header);
+	if(used_sectors == 0) oldest_sector = next;
+	head_sector = next;
+	head_offset = sizeof(KV_sector_header_t);
+	used_sectors++;
+}
+
+// append the record in record_buffer to the head sector, returns its address
+static uint32_t append_record(uint32_t size){
+	uint32_t address = sector_address(head_sector) + head_offset;
+	write_buffer_W25Q64JV(address, size, record_buffer);
+	head_offset += size;
+	return address;
+}
+
+// copy the records of the oldest sector that are still up to date to the head and erase it
+// normally the reserve sector becomes the new head for this (<open_reserve> = true),
+// after a compaction that was interrupted by a power failure the head already is the former reserve
+static void collect_garbage(bool open_reserve){
+	uint16_t victim = oldest_sector;
+	uint32_t address = sector_address(victim) + sizeof(KV_sector_header_t);
+	uint32_t sector_end = sector_address(victim) + W25Q64JV_SECTOR_SIZE;
+	if(open_reserve) open_next_sector();
+	KV_record_header_t header;
+	uint32_t size;
+	while( (size = read_record(address, sector_end, &header)) > 0 ){
+		const char* key = (const char*)&record_buffer[sizeof(KV_record_header_t)];
+		if(header.type == KV_RECORD_VALUE){
+			int16_t slot = find_key(key, header.key_length, hash_key(key, header.key_length));
+			// the index points to the newest record of each key
+			if( (slot >= 0) && (KV_index[slot].address == address) ){
+				// the live records of one sector always fit into the reserve, so this is
+				// only a safety net: the sector is kept
+				if(head_offset + size > W25Q64JV_SECTOR_SIZE) return;
+				KV_index[slot].address = append_record(size);
+			}
+		}
+		// deleted keys have no older records outside of the oldest sector, so they can be dropped
+		address += size;
+	}
+	// everything needed has been copied, the sector can be erased now
+	sector_erase_W25Q64JV(sector_address(victim));
+	oldest_sector = (oldest_sector + 1) % KV_num_sectors;
+	used_sectors--;
+}
+
+// make sure that <size> bytes fit into the head sector, returns false if the store is full
+static bool make_room(uint32_t size){
+	uint16_t gc_runs = 0;
+	while(head_offset + size > W25Q64JV_SECTOR_SIZE){
+		if(used_sectors < KV_num_sectors - 1){
+			open_next_sector();
+		}else{
+			// all sectors but the reserve are in use (or even the reserve, see init_KV_store_W25Q64JV())
+			if( (used_sectors == KV_num_sectors) || (gc_runs++ >= KV_num_sectors) ) return false;
+			collect_garbage(true);
+		}
+	}
+	return true;
+}
+
+// build a record from its parts in record_buffer, returns its size
+static uint32_t build_record(const char* key, uint8_t key_length, uint8_t type, const uint8_t* value, uint16_t length){
+	KV_record_header_t header;
+	header.key_length = key_length;
+	header.type = type;
+	header.value_length = length;
+	memcpy(&record_buffer[sizeof(KV_record_header_t)], key, key_length);
+	if(length > 0) memcpy(&record_buffer[sizeof(KV_record_header_t) + key_length], value, length);
+	header.crc = record_crc(&header, &record_buffer[sizeof(KV_record_header_t)]);
+	memcpy(record_buffer, &header, sizeof(KV_record_header_t));
+	return sizeof(KV_record_header_t) + key_length + length;
+}
+
+/* mount the store and rebuild the RAM index from the log
+arguments:		start_address	=	first byte of the store, must be the beginning of a sector
+				num_sectors		=	number of 4kB sectors used by the store (2...KV_MAX_SECTORS)
+returns false if the arguments are invalid */
+bool init_KV_store_W25Q64JV(uint32_t start_address, uint16_t num_sectors){
+	if( (start_address % W25Q64JV_SECTOR_SIZE) || (num_sectors < 2) || (num_sectors > KV_MAX_SECTORS) ) return false;
+	if(start_address + (uint32_t)num_sectors*W25Q64JV_SECTOR_SIZE > W25Q64JV_geometry.size) return false;
+	KV_start_address = start_address;
+	KV_num_sectors = num_sectors;
+	for(uint16_t slot = 0; slot < KV_INDEX_SIZE; slot++){
+		KV_index[slot].address = KV_EMPTY;
+	}
+	KV_count = 0;
+
+	// the sector with the highest sequence number is the head of the log
+	KV_sector_header_t sector_header;
+	bool found = false;
+	for(uint16_t sector = 0; sector < num_sectors; sector++){
+		read_W25Q64JV(sector_address(sector), sizeof(sector_header), (uint8_t*)&sector_header);
+		if( (sector_header.magic == KV_SECTOR_MAGIC) && (!found || (sector_header.sequence > head_sequence)) ){
+			found = true;
+			head_sector = sector;
+			head_sequence = sector_header.sequence;
+		}
+	}
+	used_sectors = 0;
+	head_offset = W25Q64JV_SECTOR_SIZE;
+	if(!found){
+		// empty store
+		head_sector = 0;
+		head_sequence = 0;
+		open_next_sector();
+		return true;
+	}
+	// go back from the head as long as the sequence numbers are consecutive
+	oldest_sector = head_sector;
+	used_sectors = 1;
+	uint32_t sequence = head_sequence;
+	while(used_sectors < num_sectors){
+		uint16_t previous = (oldest_sector + num_sectors - 1) % num_sectors;
+		read_W25Q64JV(sector_address(previous), sizeof(sector_header), (uint8_t*)&sector_header);
+		if( (sector_header.magic != KV_SECTOR_MAGIC) || (sector_header.sequence != sequence - 1) ) break;
+		oldest_sector = previous;
+		sequence--;
+		used_sectors++;
+	}
+
+	// replay the log from the oldest to the newest record
+	for(uint16_t i = 0; i < used_sectors; i++){
+		uint16_t sector = (oldest_sector + i) % num_sectors;
+		uint32_t address = sector_address(sector) + sizeof(KV_sector_header_t);
+		uint32_t sector_end = sector_address(sector) + W25Q64JV_SECTOR_SIZE;
+		KV_record_header_t header;
+		uint32_t size;
+		while( (size = read_record(address, sector_end, &header)) > 0 ){
+			index_record(address, &header);
+			address += size;
+		}
+		if(sector == head_sector){
+			// new records can only be appended if the rest of the sector is really erased,
+			// else (e.g. a record cut off by a power failure) the next record goes to a new sector
+			if( is_erased_W25Q64JV(address, sector_end - address) ){
+				head_offset = address - sector_address(sector);
+			}
+		}
+	}
+	// all sectors in use means that a compaction was interrupted, so finish it
+	if(used_sectors == num_sectors){
+		if(head_offset < W25Q64JV_SECTOR_SIZE){
+			collect_garbage(false);
+		}else{
+			// the copy in the former reserve was cut off, but the oldest sector is still intact:
+			// drop the copy, mount the store without it and do the compaction again
+			sector_erase_W25Q64JV(sector_address(head_sector));
+			if( !init_KV_store_W25Q64JV(start_address, num_sectors) ) return false;
+			collect_garbage(true);
+		}
+	}
+	return true;
+}
+
+// store <length> bytes under <key> (a C-string of 1...KV_MAX_KEY_LENGTH characters)
+// returns false if the key/value is too long or the store is full
+bool set_KV_W25Q64JV(const char* key, const uint8_t* value, uint16_t length){
+	size_t key_length = strlen(key);
+	if( (key_length == 0) || (key_length > KV_MAX_KEY_LENGTH) || (length > KV_MAX_VALUE_LENGTH) ) return false;
+	uint16_t hash = hash_key(key, key_length);
+	if( (find_key(key, key_length, hash) < 0) && (KV_count >= KV_INDEX_SIZE - 1) ) return false;
+	uint32_t size = sizeof(KV_record_header_t) + key_length + length;
+	// this might move records (garbage collection), so it has to be done before building the record
+	if( !make_room(size) ) return false;
+	build_record(key, key_length, KV_RECORD_VALUE, value, length);
+	uint32_t address = append_record(size);
+	return index_set(key, key_length, address);
+}
+
+// read the value of <key>, at most <max_length> bytes are copied
+// returns the length of the stored value or -1 if the key doesn't exist or the read failed
+int32_t get_KV_W25Q64JV(const char* key, uint8_t* destination_ptr, uint16_t max_length){
+	size_t key_length = strlen(key);
+	if( (key_length == 0) || (key_length > KV_MAX_KEY_LENGTH) ) return -1;
+	int16_t slot = find_key(key, key_length, hash_key(key, key_length));
+	if(slot < 0) return -1;
+	KV_record_header_t header;
+	if( !cached_read_W25Q64JV(KV_index[slot].address, sizeof(header), (uint8_t*)&header) ) return -1;
+	uint16_t length = (header.value_length < max_length) ? header.value_length : max_length;
+	if( !cached_read_W25Q64JV(KV_index[slot].address + sizeof(header) + key_length, length, destination_ptr) ) return -1;
+	return header.value_length;
+}
+
+// remove <key> from the store, returns false if it doesn't exist or the store is full
+bool delete_KV_W25Q64JV(const char* key){
+	size_t key_length = strlen(key);
+	if( (key_length == 0) || (key_length > KV_MAX_KEY_LENGTH) ) return false;
+	if( find_key(key, key_length, hash_key(key, key_length)) < 0 ) return false;
+	// a "deleted" record is needed so that an older value isn't found again after the next init
+	uint32_t size = sizeof(KV_record_header_t) + key_length;
+	if( !make_room(size) ) return false;
+	build_record(key, key_length, KV_RECORD_DELETED, NULL, 0);
+	append_record(size);
+	// the garbage collection may have moved the record, so search again
+	int16_t slot = find_key(key, key_length, hash_key(key, key_length));
+	if(slot >= 0) index_remove(slot);
+	return true;
+}
+
+// number of keys in the store
+uint16_t count_KV_W25Q64JV(){
+	return KV_count;
+}
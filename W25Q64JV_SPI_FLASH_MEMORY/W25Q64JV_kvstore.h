@@ -0,0 +1,40 @@
+/*	log-structured key-value store on the W25Q64JV
+ *
+ *	values are never overwritten in place: setting a key appends a new record
+ *	(header, key and value, protected by a CRC) to the current sector, so an
+ *	update costs about one page program instead of a sector erase. A RAM index
+ *	(hash of the key -> flash address of its newest record) is rebuilt from the
+ *	log at init. When the last free sector is needed, the oldest sector is
+ *	compacted: its records which are still up to date are copied to the head of
+ *	the log and the sector is erased.
+ *
+ *	power-fail safety: a record is only valid if its CRC matches, a record that
+ *	was cut off by a power failure is ignored at the next init and the previous
+ *	value of the key stays valid. A sector is only erased after its live records
+ *	have been copied.
+ *
+ *	the store uses <num_sectors> 4kB sectors starting at <start_address>,
+ *	one of them is always kept erased as reserve for the compaction
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef W25Q64JV_KVSTORE_H_
+#define W25Q64JV_KVSTORE_H_
+
+#include "W25Q64JV.h"
+
+#define KV_MAX_KEY_LENGTH	32
+#define KV_MAX_VALUE_LENGTH	512
+// max. number of sectors used by the store
+#define KV_MAX_SECTORS		64
+// max. number of keys, must be a power of two (8 bytes RAM per entry)
+#define KV_INDEX_SIZE		64
+
+bool init_KV_store_W25Q64JV(uint32_t start_address, uint16_t num_sectors);
+bool set_KV_W25Q64JV(const char* key, const uint8_t* value, uint16_t length);
+int32_t get_KV_W25Q64JV(const char* key, uint8_t* destination_ptr, uint16_t max_length);
+bool delete_KV_W25Q64JV(const char* key);
+uint16_t count_KV_W25Q64JV();
+
+#endif /* W25Q64JV_KVSTORE_H_ */
@@ -0,0 +1,309 @@
+/*	ring-buffer data logger on the W25Q64JV
+ *
+ *  see LICENCE.txt
+ */
+#include "W25Q64JV_log.h"
+#include <string.h>
+
+#ifdef W25Q64JV_HOST_SIM
+// seconds of the simulated time
+#define LOG_TIMESTAMP()		(uint32_t)(sim_time_ns() / 1000000000ULL)
+#else
+#include "rtc.h"
+#define LOG_TIMESTAMP()		read_RTC()
+#endif
+
+// "LOG1"
+#define LOG_MAGIC		0x31474F4C
+
+typedef struct {
+	uint32_t magic;
+	// lap * number of sectors + index of the sector
+	uint32_t sequence;
+	uint32_t reserved[2];
+} log_sector_header_t;
+
+// a page in RAM, the data is at the same offsets as in the flash page
+typedef struct {
+	uint32_t sequence;		// sector
+	uint32_t address;		// first byte in the flash
+	uint16_t length;
+	uint8_t data[W25Q64JV_PAGE_SIZE];
+} log_page_t;
+
+log_stats_t log_stats;
+
+static uint32_t log_start_address;
+static uint16_t log_num_sectors;
+// staging pages: <num_queued> full pages from <first_queued> on, then the page being filled
+static log_page_t staging[LOG_STAGING_PAGES];
+static uint8_t first_queued;
+static uint8_t num_queued;
+static bool filling;
+// where the page being filled (or the next one) goes to
+static uint32_t fill_sequence;
+static uint32_t fill_address;
+// end of the programmed records, the readers stop here
+static uint32_t end_sequence;
+static uint32_t end_address;
+// end after the page program that is running
+static uint32_t pending_end_sequence;
+static uint32_t pending_end_address;
+// the sector after the head, erased ahead
+static bool erase_pending;
+static uint32_t erase_sequence;
+
+static uint32_t sector_address(uint32_t sequence){
+	return log_start_address + (sequence % log_num_sectors) * W25Q64JV_SECTOR_SIZE;
+}
+
+// first byte of the next page, the next sector starts after its header
+static void next_page(uint32_t* sequence, uint32_t* address){
+	*address = (*address & ~(uint32_t)(W25Q64JV_PAGE_SIZE - 1)) + W25Q64JV_PAGE_SIZE;
+	if( (*address - log_start_address) % W25Q64JV_SECTOR_SIZE == 0 ){
+		(*sequence)++;
+		*address = sector_address(*sequence) + LOG_SECTOR_HEADER_SIZE;
+	}
+}
+
+// CRC-8 (polynomial 0x07)
+static uint8_t log_CRC8(const uint8_t* data, uint16_t length, uint8_t crc){
+	for(uint16_t byte_counter = 0; byte_counter<length; byte_counter++){
+		crc ^= data[byte_counter];
+		for(uint8_t bit = 0; bit < 8; bit++){
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+// check if sector <sequence> is in the log with exactly this sequence number
+static bool sector_valid(uint32_t sequence){
+	log_sector_header_t header;
+	read_W25Q64JV(sector_address(sequence), sizeof(header), (uint8_t*)&header);
+	return (header.magic == LOG_MAGIC) && (header.sequence == sequence);
+}
+
+static uint32_t read_sequence(uint16_t sector, bool* valid){
+	log_sector_header_t header;
+	read_W25Q64JV(log_start_address + (uint32_t)sector*W25Q64JV_SECTOR_SIZE, sizeof(header), (uint8_t*)&header);
+	*valid = (header.magic == LOG_MAGIC) && (header.sequence % log_num_sectors == sector);
+	return header.sequence;
+}
+
+// first byte of page <page> of a sector that can hold records
+static uint32_t page_start(uint32_t sequence, uint8_t page){
+	return sector_address(sequence) + (page ? (uint32_t)page*W25Q64JV_PAGE_SIZE : LOG_SECTOR_HEADER_SIZE);
+}
+
+static bool page_written(uint32_t sequence, uint8_t page){
+	uint8_t first_byte;
+	read_W25Q64JV(page_start(sequence, page), 1, &first_byte);
+	// the length of a record is never 0xFF
+	return first_byte != 0xFF;
+}
+
+// called by poll_busy_W25Q64JV() when a page has been programmed, its records can be read now
+static void page_programmed(){
+	end_sequence = pending_end_sequence;
+	end_address = pending_end_address;
+}
+
+/* mount the log and find its head
+arguments:		start_address	=	first byte of the log area, must be the beginning of a sector
+				num_sectors		=	number of 4kB sectors, at least 3
+a region that doesn't hold a log is used as an empty log
+returns false if the arguments are invalid */
+bool init_log_W25Q64JV(uint32_t start_address, uint16_t num_sectors){
+	if( (start_address % W25Q64JV_SECTOR_SIZE) || (num_sectors < 3) ) return false;
+	if(start_address + (uint32_t)num_sectors*W25Q64JV_SECTOR_SIZE > W25Q64JV_geometry.size) return false;
+	log_start_address = start_address;
+	log_num_sectors = num_sectors;
+	memset(&log_stats, 0, sizeof(log_stats));
+	first_queued = 0;
+	num_queued = 0;
+	filling = false;
+	while( poll_busy_W25Q64JV() );
+
+	// the sectors from 0 to the head belong to the current lap, all sectors after the head
+	// (except the erased one) to the previous lap. So the head is the last sector whose
+	// sequence number is the one of sector 0 plus its index.
+	bool valid;
+	uint32_t head_sequence = read_sequence(0, &valid);
+	if(valid){
+		uint16_t low = 0;
+		uint16_t high = num_sectors - 1;
+		while(low < high){
+			uint16_t middle = (low + high + 1) / 2;
+			bool middle_valid;
+			if( (read_sequence(middle, &middle_valid) == head_sequence + middle) && middle_valid ){
+				low = middle;
+			}else{
+				high = middle - 1;
+			}
+		}
+		head_sequence += low;
+	}else{
+		// the erase of sector 0 ahead of the last sector may have been interrupted
+		head_sequence = read_sequence(num_sectors - 1, &valid);
+	}
+
+	if(!valid){
+		// empty log: the first sector is erased now, the next one after its first page
+		sector_erase_W25Q64JV(sector_address(0));
+		log_stats.erases++;
+		fill_sequence = 0;
+		fill_address = sector_address(0) + LOG_SECTOR_HEADER_SIZE;
+	}else{
+		// the pages of a sector are written in order, find the first free one
+		uint8_t pages_per_sector = W25Q64JV_SECTOR_SIZE / W25Q64JV_PAGE_SIZE;
+		uint8_t low = 0;
+		uint8_t high = pages_per_sector;
+		while(low < high){
+			uint8_t middle = (low + high) / 2;
+			if( page_written(head_sequence, middle) ){
+				low = middle + 1;
+			}else{
+				high = middle;
+			}
+		}
+		fill_sequence = head_sequence;
+		if(low == pages_per_sector){
+			fill_sequence++;
+			fill_address = sector_address(fill_sequence) + LOG_SECTOR_HEADER_SIZE;
+		}else{
+			fill_address = page_start(head_sequence, low);
+		}
+		// the erase ahead may have been interrupted, it is repeated now (the staging pages
+		// couldn't bridge it together with the erase after the next sector header)
+		if( !is_erased_W25Q64JV(sector_address(head_sequence + 1), W25Q64JV_SECTOR_SIZE) ){
+			sector_erase_W25Q64JV(sector_address(head_sequence + 1));
+			log_stats.erases++;
+		}
+	}
+	erase_pending = false;
+	end_sequence = fill_sequence;
+	end_address = fill_address;
+	return true;
+}
+
+// move the page being filled to the queue, the next one goes to the next page in the flash
+static void queue_page(){
+	num_queued++;
+	filling = false;
+	next_page(&fill_sequence, &fill_address);
+}
+
+/* append a record with the current RTC time
+returns false if the record doesn't fit into the staging pages (the chip is too slow) */
+bool append_log_W25Q64JV(const uint8_t* data, uint8_t length){
+	if( (length == 0) || (length > LOG_MAX_RECORD) || (log_num_sectors == 0) ) return false;
+	uint16_t size = LOG_RECORD_HEADER_SIZE + length;
+	log_page_t* page = &staging[(first_queued + num_queued) % LOG_STAGING_PAGES];
+	if( filling && ((page->address % W25Q64JV_PAGE_SIZE) + page->length + size > W25Q64JV_PAGE_SIZE) ){
+		queue_page();
+		page = &staging[(first_queued + num_queued) % LOG_STAGING_PAGES];
+	}
+	if(!filling){
+		if(num_queued == LOG_STAGING_PAGES){
+			log_stats.dropped++;
+			return false;
+		}
+		page->sequence = fill_sequence;
+		page->address = fill_address;
+		page->length = 0;
+		filling = true;
+	}
+	uint8_t* record = &page->data[(page->address % W25Q64JV_PAGE_SIZE) + page->length];
+	uint32_t timestamp = LOG_TIMESTAMP();
+	record[0] = length;
+	memcpy(&record[2], &timestamp, sizeof(timestamp));
+	memcpy(&record[LOG_RECORD_HEADER_SIZE], data, length);
+	record[1] = log_CRC8(&record[2], sizeof(timestamp) + length, log_CRC8(record, 1, 0));
+	page->length += size;
+	log_stats.records++;
+	return true;
+}
+
+/* call regularly from the main loop, from the same context as append_log_W25Q64JV():
+starts the erase ahead or the program of the next full page if the chip is idle */
+void service_log_W25Q64JV(){
+	if( (log_num_sectors == 0) || poll_busy_W25Q64JV() ) return;
+	if(erase_pending){
+		erase_pending = false;
+		sector_erase_async_W25Q64JV(sector_address(erase_sequence), NULL);
+		log_stats.erases++;
+		return;
+	}
+	if(num_queued == 0) return;
+	log_page_t* page = &staging[first_queued];
+	uint32_t address = page->address;
+	uint16_t offset = address % W25Q64JV_PAGE_SIZE;
+	uint16_t length = page->length;
+	if(offset == LOG_SECTOR_HEADER_SIZE){
+		// the first page of a sector also gets the header
+		log_sector_header_t header = {LOG_MAGIC, page->sequence, {0xFFFFFFFF, 0xFFFFFFFF}};
+		memcpy(page->data, &header, sizeof(header));
+		address -= LOG_SECTOR_HEADER_SIZE;
+		offset = 0;
+		length += LOG_SECTOR_HEADER_SIZE;
+		// ... and the next sector is erased right after this page
+		erase_pending = true;
+		erase_sequence = page->sequence + 1;
+	}
+	pending_end_sequence = page->sequence;
+	pending_end_address = page->address + page->length;
+	// the data is clocked out before the function returns, so the page is free again
+	write_async_W25Q64JV(address, length, &page->data[offset], page_programmed);
+	first_queued = (first_queued + 1) % LOG_STAGING_PAGES;
+	num_queued--;
+	log_stats.pages++;
+}
+
+// program all records that are still in RAM and wait until they are in the chip
+void flush_log_W25Q64JV(){
+	if(filling) queue_page();
+	while( (num_queued > 0) || erase_pending ){
+		service_log_W25Q64JV();
+	}
+	while( poll_busy_W25Q64JV() );
+}
+
+// let <cursor> point to the oldest record
+void rewind_log_W25Q64JV(log_cursor_t* cursor){
+	// the sector after the head is erased, so the log holds up to num_sectors-1 sectors
+	cursor->sequence = (end_sequence > log_num_sectors - 2u) ? end_sequence - (log_num_sectors - 2u) : 0;
+	cursor->address = sector_address(cursor->sequence) + LOG_SECTOR_HEADER_SIZE;
+}
+
+/* read the record at <cursor> and move the cursor to the next one
+up to <max_length> bytes of the data are copied to <destination_ptr>
+returns the length of the record, -1 if there are no more records */
+int16_t read_log_W25Q64JV(log_cursor_t* cursor, uint32_t* timestamp, uint8_t* destination_ptr, uint8_t max_length){
+	uint8_t record[LOG_RECORD_HEADER_SIZE + LOG_MAX_RECORD];
+	while(1){
+		if( (cursor->sequence > end_sequence) || ((cursor->sequence == end_sequence) && (cursor->address >= end_address)) ) return -1;
+		// a sector that has been overwritten or doesn't belong to the log is skipped
+		if( (cursor->address == sector_address(cursor->sequence) + LOG_SECTOR_HEADER_SIZE) && !sector_valid(cursor->sequence) ){
+			cursor->sequence++;
+			cursor->address = sector_address(cursor->sequence) + LOG_SECTOR_HEADER_SIZE;
+			continue;
+		}
+		uint16_t offset = cursor->address % W25Q64JV_PAGE_SIZE;
+		if(offset + LOG_RECORD_HEADER_SIZE <= W25Q64JV_PAGE_SIZE){
+			read_W25Q64JV(cursor->address, LOG_RECORD_HEADER_SIZE, record);
+			uint8_t length = record[0];
+			if( (length > 0) && (length <= LOG_MAX_RECORD) && (offset + LOG_RECORD_HEADER_SIZE + length <= W25Q64JV_PAGE_SIZE) ){
+				read_W25Q64JV(cursor->address + LOG_RECORD_HEADER_SIZE, length, &record[LOG_RECORD_HEADER_SIZE]);
+				if( log_CRC8(&record[2], sizeof(uint32_t) + length, log_CRC8(record, 1, 0)) == record[1] ){
+					memcpy(timestamp, &record[2], sizeof(uint32_t));
+					memcpy(destination_ptr, &record[LOG_RECORD_HEADER_SIZE], (length < max_length) ? length : max_length);
+					cursor->address += LOG_RECORD_HEADER_SIZE + length;
+					return length;
+				}
+			}
+		}
+		// the rest of the page is unused (or damaged by a power failure)
+		next_page(&cursor->sequence, &cursor->address);
+	}
+}
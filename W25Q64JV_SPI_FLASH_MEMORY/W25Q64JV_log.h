@@ -0,0 +1,60 @@
+/*	ring-buffer data logger on the W25Q64JV
+ *
+ *	records (e.g. ADC or sensor readings) are stamped with the RTC time and
+ *	collected in RAM pages. service_log_W25Q64JV() programs every full page
+ *	in the background (non-blocking, like the *_async_* functions), so
+ *	append_log_W25Q64JV() never waits for the chip. Both have to be called
+ *	from the same context, e.g. the main loop. When the log is full, the
+ *	oldest sector is overwritten.
+ *
+ *	the log uses <num_sectors> 4kB sectors from <start_address> on. Each
+ *	sector starts with a header (magic and sequence number = lap*num_sectors
+ *	+ sector index), followed by the records. The sector after the head is
+ *	always erased ahead, so the head is found at init by a binary search over
+ *	the sector headers and the pages of the head sector (a few reads instead
+ *	of a scan of the whole log).
+ *
+ *	record:	length of the data (1 byte) | CRC8 (1 byte) | timestamp (4 bytes) | data
+ *	records never cross a page boundary. Records that are still in RAM are
+ *	lost on a power failure, flush_log_W25Q64JV() writes them immediately
+ *	(the rest of that page stays unused).
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef W25Q64JV_LOG_H_
+#define W25Q64JV_LOG_H_
+
+#include "W25Q64JV.h"
+
+// max. length of the data of one record
+#define LOG_MAX_RECORD		64
+#define LOG_RECORD_HEADER_SIZE	6
+#define LOG_SECTOR_HEADER_SIZE	16
+// pages collected in RAM while the chip is busy (256 bytes each), the erase of a
+// sector (45ms) has to be bridged
+#define LOG_STAGING_PAGES	8
+
+typedef struct {
+	uint32_t records;		// records appended
+	uint32_t dropped;		// records lost because all staging pages were full
+	uint32_t pages;			// pages programmed
+	uint32_t erases;		// sectors erased
+} log_stats_t;
+
+extern log_stats_t log_stats;
+
+// position of a reader in the log
+typedef struct {
+	uint32_t sequence;		// sequence number of the sector
+	uint32_t address;		// next record
+} log_cursor_t;
+
+bool init_log_W25Q64JV(uint32_t start_address, uint16_t num_sectors);
+bool append_log_W25Q64JV(const uint8_t* data, uint8_t length);
+void service_log_W25Q64JV();
+void flush_log_W25Q64JV();
+void rewind_log_W25Q64JV(log_cursor_t* cursor);
+int16_t read_log_W25Q64JV(log_cursor_t* cursor, uint32_t* timestamp, uint8_t* destination_ptr, uint8_t max_length);
+
+#endif /* W25Q64JV_LOG_H_ */
@@ -0,0 +1,52 @@
+/*	sequential read-ahead streaming from the W25Q64JV
+ *
+ *	a stream keeps a RAM buffer filled with the bytes following the current
+ *	read position. Every refill is a separate FAST_READ transaction whose data
+ *	phase is moved by DMA, and CS goes high again when it is finished. So the
+ *	SPI bus is free between two refills and other SPI transactions can be
+ *	done in between, the next refill just continues at the saved position.
+ *
+ *	usage:	open_stream_W25Q64JV() once, then call service_stream_W25Q64JV() regularly
+ *			from the main loop (it starts a refill when there is space in the buffer and
+ *			puts the bytes of the last one in order, see SPI_DMA_order) and take the data
+ *			with read_stream_W25Q64JV()/read_byte_stream_W25Q64JV(), which may also be
+ *			done from an interrupt (e.g. a sample rate timer)
+ *
+ *	NOTE: before using the SPI bus for something else, make sure that no refill is
+ *	running, i.e. stream_refill_busy_W25Q64JV() returns false (which also needs calls
+ *	of service_stream_W25Q64JV())
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef W25Q64JV_STREAM_H_
+#define W25Q64JV_STREAM_H_
+
+#include "W25Q64JV.h"
+
+// size of the read-ahead buffer, must be a power of two
+#define W25Q64JV_STREAM_BUFFER_SIZE	1024
+// a refill is started as soon as this many bytes are free in the buffer
+#define W25Q64JV_STREAM_MIN_REFILL	256
+
+typedef struct {
+	// flash address of the next byte to be fetched from the chip
+	uint32_t address;
+	// bytes left until the end of the stream
+	uint32_t remaining;
+	// the refill (DMA) writes at <head>, the reader reads at <tail>
+	// both only count up, the buffer index is the counter modulo the buffer size
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	uint8_t buffer[W25Q64JV_STREAM_BUFFER_SIZE];
+} W25Q64JV_stream_t;
+
+void open_stream_W25Q64JV(W25Q64JV_stream_t* stream, uint32_t address, uint32_t length);
+void service_stream_W25Q64JV(W25Q64JV_stream_t* stream);
+bool stream_refill_busy_W25Q64JV();
+uint32_t available_stream_W25Q64JV(W25Q64JV_stream_t* stream);
+bool end_of_stream_W25Q64JV(W25Q64JV_stream_t* stream);
+uint32_t read_stream_W25Q64JV(W25Q64JV_stream_t* stream, uint8_t* destination_ptr, uint32_t length);
+bool read_byte_stream_W25Q64JV(W25Q64JV_stream_t* stream, uint8_t* byte);
+
+#endif /* W25Q64JV_STREAM_H_ */
@@ -0,0 +1,138 @@
+/*	framed upload protocol for writing large files into the W25Q64JV via USART1
+ *
+ *  see LICENCE.txt
+ */
+#include "W25Q64JV_upload.h"
+
+#ifdef W25Q64JV_HOST_SIM
+// the USART is simulated as well
+#define UPLOAD_TIME_MS()		(uint32_t)(sim_time_ns() / 1000000)
+#define start_reception()
+#define stop_reception()
+#define receive_available()		sim_UART_available()
+#define receive_next()			sim_UART_read()
+#define transmit(data)			sim_UART_write(data)
+#else
+#include "usart1.h"
+#define UPLOAD_TIME_MS()		sysTick_Time
+#define transmit(data)			USART1_transmit(data)
+// the received bytes are stored by the interrupt handler of usart1.c, its RX ring must hold
+// more than UPLOAD_WINDOW frames
+#if USART1_RX_BUFFER_SIZE <= UPLOAD_WINDOW * (UPLOAD_CHUNK_SIZE + 6)
+#error "USART1_RX_BUFFER_SIZE is too small for UPLOAD_WINDOW"
+#endif
+#define start_reception()		do{ USART1_start_IRQ(); USART1_flush(); }while(0)
+#define stop_reception()
+#define receive_available()		(USART1_available() > 0)
+#define receive_next()			(uint8_t)USART1_receive()
+#endif
+
+typedef enum {FRAME_OK, FRAME_BAD, FRAME_TIMEOUT} frame_result_t;
+
+static uint8_t frame_data[UPLOAD_CHUNK_SIZE];
+
+// CRC-16/CCITT, start with crc = 0xFFFF
+uint16_t upload_CRC16(const uint8_t* data, uint32_t length, uint16_t crc){
+	for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
+		crc ^= (uint16_t)data[byte_counter] << 8;
+		for(uint8_t bit = 0; bit < 8; bit++){
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+// wait for the next received byte, returns false after UPLOAD_TIMEOUT
+static bool receive_byte(uint8_t* data){
+	uint32_t t1 = UPLOAD_TIME_MS();
+	while( !receive_available() ){
+		// a finished page program is noticed here, too
+		poll_busy_W25Q64JV();
+		if( (uint32_t)(UPLOAD_TIME_MS() - t1) >= UPLOAD_TIMEOUT ) return false;
+	}
+	*data = receive_next();
+	return true;
+}
+
+// receive one frame into frame_data
+static frame_result_t receive_frame(uint8_t* sequence, uint16_t* length){
+	uint8_t header[3];
+	uint8_t data;
+	// skip everything up to the next sync byte
+	do{
+		if( !receive_byte(&data) ) return FRAME_TIMEOUT;
+	}while(data != UPLOAD_SYNC);
+	for(uint8_t byte_counter = 0; byte_counter<3; byte_counter++){
+		if( !receive_byte(&header[byte_counter]) ) return FRAME_TIMEOUT;
+	}
+	*sequence = header[0];
+	*length = header[1] | ((uint16_t)header[2] << 8);
+	if( (*length == 0) || (*length > UPLOAD_CHUNK_SIZE) ) return FRAME_BAD;
+	for(uint16_t byte_counter = 0; byte_counter<*length; byte_counter++){
+		if( !receive_byte(&frame_data[byte_counter]) ) return FRAME_TIMEOUT;
+	}
+	uint8_t crc_low, crc_high;
+	if( !receive_byte(&crc_low) || !receive_byte(&crc_high) ) return FRAME_TIMEOUT;
+	uint16_t crc = upload_CRC16(header, 3, 0xFFFF);
+	crc = upload_CRC16(frame_data, *length, crc);
+	if( crc != (crc_low | ((uint16_t)crc_high << 8)) ) return FRAME_BAD;
+	return FRAME_OK;
+}
+
+static void send_reply(uint8_t type, uint8_t sequence){
+	transmit(type);
+	transmit(sequence);
+}
+
+// start programming the frame, it is split if it crosses a page boundary
+static void program_frame(uint32_t address, uint16_t length){
+	uint16_t first = W25Q64JV_PAGE_SIZE - (address % W25Q64JV_PAGE_SIZE);
+	if(first > length) first = length;
+	// wait for the previous frame, the reception goes on in the interrupt
+	while( poll_busy_W25Q64JV() );
+	write_async_W25Q64JV(address, first, frame_data, NULL);
+	if(first < length){
+		while( poll_busy_W25Q64JV() );
+		write_async_W25Q64JV(address + first, length - first, &frame_data[first], NULL);
+	}
+}
+
+/* receive <length> bytes with the upload protocol and write them to the chip from <address> on
+returns false if the host stopped sending (timeout) */
+bool upload_W25Q64JV(uint32_t address, uint32_t length){
+	uint32_t num_frames = (length + UPLOAD_CHUNK_SIZE - 1) / UPLOAD_CHUNK_SIZE;
+	uint32_t next_frame = 0;
+	uint8_t sequence;
+	uint16_t frame_length;
+	start_reception();
+	// request the first frame
+	send_reply(UPLOAD_NAK, 0);
+	// only one NAK per lost frame, the following frames of the window are just dropped
+	bool NAK_sent = true;
+	while(next_frame < num_frames){
+		frame_result_t result = receive_frame(&sequence, &frame_length);
+		if(result == FRAME_TIMEOUT){
+			while( poll_busy_W25Q64JV() );
+			stop_reception();
+			return false;
+		}
+		uint32_t offset = next_frame * UPLOAD_CHUNK_SIZE;
+		uint16_t expected_length = (length - offset < UPLOAD_CHUNK_SIZE) ? (length - offset) : UPLOAD_CHUNK_SIZE;
+		if( (result == FRAME_OK) && (sequence == (uint8_t)next_frame) && (frame_length == expected_length) ){
+			program_frame(address + offset, frame_length);
+			next_frame++;
+			NAK_sent = false;
+			// the last frame is only acknowledged when it is in the chip
+			if(next_frame == num_frames) while( poll_busy_W25Q64JV() );
+			send_reply(UPLOAD_ACK, sequence);
+		}else if( (result == FRAME_OK) && ((uint8_t)(next_frame - sequence - 1) < UPLOAD_WINDOW) ){
+			// a frame that was already received, the host missed the ACK
+			send_reply(UPLOAD_ACK, (uint8_t)(next_frame - 1));
+		}else if(!NAK_sent){
+			send_reply(UPLOAD_NAK, (uint8_t)next_frame);
+			NAK_sent = true;
+		}
+	}
+	stop_reception();
+	return true;
+}
@@ -0,0 +1,40 @@
+/*	framed upload protocol for writing large files into the W25Q64JV via USART1
+ *
+ *	host -> µC: the data is split into frames of UPLOAD_CHUNK_SIZE bytes (the last one may be shorter)
+ *		UPLOAD_SYNC | sequence number | length (2 bytes, LSB first) | data | CRC (2 bytes, LSB first)
+ *	frame n holds the data from n*UPLOAD_CHUNK_SIZE on, its sequence number is n modulo 256.
+ *	The CRC16 (CCITT, start value 0xFFFF) covers sequence number, length and data.
+ *
+ *	µC -> host: 2 bytes
+ *		UPLOAD_ACK | n		frame n and all frames before have been received correctly
+ *		UPLOAD_NAK | n		send again from frame n on (a frame got lost or its CRC was wrong)
+ *	the upload starts with UPLOAD_NAK | 0. The host may send up to UPLOAD_WINDOW frames
+ *	without waiting for their ACKs, so the next frames arrive while the chip is programming.
+ *	The µC buffers the received bytes in the RX ring of usart1.c (filled by DMA or by the
+ *	USART1 interrupt), nothing is lost while the CPU is busy with the SPI transfers. The ACK of the last frame is sent when it has been
+ *	programmed. If the host gets no answer within its timeout, it goes back to the oldest
+ *	frame that has not been acknowledged.
+ *
+ *	the memory range has to be erased before (e.g. with erase_range_W25Q64JV())
+ *
+ *  see LICENCE.txt
+ */
+
+#ifndef W25Q64JV_UPLOAD_H_
+#define W25Q64JV_UPLOAD_H_
+
+#include "W25Q64JV.h"
+
+#define UPLOAD_CHUNK_SIZE	256
+// max. number of frames the host may send ahead
+#define UPLOAD_WINDOW		4
+#define UPLOAD_SYNC			0xA5
+#define UPLOAD_ACK			0x06
+#define UPLOAD_NAK			0x15
+// the upload is aborted if no byte is received for this time (in ms)
+#define UPLOAD_TIMEOUT		10000
+
+bool upload_W25Q64JV(uint32_t address, uint32_t length);
+uint16_t upload_CRC16(const uint8_t* data, uint32_t length, uint16_t crc);
+
+#endif /* W25Q64JV_UPLOAD_H_ */
@@ -1,8 +1,11 @@
 /*	testing the Winbond W25Q64JV SPI flash memory
  *
- *	NOTE: when writing to the chip, the SPI clock rate
- *	should be much faster than the USART baud rate to avoid
- *	losing data (there is no buffering implemented)
+ *	NOTE: the USART runs in interrupt mode (see usart1.h), the
+ *	received bytes are buffered by DMA while the chip is busy and
+ *	the text is sent while the CPU goes on (the menu by DMA).
+ *	The baud rate (TOOL_BAUD_RATE) can be raised up to 2Mbaud.
+ *	Writing multiple pages (8) uses the framed upload protocol
+ *	(see W25Q64JV_upload.h and W25Q64JV_HOST_UPLOADER) instead.
  *
  *  connection:
  *	PB3 -> CLK
@@ -20,25 +23,40 @@
 #include "init.h"
 #include "W25Q64JV.h"
 #include "usart1.h"
+#include "W25Q64JV_upload.h"
+#include "W25Q64JV_dump.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
+// must match the baud rate of the terminal or W25Q64JV_HOST_UPLOADER
+#define TOOL_BAUD_RATE	9600
+
+static const char menu_text[] = "|--------------------------------------------|\n| W25Q64JV Flash Memory Tool |\n|--------------------------------------------|"
+		"\n\nenter number to choose among the following:\n\n1 erase block (64kB)\n2 write one page (max. 256 byte)\n3 get unique chip ID\n4 erase whole chip (use with caution. Takes a long time, up to ~1min)\n5 power down chip (to test current consumption)\n6 power up chip (to test current consumption)\n7 read data from chip\n8 write multiple pages (>256 byte)\n9 erase address range (any length, rounded to 4kB sectors)\n";
+static USART1_DMA_buffer_t menu = {.data_ptr = (const uint8_t*)menu_text, .length = sizeof(menu_text) - 1, .done = true};
+
 int main(void)
 {
 	// Initialize system timer for 1ms ticks (else divide by 1e6 for µs ticks)
 	SysTick_Config(SystemCoreClock / 1e3);
 	init_USART1();
+	USART1_set_baud_rate(TOOL_BAUD_RATE);
+	// the received bytes are read from the RX ring, which is filled by DMA
+	USART1_DMA_start_receive(NULL);
 	init_W25Q64JV();
 
 	while(1){
-		USART1_transmitString("|--------------------------------------------|\n| W25Q64JV Flash Memory Tool |\n|--------------------------------------------|");
-		USART1_transmitString("\n\nenter number to choose among the following:\n\n1 erase block (64kB)\n2 write one page (max. 256 byte)\n3 get unique chip ID\n4 erase whole chip (use with caution. Takes a long time, up to ~1min)\n5 power down chip (to test current consumption)\n6 power up chip (to test current consumption)\n7 read data from chip\n8 write multiple pages (>256 byte)\n9 erase multiple blocks (64kb per block)\n");
+		// the menu is sent by DMA straight from the flash memory of the µC
+		while( !menu.done );
+		USART1_DMA_queue(&menu);
 		USART1_flush();
 		char strbuf[30];
 		uint32_t address;
 		uint32_t length;
 
+		// the chip goes to power-down while the tool waits for the user
+		while( USART1_available() == 0 ) idle_W25Q64JV();
 		switch(USART1_receive()){
 
 		case '1': //erase block(64kb)
@@ -93,11 +111,11 @@ int main(void)
 			uint32_t timeout = sysTick_Time;
 			// if after a timeout of 500ms no data is available, stop reception
 			while(1){
-				// wait until the USART data register is not empty and check for timeout
-				while (!((USART1->SR) & USART_SR_RXNE) && ((sysTick_Time-timeout) < 500));
+				// wait until a byte has been received and check for timeout
+				while ((USART1_available() == 0) && ((sysTick_Time-timeout) < 500));
 				if((sysTick_Time-timeout) >= 500) break;
-				// get one byte from USART and pass it on via SPI
-				SPI_transmit(((USART1->DR) & 0xFF));
+				// get one byte from the RX ring and pass it on via SPI
+				SPI_transmit(USART1_receive());
 			}
 			// CS high, transmission finished
 			CS_HIGH();
@@ -115,11 +133,22 @@ int main(void)
 			USART1_transmitString("unique chip ID is (HEX format): ");
 			itoa(get_unique_ID_W25Q64JV(), strbuf, 16);
 			USART1_transmitString(strbuf);
+			// found by probe_W25Q64JV() in init_W25Q64JV()
+			USART1_transmitString("\nJEDEC ID: ");
+			USART1_transmitString(utoa( ((uint32_t)W25Q64JV_geometry.manufacturer_ID << 16) | (W25Q64JV_geometry.memory_type << 8) | W25Q64JV_geometry.capacity_ID, strbuf, 16));
+			USART1_transmitString("\nsize in bytes: ");
+			USART1_transmitString(utoa(W25Q64JV_geometry.size, strbuf, 10));
+			USART1_transmitString(W25Q64JV_geometry.SFDP ? " (from SFDP)" : " (from JEDEC ID)");
 			break;
 
 		case '4':
 			USART1_transmitString("erasing whole chip...");
-			erase_chip_W25Q64JV();
+			erase_chip_async_W25Q64JV(NULL);
+			// the CPU is free while the chip is erasing, print a dot every second
+			while( poll_busy_W25Q64JV() ){
+				delay(1000);
+				USART1_transmit('.');
+			}
 			USART1_transmitString("erasing finished.");
 			break;
 
@@ -151,23 +180,13 @@ int main(void)
 				USART1_transmitString("\nERROR: length must be >0");
 				break;
 			}
+			USART1_transmitString("\nappend CRC32 checksum (4 bytes, LSB first)? (y/n): ");
+			USART1_flush();
+			bool append_checksum = (USART1_receive() == 'y');
 			USART1_transmitString("OK. Data transmission will start in 5 seconds. get ready!");
 			delay(5000);
-			// CS low, SPI slave starts to listen
-			CS_LOW();
-			// send instruction
-			SPI_transmit(FAST_READ);
-			// send 24bit address MSB first
-			SPI_transmit( (uint8_t)(address>>16) );
-			SPI_transmit( (uint8_t)(address>>8) );
-			SPI_transmit( (uint8_t)(address) );
-			//send 8 dummy clocks, i.e. 1 dummy byte
-			SPI_transmit(0xFF);
-			for(uint32_t byte_counter = 0; byte_counter<length; byte_counter++){
-				USART1_transmit(SPI_transmit(0xFF));
-			}
-			// CS high, transmission finished
-			CS_HIGH();
+			// the next part of the memory is read by DMA while the previous one is sent
+			dump_W25Q64JV(address, length, append_checksum);
 			break;
 
 		case '8': //write more than one page
@@ -188,52 +207,24 @@ int main(void)
 				USART1_transmitString("\nERROR: length must be >0");
 				break;
 			}
-			USART1_transmitString("\nsend data now!");
-			uint32_t num_pages = length / 256;
-			uint32_t rest_page_length = length - 256*num_pages;
-			for(uint32_t page_iterator = 0; page_iterator<num_pages; page_iterator++){
-				// CS low, SPI slave starts to listen
-				CS_LOW();
-				// send instruction
-				SPI_transmit(WRITE_ENABLE);
-				// CS high, transmission finished
-				CS_HIGH();
-				//eventually a small delay is needed here, depends on your µC's speed
-				asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
-				// CS low, SPI slave starts to listen
-				CS_LOW();
-				// send instruction
-				SPI_transmit(PAGE_PROGRAM);
-				// send 24bit address MSB first
-				SPI_transmit( (uint8_t)(address>>16) );
-				SPI_transmit( (uint8_t)(address>>8) );
-				// from datasheet: If an entire 256 byte page is to be programmed, the last address byte (the 8 LSB) should be set to 0.
-				SPI_transmit(0);
-				for(uint32_t byte_counter = 0; byte_counter<256; byte_counter++){
-					SPI_transmit(USART1_receive());
-				}
-				// CS high, transmission finished
-				CS_HIGH();
-				//eventually a small delay is needed here, depends on your µC's speed
-				asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
-				// CS low, SPI slave starts to listen
-				CS_LOW();
-				// poll status register 1 to check the BUSY bit which indicates that writing procedure is over
-				wait_busy_flag_W25Q64JV();
-				CS_HIGH();
-				//eventually a small delay is needed here, depends on your µC's speed
-				asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");asm("NOP");
-				address += 256;
+			if( address + length > W25Q64JV_geometry.size ){
+				USART1_transmitString("\nERROR: not enough space on the chip");
+				break;
 			}
-			uint8_t rest_page_buf[255];
-			for(uint8_t x=0; x<rest_page_length; x++){
-				rest_page_buf[x] = USART1_receive();
+			USART1_transmitString("\nsend data now!\n");
+			// the next frames are received while the chip programs the current one
+			if( upload_W25Q64JV(address, length) ){
+				USART1_transmitString("\nwriting finished.");
+				// read back, so the host can compare it with the CRC32 of its file
+				USART1_transmitString(" CRC32: ");
+				USART1_transmitString(utoa(crc32_W25Q64JV(address, length), strbuf, 16));
+				USART1_transmitString("\n");
+			}else{
+				USART1_transmitString("\nERROR: upload aborted (timeout)");
 			}
-			write_W25Q64JV(address, rest_page_length, rest_page_buf);
-			USART1_transmitString("\nwriting finished.");
 			break;
 
-		case '9': //erase multiple blocks (64kb per block)
+		case '9': //erase address range
 			USART1_transmitString("enter 24bit address in HEX format: ");
 			USART1_flush();
 			USART1_receiveString(strbuf, sizeof(strbuf));
@@ -243,9 +234,20 @@ int main(void)
 				USART1_transmitString("\nERROR: not a valid 24bit address");
 				break;
 			}
-			USART1_transmitString("\nerasing block...");
-			block_erase_64KB_W25Q64JV(address);
-			USART1_transmitString("\nfinished erasing block.");
+			USART1_transmitString("\nenter amount of bytes to be erased in decimal format: ");
+			USART1_receiveString(strbuf, sizeof(strbuf));
+			length = strtol(strbuf, NULL, 10);
+			USART1_transmitString(itoa(length, strbuf, 10));
+			if( length <= 0 ){
+				USART1_transmitString("\nERROR: length must be >0");
+				break;
+			}
+			USART1_transmitString("\nerasing...");
+			if( erase_verify_W25Q64JV(address, length) ){
+				USART1_transmitString("\nfinished erasing.");
+			}else{
+				USART1_transmitString("\nERROR: the range is not blank after erasing");
+			}
 			break;
 
 		default:
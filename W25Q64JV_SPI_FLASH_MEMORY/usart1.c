@@ -6,6 +6,26 @@
  */
 #include "usart1.h"
 
+#if defined(SPI2_USE_DMA) && SPI2_USE_DMA
+#error "DMA1 channel 4 and 5 are used by SPI2 (SPI2_USE_DMA), they can't be used for USART1"
+#endif
+
+// ring buffers of the interrupt mode, head and tail count up freely and are masked on access.
+// Every index has only one writer (RX: head = ISR, tail = main loop; TX: the other way round),
+// so no locks are needed.
+static uint8_t rx_buffer[USART1_RX_BUFFER_SIZE];
+static uint8_t tx_buffer[USART1_TX_BUFFER_SIZE];
+static volatile uint32_t rx_head = 0;
+static volatile uint32_t rx_tail = 0;
+static volatile uint32_t tx_head = 0;
+static volatile uint32_t tx_tail = 0;
+static bool irq_mode = false;
+static volatile bool rx_dma = false;	// the RX ring is filled by DMA1 channel 5 instead of the RXNE interrupt
+static void (*rx_callback)(const uint8_t* data_ptr, uint16_t length, bool idle) = NULL;
+volatile uint32_t USART1_rx_dropped = 0;
+
+static void sync_rx_head(void);
+
 // initialize the USART with default settings (1start, 8data, 1stop bit) and 9600 baud rate
 void init_USART1(void) {
 	//	enable GPIO port A clock , alternate function I/O clock and USART1 clock
@@ -22,7 +42,19 @@ void init_USART1(void) {
 	GPIOA->CRH |= GPIO_CRH_CNF10_0;
 }
 
+// change the baud rate (e.g. 2000000 for the DMA receive), from the 72MHz PCLK2
+void USART1_set_baud_rate(uint32_t baud_rate){
+	USART1->CR1 &= ~USART_CR1_UE;
+	USART1->BRR = (72000000 + baud_rate/2) / baud_rate;
+	USART1->CR1 |= USART_CR1_UE;
+}
+
 char USART1_receive(void) {
+	if(irq_mode){
+		uint8_t data;
+		while( USART1_read(&data, 1) == 0 );
+		return data;
+	}
 	// wait until the USART data register is not empty
 	while (!((USART1->SR) & USART_SR_RXNE));
 	// return the content (first byte) of the data register
@@ -41,12 +73,30 @@ void USART1_receiveString(char* destination_str_ptr, uint32_t length){
 }
 
 void USART1_flush(){
+	if(irq_mode){
+		sync_rx_head();
+		rx_tail = rx_head;
+		return;
+	}
 	while ((USART1->SR) & USART_SR_RXNE){
 		USART1->DR;
 	}
 }
 
+// copy all bytes into the TX ring, waiting only if it is full
+static void write_all(const uint8_t* source_ptr, uint32_t length){
+	while(length > 0){
+		uint32_t written = USART1_write(source_ptr, length);
+		source_ptr += written;
+		length -= written;
+	}
+}
+
 void USART1_transmit(char data) {
+	if(irq_mode){
+		write_all((uint8_t*)&data, 1);
+		return;
+	}
 	// 	wait until the USART data register is empty i.e. ready to transmit
 	while (!((USART1->SR) & USART_SR_TXE))
 		;
@@ -57,7 +107,390 @@ void USART1_transmit(char data) {
 }
 
 void USART1_transmitString(char* data_string){
+	if(irq_mode){
+		write_all((uint8_t*)data_string, strlen(data_string));
+		return;
+	}
 	while( *data_string != 0 ){
 		USART1_transmit(*data_string++);
 	}
 }
+
+/*	DMA transmit queue
+ *
+ *	the buffers are sent by DMA1 channel 4 one after the other. The next one is
+ *	started from the DMA interrupt as soon as the last byte of the previous one
+ *	has been moved into the data register, so there is no gap on the line.
+ *	The TX ring of the interrupt mode and the queue take turns: the ring waits
+ *	until the queue is empty and the queue waits until the ring is empty.
+ */
+static USART1_DMA_buffer_t* volatile dma_queue[USART1_DMA_QUEUE_LENGTH];
+static volatile uint8_t dma_head = 0;
+static volatile uint8_t dma_tail = 0;
+static volatile bool dma_running = false;
+static bool dma_ready = false;
+
+// start sending the buffer at the head of the queue
+static void start_DMA(void){
+	USART1_DMA_buffer_t* buffer = dma_queue[dma_head];
+	DMA1_Channel4->CCR = 0;
+	DMA1->IFCR = DMA_IFCR_CGIF4;
+	DMA1_Channel4->CMAR = (uint32_t) buffer->data_ptr;
+	DMA1_Channel4->CNDTR = buffer->length;
+	DMA1_Channel4->CCR = (DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE | DMA_CCR_EN);
+	dma_running = true;
+}
+
+// this is triggered when the last byte of a buffer has been moved into the data register
+void DMA1_Channel4_IRQHandler(void){
+	DMA1_Channel4->CCR = 0;
+	DMA1->IFCR = DMA_IFCR_CGIF4;
+	USART1_DMA_buffer_t* buffer = dma_queue[dma_head];
+	dma_head = (dma_head + 1) & (USART1_DMA_QUEUE_LENGTH - 1);
+	dma_running = false;
+	// start the next buffer first, the callback may queue another one
+	if(dma_head != dma_tail){
+		start_DMA();
+	}else if(tx_head != tx_tail){
+		// the TX ring has been waiting for the queue
+		USART1->CR1 |= USART_CR1_TXEIE;
+	}
+	buffer->done = true;
+	if(buffer->callback) buffer->callback(buffer);
+}
+
+/* queue <buffer> for sending with DMA1 channel 4, it is started right away if the USART is idle
+<buffer> and its data must stay valid until its <done> flag is set or its callback is called
+returns false if the queue is full. Can be called from interrupts, e.g. from a callback. */
+bool USART1_DMA_queue(USART1_DMA_buffer_t* buffer){
+	if(!dma_ready){
+		// enable DMA1 clock, memory -> USART1 data register
+		RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+		DMA1_Channel4->CCR = 0;
+		DMA1_Channel4->CPAR = (uint32_t) (&(USART1->DR));
+		// let the USART request a new byte whenever the data register is empty
+		USART1->CR3 |= USART_CR3_DMAT;
+		NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+		dma_ready = true;
+	}
+	if(buffer->length == 0){
+		buffer->done = true;
+		if(buffer->callback) buffer->callback(buffer);
+		return true;
+	}
+	// the DMA interrupt removes buffers from the queue
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t next_tail = (dma_tail + 1) & (USART1_DMA_QUEUE_LENGTH - 1);
+	if(next_tail == dma_head){
+		__set_PRIMASK(primask);
+		return false;
+	}
+	buffer->done = false;
+	bool idle = (dma_head == dma_tail);
+	dma_queue[dma_tail] = buffer;
+	dma_tail = next_tail;
+	// if the TX ring isn't empty, the USART1 interrupt starts the queue when it is
+	if(idle && (tx_head == tx_tail)) start_DMA();
+	__set_PRIMASK(primask);
+	return true;
+}
+
+// check if all buffers queued with USART1_DMA_queue() have been sent
+// (the last byte may still be in the shift register when it returns true)
+bool USART1_DMA_queue_idle(void){
+	return dma_head == dma_tail;
+}
+
+static USART1_DMA_buffer_t single_buffer = {.done = true};
+
+// start sending <length> bytes with DMA1 channel 4 and return immediately
+// the data must not be changed until USART1_DMA_busy() returns false
+void USART1_DMA_transmit(const uint8_t* data_ptr, uint16_t length){
+	while( !single_buffer.done );
+	single_buffer.data_ptr = data_ptr;
+	single_buffer.length = length;
+	while( !USART1_DMA_queue(&single_buffer) );
+}
+
+// check if a transfer started by USART1_DMA_transmit() is still running
+// (the last byte may still be in the shift register when it returns false)
+bool USART1_DMA_busy(void){
+	return !single_buffer.done;
+}
+
+/*	double-buffered log writer
+ *
+ *	USART1_log() copies the bytes into one of two buffers and returns, while the
+ *	other one is sent by the DMA queue. When it has been sent, the buffers are
+ *	swapped from the DMA interrupt, so a continuous stream (e.g. telemetry) only
+ *	costs the CPU the copies. If both buffers are full, the bytes are dropped
+ *	and counted in USART1_log_dropped.
+ */
+static uint8_t log_buffer[2][USART1_LOG_BUFFER_SIZE];
+static volatile uint8_t log_fill = 0;		// the buffer that is being filled
+static volatile uint16_t log_length = 0;
+static volatile bool log_writing = false;	// USART1_log() is copying into the buffer
+volatile uint32_t USART1_log_dropped = 0;
+static void log_sent(USART1_DMA_buffer_t* buffer);
+static USART1_DMA_buffer_t log_tx = {.callback = log_sent, .done = true};
+
+// send the buffer that is being filled and fill the other one (called with interrupts disabled)
+static void send_log(void){
+	if(log_length == 0) return;
+	log_tx.data_ptr = log_buffer[log_fill];
+	log_tx.length = log_length;
+	// if the queue is full, the next USART1_log() tries again
+	if( !USART1_DMA_queue(&log_tx) ) return;
+	log_fill ^= 1;
+	log_length = 0;
+}
+
+static void log_sent(USART1_DMA_buffer_t* buffer){
+	(void)buffer;
+	// USART1_log() sends the buffer itself when it has finished copying
+	if(!log_writing) send_log();
+}
+
+// append <length> bytes to the log and return immediately, returns the number of bytes taken
+uint32_t USART1_log(const uint8_t* data_ptr, uint32_t length){
+	log_writing = true;
+	uint32_t space = USART1_LOG_BUFFER_SIZE - log_length;
+	if(length > space){
+		USART1_log_dropped += length - space;
+		length = space;
+	}
+	memcpy(&log_buffer[log_fill][log_length], data_ptr, length);
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	log_length += length;
+	log_writing = false;
+	if(log_tx.done) send_log();
+	__set_PRIMASK(primask);
+	return length;
+}
+
+/*	DMA receive
+ *
+ *	DMA1 channel 5 writes every received byte into the RX ring in circular mode,
+ *	so no byte is lost while the CPU is busy (e.g. with a flash operation) or
+ *	interrupts are disabled, even at 2Mbaud. The position of the DMA is turned
+ *	into the head of the ring at the half-transfer, transfer-complete and IDLE
+ *	(the line has been quiet for one byte time) interrupts, and whenever the
+ *	ring is read.
+ *	with a callback, the new bytes are passed to it from these interrupts: a long
+ *	packet arrives in pieces of up to half the ring, idle = true marks its end.
+ *	Without, the bytes are read as in the interrupt mode (USART1_read() etc.).
+ *	The DMA doesn't wait for the reader: USART1_read() skips bytes that have been
+ *	overwritten and counts them in USART1_rx_dropped.
+ */
+
+// move the head of the RX ring to the position of the DMA (with interrupts disabled)
+// it has to be called at least every half ring, which the half-transfer and transfer-complete interrupts ensure
+static void update_rx_head(void){
+	uint32_t position = USART1_RX_BUFFER_SIZE - DMA1_Channel5->CNDTR;
+	rx_head += (position - rx_head) & (USART1_RX_BUFFER_SIZE-1);
+}
+
+static void sync_rx_head(void){
+	if( !rx_dma || rx_callback ) return;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	update_rx_head();
+	__set_PRIMASK(primask);
+}
+
+// called from the DMA and the IDLE interrupt
+static void DMA_receive_update(bool idle){
+	if(!rx_dma) return;
+	update_rx_head();
+	if(!rx_callback) return;
+	// pass the new bytes on, in two pieces if they wrap around the end of the ring
+	uint32_t length = rx_head - rx_tail;
+	uint32_t index = rx_tail & (USART1_RX_BUFFER_SIZE-1);
+	if(index + length > USART1_RX_BUFFER_SIZE){
+		uint32_t first = USART1_RX_BUFFER_SIZE - index;
+		rx_callback(&rx_buffer[index], first, false);
+		index = 0;
+		length -= first;
+		rx_tail += first;
+	}
+	if( (length > 0) || idle ) rx_callback(&rx_buffer[index], length, idle);
+	rx_tail += length;
+}
+
+void DMA1_Channel5_IRQHandler(void){
+	DMA1->IFCR = DMA_IFCR_CGIF5;
+	DMA_receive_update(false);
+}
+
+/* receive into the RX ring with DMA1 channel 5 (switches to the interrupt mode, too)
+if <callback> isn't NULL, it gets the received bytes from the interrupts, otherwise they are read
+with USART1_read(), USART1_receive() etc. */
+void USART1_DMA_start_receive(void (*callback)(const uint8_t* data_ptr, uint16_t length, bool idle)){
+	USART1_start_IRQ();
+	USART1_DMA_stop_receive();
+	// enable DMA1 clock
+	RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	// the RXNE interrupt doesn't fill the ring anymore
+	USART1->CR1 &= ~USART_CR1_RXNEIE;
+	rx_callback = callback;
+	rx_head = 0;
+	rx_tail = 0;
+	// USART1 data register -> RX ring, circular, with a high priority (1 byte is lost if it comes too late)
+	DMA1_Channel5->CCR = 0;
+	DMA1->IFCR = DMA_IFCR_CGIF5;
+	DMA1_Channel5->CPAR = (uint32_t) (&(USART1->DR));
+	DMA1_Channel5->CMAR = (uint32_t) rx_buffer;
+	DMA1_Channel5->CNDTR = USART1_RX_BUFFER_SIZE;
+	DMA1_Channel5->CCR = (DMA_CCR_PL_1 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN);
+	// a byte received before is dropped
+	USART1->SR;
+	USART1->DR;
+	USART1->CR3 |= USART_CR3_DMAR;
+	USART1->CR1 |= USART_CR1_IDLEIE;
+	rx_dma = true;
+	__set_PRIMASK(primask);
+	NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+}
+
+// back to the RXNE interrupt, unread bytes are lost
+void USART1_DMA_stop_receive(void){
+	if(!rx_dma) return;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	NVIC_DisableIRQ(DMA1_Channel5_IRQn);
+	USART1->CR1 &= ~USART_CR1_IDLEIE;
+	USART1->CR3 &= ~USART_CR3_DMAR;
+	DMA1_Channel5->CCR = 0;
+	DMA1->IFCR = DMA_IFCR_CGIF5;
+	rx_dma = false;
+	rx_callback = NULL;
+	rx_head = 0;
+	rx_tail = 0;
+	if(irq_mode) USART1->CR1 |= USART_CR1_RXNEIE;
+	__set_PRIMASK(primask);
+}
+
+// switch to the interrupt mode: from now on the RXNE/TXE interrupts move the bytes
+void USART1_start_IRQ(void){
+	if(irq_mode) return;
+	rx_head = 0;
+	rx_tail = 0;
+	tx_head = 0;
+	tx_tail = 0;
+	// bytes received before are dropped
+	while ((USART1->SR) & USART_SR_RXNE){
+		USART1->DR;
+	}
+	irq_mode = true;
+	USART1->CR1 |= USART_CR1_RXNEIE;
+	NVIC_EnableIRQ(USART1_IRQn);
+}
+
+// back to polling mode, after the TX ring has been sent. Unread bytes of the RX ring are lost.
+void USART1_stop_IRQ(void){
+	if(!irq_mode) return;
+	USART1_DMA_stop_receive();
+	while( USART1_tx_busy() );
+	NVIC_DisableIRQ(USART1_IRQn);
+	USART1->CR1 &= ~(USART_CR1_RXNEIE | USART_CR1_TXEIE);
+	irq_mode = false;
+}
+
+void USART1_IRQHandler(void){
+	uint32_t status = USART1->SR;
+	// reading SR and then DR also clears an overrun error
+	// (not while the DMA reads the data register)
+	if( (USART1->CR1 & USART_CR1_RXNEIE) && (status & (USART_SR_RXNE | USART_SR_ORE)) ){
+		uint8_t data = (USART1->DR) & 0xFF;
+		if(status & USART_SR_ORE) USART1_rx_dropped++;
+		if( (uint32_t)(rx_head - rx_tail) < USART1_RX_BUFFER_SIZE ){
+			rx_buffer[rx_head & (USART1_RX_BUFFER_SIZE-1)] = data;
+			rx_head++;
+		}else{
+			USART1_rx_dropped++;
+		}
+	}
+	if( (USART1->CR1 & USART_CR1_TXEIE) && (status & USART_SR_TXE) ){
+		if(tx_tail != tx_head){
+			USART1->DR = tx_buffer[tx_tail & (USART1_TX_BUFFER_SIZE-1)];
+			tx_tail++;
+		}else{
+			// the ring is empty, USART1_write() enables the interrupt again
+			USART1->CR1 &= ~USART_CR1_TXEIE;
+			// the DMA queue has been waiting for the ring
+			if( !dma_running && (dma_head != dma_tail) ) start_DMA();
+		}
+	}
+	if( (USART1->CR1 & USART_CR1_IDLEIE) && (status & USART_SR_IDLE) ){
+		// reading SR and then DR clears the IDLE flag, the line is quiet, so there is no byte to lose
+		USART1->DR;
+		DMA_receive_update(true);
+	}
+}
+
+// number of received bytes waiting in the RX ring
+uint32_t USART1_available(void){
+	sync_rx_head();
+	return rx_head - rx_tail;
+}
+
+// copy up to <length> received bytes to <destination_ptr> without waiting, returns the number of bytes
+uint32_t USART1_read(uint8_t* destination_ptr, uint32_t length){
+	sync_rx_head();
+	uint32_t tail = rx_tail;
+	uint32_t available = rx_head - tail;
+	if(available > USART1_RX_BUFFER_SIZE){
+		// the DMA has overwritten the oldest bytes
+		USART1_rx_dropped += available - USART1_RX_BUFFER_SIZE;
+		tail = rx_head - USART1_RX_BUFFER_SIZE;
+		available = USART1_RX_BUFFER_SIZE;
+	}
+	// the bytes are read after the head
+	__DMB();
+	if(length > available) length = available;
+	uint32_t index = tail & (USART1_RX_BUFFER_SIZE-1);
+	uint32_t first = USART1_RX_BUFFER_SIZE - index;
+	if(first > length) first = length;
+	memcpy(destination_ptr, &rx_buffer[index], first);
+	memcpy(destination_ptr + first, rx_buffer, length - first);
+	__DMB();
+	rx_tail = tail + length;
+	return length;
+}
+
+// free space in the TX ring
+uint32_t USART1_write_space(void){
+	return USART1_TX_BUFFER_SIZE - (tx_head - tx_tail);
+}
+
+// copy up to <length> bytes into the TX ring without waiting, returns the number of bytes
+// (less than <length> if the ring is full). The TXE interrupt sends them.
+uint32_t USART1_write(const uint8_t* source_ptr, uint32_t length){
+	uint32_t head = tx_head;
+	uint32_t space = USART1_TX_BUFFER_SIZE - (head - tx_tail);
+	if(length > space) length = space;
+	if(length == 0) return 0;
+	uint32_t index = head & (USART1_TX_BUFFER_SIZE-1);
+	uint32_t first = USART1_TX_BUFFER_SIZE - index;
+	if(first > length) first = length;
+	memcpy(&tx_buffer[index], source_ptr, first);
+	memcpy(tx_buffer, source_ptr + first, length - first);
+	// the bytes have to be in the ring before the ISR sees the new head
+	__DMB();
+	tx_head = head + length;
+	// while the DMA queue is sending, its interrupt enables the TXE interrupt when it's done
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(dma_head == dma_tail) USART1->CR1 |= USART_CR1_TXEIE;
+	__set_PRIMASK(primask);
+	return length;
+}
+
+// check if bytes of the TX ring or the DMA queue are waiting or being sent
+bool USART1_tx_busy(void){
+	return (tx_head != tx_tail) || (dma_head != dma_tail) || !((USART1->SR) & USART_SR_TC);
+}
@@ -1,6 +1,6 @@
 /*
  * usart1.h
- *	simple functions for using USART1 in polling mode for serial communication
+ *	simple functions for using USART1 in polling or interrupt mode for serial communication
  *  Created on: 11.09.2018
  *      Author: marcel
  */
@@ -10,12 +10,63 @@
 
 #include "stm32f1xx.h"
 #include <string.h>
+#include <stdbool.h>
+
+/*	interrupt mode
+ *	after USART1_start_IRQ() the RXNE and TXE interrupts move the bytes between the data
+ *	register and two ring buffers. USART1_write() only copies into the TX ring and
+ *	USART1_read() only copies out of the RX ring, neither of them waits. USART1_receive(),
+ *	USART1_flush(), USART1_transmit() and USART1_transmitString() use the rings, too
+ *	(they only wait for a received byte or for space in the TX ring).
+ *	USART1_rx_dropped counts the bytes lost because the RX ring was full or the
+ *	interrupt came too late (overrun).
+ *	USART1_DMA_start_receive() lets DMA1 channel 5 fill the RX ring instead of the
+ *	RXNE interrupt, so nothing is lost at high baud rates (see usart1.c).
+ */
+#define USART1_RX_BUFFER_SIZE	2048	// must be a power of two
+#define USART1_TX_BUFFER_SIZE	1024	// must be a power of two
+
+extern volatile uint32_t USART1_rx_dropped;
+
+// DMA transmit with DMA1 channel 4 and receive with channel 5 (see usart1.c),
+// not available if SPI2 uses DMA (SPI2_USE_DMA)
+// size of the queue (it holds up to USART1_DMA_QUEUE_LENGTH-1 buffers), a power of two
+#define USART1_DMA_QUEUE_LENGTH	8
+// size of each of the two buffers of USART1_log()
+#define USART1_LOG_BUFFER_SIZE	256
+
+// one buffer to be sent
+typedef struct USART1_DMA_buffer {
+	const uint8_t* data_ptr;
+	uint16_t length;
+	// called from the DMA interrupt when the last byte has been moved into the data register, or NULL
+	void (*callback)(struct USART1_DMA_buffer* buffer);
+	void* context;				// free for the caller
+	volatile bool done;			// set when the buffer has been sent
+} USART1_DMA_buffer_t;
+
+extern volatile uint32_t USART1_log_dropped;
 
 void init_USART1(void);
+void USART1_set_baud_rate(uint32_t baud_rate);
 char USART1_receive(void);
 void USART1_receiveString(char* destination_str_ptr, uint32_t length);
 void USART1_flush(void);
 void USART1_transmit(char data);
 void USART1_transmitString(char* data_string);
+void USART1_DMA_transmit(const uint8_t* data_ptr, uint16_t length);
+bool USART1_DMA_busy(void);
+bool USART1_DMA_queue(USART1_DMA_buffer_t* buffer);
+bool USART1_DMA_queue_idle(void);
+uint32_t USART1_log(const uint8_t* data_ptr, uint32_t length);
+void USART1_start_IRQ(void);
+void USART1_stop_IRQ(void);
+uint32_t USART1_available(void);
+uint32_t USART1_read(uint8_t* destination_ptr, uint32_t length);
+uint32_t USART1_write_space(void);
+uint32_t USART1_write(const uint8_t* source_ptr, uint32_t length);
+bool USART1_tx_busy(void);
+void USART1_DMA_start_receive(void (*callback)(const uint8_t* data_ptr, uint16_t length, bool idle));
+void USART1_DMA_stop_receive(void);
 
 #endif /* USART1_H_ */